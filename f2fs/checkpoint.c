@@ -1638,6 +1638,8 @@ int f3fs_write_checkpoint(struct f3fs_sb_info *sbi, struct cp_control *cpc)
 
 	trace_f3fs_write_checkpoint(sbi->sb, cpc->reason, "finish block_ops");
 
+	f3fs_close_curseg_windows(sbi);
+	f3fs_flush_invalidations(sbi);
 	f3fs_flush_merged_writes(sbi);
 
 	/* this is the case of multiple fstrims without any changes */
@@ -283,6 +283,12 @@ static void f3fs_read_end_io2(struct bio* bio)
 
   bio_for_each_segment_all(bv, bio, iter_all) {
     struct page *page = bv->bv_page;
+
+    /* move_data_page2() must not write out what a failed read left */
+    if (bio->bi_status)
+      SetPageError(page);
+    else
+      SetPageUptodate(page);
     unlock_page(page);
   }
   bio_put(bio);
@@ -472,9 +478,10 @@ int f3fs_target_device_index(struct f3fs_sb_info *sbi, block_t blkaddr)
 
 static blk_opf_t f3fs_io_flags(struct f3fs_io_info *fio)
 {
-	unsigned long long temp_mask = ((unsigned long long)1 << NR_TEMP_TYPE) - 1;
+	unsigned long long temp_mask = (1 << (COLD + 1)) - 1;
 	unsigned long long fua_flag, meta_flag, io_flag;
 	blk_opf_t op_flags = 0;
+	enum temp_type temp = fio->temp;
 
 	if (fio->op != REQ_OP_WRITE)
 		return 0;
@@ -485,8 +492,14 @@ static blk_opf_t f3fs_io_flags(struct f3fs_io_info *fio)
 	else
 		return 0;
 
+	/* the GC and warm data logs share the bits of their temperature */
+	if (temp >= WARM_LOG_START)
+		temp = WARM;
+	else if (temp >= COLD_GC_START)
+		temp = COLD;
+
 	fua_flag = io_flag & temp_mask;
-	meta_flag = (io_flag >> NR_TEMP_TYPE) & temp_mask;
+	meta_flag = (io_flag >> (COLD + 1)) & temp_mask;
 
 	/*
 	 * data/node io flag bits per temp:
@@ -494,9 +507,9 @@ static blk_opf_t f3fs_io_flags(struct f3fs_io_info *fio)
 	 *    5 |    4 |   3 |    2 |    1 |   0 |
 	 * Cold | Warm | Hot | Cold | Warm | Hot |
 	 */
-	if ((1 << fio->temp) & meta_flag)
+	if ((1 << temp) & meta_flag)
 		op_flags |= REQ_META;
-	if ((1 << fio->temp) & fua_flag)
+	if ((1 << temp) & fua_flag)
 		op_flags |= REQ_FUA;
 	return op_flags;
 }
@@ -1438,83 +1451,46 @@ int f3fs_get_block(struct dnode_of_data *dn, pgoff_t index)
 	return f3fs_reserve_block(dn, index);
 }
 
-struct page *f3fs_get_read_data_page_without_cache(struct inode *inode, pgoff_t index,
-    blk_opf_t op_flags, bool for_write)
+/*
+ * Read the victim block @blkaddr of @inode's block @index into @page for GC.
+ * Physically contiguous blocks are added to the same bio, which is sent off
+ * when the next block does not continue it, or by the caller once it has no
+ * more blocks. @page stays locked until its read completes, which leaves
+ * it uptodate on success and with PG_error set otherwise.
+ */
+void f3fs_gc_read_block(struct inode *inode, pgoff_t index, block_t blkaddr,
+		struct page *page, struct bio **bio_ret, block_t *last_block_in_bio)
 {
-  struct dnode_of_data dn;
-  struct page *page;
-  int err;
-  struct f3fs_sb_info* sbi = F3FS_I_SB(inode);
-  struct block_device *bdev;
-  sector_t sector;
-  block_t blkaddr;
-  struct bio* bio;
-  struct extent_info ei = {0, };
-  struct page *cpage = NULL;
-  struct address_space *mapping = inode->i_mapping;
-  page = alloc_page(GFP_NOIO);
-
-  if (page == NULL) {
-    return NULL;
-  }
-  lock_page(page);
-
-  if (f3fs_lookup_extent_cache(inode, index, &ei)) {
-    dn.data_blkaddr = ei.blk + index - ei.fofs;
-    if (!f3fs_is_valid_blkaddr(F3FS_I_SB(inode), dn.data_blkaddr,
-          DATA_GENERIC_ENHANCE_READ)) {
-      err = -EFSCORRUPTED;
-      goto put_err;
-    }
-    goto got_it;
-  }
-
-  set_new_dnode(&dn, inode, NULL, NULL, 0);
-  err = f3fs_get_dnode_of_data(&dn, index, LOOKUP_NODE);
-  if (err)
-    goto put_err;
-  f3fs_put_dnode(&dn);
-
-got_it:
-  blkaddr = dn.data_blkaddr;
-/*  cpage = find_lock_page(mapping, index);
-  if (cpage) {
-    wait_on_page_writeback(cpage);
-    memcpy(page_address(page), page_address(cpage), 4096);
-    unlock_page(cpage);
-    put_page(cpage);
-    unlock_page(page);
-    return page;
-  }*/
-  bdev = f3fs_target_device(sbi, blkaddr, &sector);
-  bio = bio_alloc_bioset(bdev, 1, REQ_OP_READ, GFP_NOIO, &f3fs_bioset);
-  if (bio == NULL) {
-    goto put_err;
-  }
-  bio->bi_iter.bi_sector = sector;
-  f3fs_set_bio_crypt_ctx(bio, inode, index, NULL, GFP_NOFS);
-  bio->bi_end_io = f3fs_read_end_io2;
-  if (bio_add_page(bio, page, PAGE_SIZE, 0) < PAGE_SIZE) {
-    goto put_err;
-  }
-
-  atomic_inc(&F3FS_I_SB(inode)->gc_read_blocks);
-  submit_bio(bio);
-
-  return page;
+	struct f3fs_sb_info *sbi = F3FS_I_SB(inode);
+	struct bio *bio = *bio_ret;
+	struct block_device *bdev;
+	sector_t sector;
 
-put_err:
-  printk("%s %d daba_blkaddr %d bidx %ld err %d\n", __func__, __LINE__, dn.data_blkaddr, index, err);
-  if (bio) {
-    bio_put(bio);
-  }
+	lock_page(page);
+	/* arena pages still carry the state of the last victim's read */
+	ClearPageUptodate(page);
+	ClearPageError(page);
 
-  if (page) {
-    unlock_page(page);
-    __free_page(page);
-  }
+	if (bio && (!page_is_mergeable(sbi, bio, *last_block_in_bio, blkaddr) ||
+		    !f3fs_crypt_mergeable_bio(bio, inode, index, NULL))) {
+submit_and_realloc:
+		submit_bio(bio);
+		bio = NULL;
+	}
+	if (!bio) {
+		bdev = f3fs_target_device(sbi, blkaddr, &sector);
+		bio = bio_alloc_bioset(bdev, BIO_MAX_VECS, REQ_OP_READ,
+						GFP_NOIO, &f3fs_bioset);
+		bio->bi_iter.bi_sector = sector;
+		f3fs_set_bio_crypt_ctx(bio, inode, index, NULL, GFP_NOFS);
+		bio->bi_end_io = f3fs_read_end_io2;
+	}
+	if (bio_add_page(bio, page, PAGE_SIZE, 0) < PAGE_SIZE)
+		goto submit_and_realloc;
 
-  return NULL;
+	atomic_inc(&sbi->gc_read_blocks);
+	*last_block_in_bio = blkaddr;
+	*bio_ret = bio;
 }
 
 struct page *f3fs_get_read_data_page(struct inode *inode, pgoff_t index,
@@ -1730,6 +1706,8 @@ static int __allocate_data_block(struct dnode_of_data *dn, int seg_type)
 alloc:
 	set_summary(&sum, dn->nid, dn->ofs_in_node, ni.version);
 	old_blkaddr = dn->data_blkaddr;
+	if (seg_type == CURSEG_WARM_DATA)
+		seg_type = f3fs_warm_data_log(sbi);
 	f3fs_allocate_data_block2(sbi, NULL, old_blkaddr, &dn->data_blkaddr,
 				&sum, seg_type, NULL);
 	if (GET_SEGNO(sbi, old_blkaddr) != NULL_SEGNO) {
@@ -3289,6 +3267,166 @@ redirty_out:
 	return err;
 }
 
+/* Whether @page may be written by f3fs_write_data_page_run() */
+static bool f3fs_page_can_write_run(struct page *page,
+				struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	struct f3fs_sb_info *sbi = F3FS_I_SB(inode);
+
+	if (!S_ISREG(inode->i_mode) || IS_NOQUOTA(inode) || wbc->for_reclaim)
+		return false;
+	if (f3fs_is_atomic_file(inode) || f3fs_compressed_file(inode) ||
+			f3fs_has_inline_data(inode) || f3fs_is_drop_cache(inode) ||
+			f3fs_verity_in_progress(inode) ||
+			fscrypt_inode_uses_fs_layer_crypto(inode))
+		return false;
+	if (F3FS_IO_ALIGNED(sbi) || unlikely(f3fs_cp_error(sbi)) ||
+			is_sbi_flag_set(sbi, SBI_POR_DOING))
+		return false;
+
+	/* the page across i_size is zeroed by f3fs_write_single_data_page() */
+	return page->index < (i_size_read(inode) >> PAGE_SHIFT);
+}
+
+/*
+ * Called by f3fs_write_cache_pages() with pages[0] locked and cleared for
+ * I/O. Writes it out of place together with the dirty pages right after
+ * it in @pages that share its dnode: one dnode lookup, one f3fs_lock_op()
+ * and back to back blocks from f3fs_allocate_data_blocks() for the run.
+ * f3fs_lock_op() is taken with pages[0] locked, so the others are only
+ * trylocked. Returns how many pages were written; 0 leaves pages[0] to
+ * f3fs_write_single_data_page().
+ */
+static int f3fs_write_data_page_run(struct page **pages, int nr,
+				int *submitted, struct writeback_control *wbc,
+				enum iostat_type io_type)
+{
+	struct inode *inode = pages[0]->mapping->host;
+	struct f3fs_sb_info *sbi = F3FS_I_SB(inode);
+	struct f3fs_io_info *fio, *fios[F3FS_ONSTACK_PAGES];
+	struct dnode_of_data dn;
+	struct node_info ni;
+	loff_t psize;
+	int i, n = 0;
+
+	if (wbc->sync_mode == WB_SYNC_NONE)
+		nr = min_t(long, nr, wbc->nr_to_write);
+	if (nr < 2 || !f3fs_page_can_write_run(pages[0], wbc))
+		return 0;
+
+	fio = f3fs_kmalloc(sbi, sizeof(*fio) * nr, GFP_NOFS);
+	if (!fio)
+		return 0;
+
+	if (!f3fs_trylock_op(sbi))
+		goto out_free;
+
+	set_new_dnode(&dn, inode, NULL, NULL, 0);
+	if (f3fs_get_dnode_of_data(&dn, pages[0]->index, LOOKUP_NODE))
+		goto out_unlock;
+	if (f3fs_get_node_info(sbi, dn.nid, &ni, false))
+		goto out_put;
+
+	nr = min_t(int, nr, ADDRS_PER_PAGE(dn.node_page, inode) -
+							dn.ofs_in_node);
+	for (n = 0; n < nr; n++) {
+		struct page *page = pages[n];
+		block_t blkaddr;
+
+		if (n) {
+			if (page->index != pages[0]->index + n ||
+					!trylock_page(page))
+				break;
+			if (page->mapping != inode->i_mapping ||
+					!PageDirty(page) || PageWriteback(page) ||
+					!f3fs_page_can_write_run(page, wbc))
+				goto stop;
+		}
+
+		blkaddr = data_blkaddr(inode, dn.node_page,
+						dn.ofs_in_node + n);
+		fio[n] = (struct f3fs_io_info) {
+			.sbi = sbi,
+			.ino = inode->i_ino,
+			.type = DATA,
+			.op = REQ_OP_WRITE,
+			.op_flags = wbc_to_write_flags(wbc),
+			.old_blkaddr = blkaddr,
+			.page = page,
+			.need_lock = LOCK_REQ,
+			.post_read = f3fs_post_read_required(inode),
+			.io_type = io_type,
+			.io_wbc = wbc,
+			.version = ni.version,
+			.dst_hint = -1,
+		};
+
+		/* truncated pages and in-place updates go one by one */
+		if (blkaddr == NULL_ADDR)
+			goto stop;
+		if (__is_valid_data_blkaddr(blkaddr) &&
+			(!f3fs_is_valid_blkaddr(sbi, blkaddr,
+					DATA_GENERIC_ENHANCE) ||
+			 need_inplace_update(&fio[n])))
+			goto stop;
+
+		if (n)
+			clear_page_dirty_for_io(page);
+		fios[n] = &fio[n];
+		continue;
+stop:
+		if (n)
+			unlock_page(page);
+		break;
+	}
+	if (!n)
+		goto out_put;
+
+	for (i = 0; i < n; i++) {
+		trace_f3fs_writepage(pages[i], DATA);
+		atomic_add(1, &sbi->total_written_request_blocks);
+		set_page_writeback(pages[i]);
+		ClearPageError(pages[i]);
+	}
+
+	f3fs_outplace_write_data_run(&dn, fios, n);
+
+	for (i = 0; i < n; i++) {
+		trace_f3fs_do_write_data_page(pages[i], OPU);
+		*submitted += fio[i].submitted ? 1 : 0;
+	}
+	set_inode_flag(inode, FI_APPEND_WRITE);
+	if (pages[0]->index == 0)
+		set_inode_flag(inode, FI_FIRST_BLOCK_WRITTEN);
+out_put:
+	f3fs_put_dnode(&dn);
+out_unlock:
+	f3fs_unlock_op(sbi);
+out_free:
+	kfree(fio);
+	if (!n)
+		return 0;
+
+	psize = (loff_t)(pages[n - 1]->index + 1) << PAGE_SHIFT;
+	spin_lock(&F3FS_I(inode)->i_size_lock);
+	if (F3FS_I(inode)->last_disk_size < psize)
+		F3FS_I(inode)->last_disk_size = psize;
+	spin_unlock(&F3FS_I(inode)->i_size_lock);
+
+	for (i = 0; i < n; i++) {
+		inode_dec_dirty_pages(inode);
+		unlock_page(pages[i]);
+	}
+
+	if (!F3FS_I(inode)->cp_task)
+		f3fs_balance_fs(sbi, true);
+
+	if (unlikely(f3fs_cp_error(sbi)))
+		f3fs_submit_merged_write(sbi, DATA);
+	return n;
+}
+
 static int f3fs_write_data_page(struct page *page,
 					struct writeback_control *wbc)
 {
@@ -3351,6 +3489,7 @@ static int f3fs_write_cache_pages(struct address_space *mapping,
 	xa_mark_t tag;
 	int nwritten = 0;
 	int submitted = 0;
+	int nr_run;
 	int i;
 
 	if (get_dirty_pages(mapping->host) <=
@@ -3479,11 +3618,22 @@ continue_unlock:
 				continue;
 			}
 #endif
+			submitted = 0;
+			nr_run = f3fs_write_data_page_run(pages + i,
+					nr_pages - i, &submitted, wbc, io_type);
+			if (nr_run) {
+				/* the pages after @page went with it */
+				i += nr_run - 1;
+				ret = 0;
+				goto written;
+			}
+
 			ret = f3fs_write_single_data_page(page, &submitted,
 					&bio, &last_block, wbc, io_type,
 					0, true);
 			if (ret == AOP_WRITEPAGE_ACTIVATE)
 				unlock_page(page);
+written:
 #ifdef CONFIG_F3FS_FS_COMPRESSION
 result:
 #endif
@@ -3670,7 +3820,10 @@ void f3fs_write_failed(struct inode *inode, loff_t to)
 
 	/* In the fs-verity case, f3fs_end_enable_verity() does the truncate */
 	if (to > i_size && !f3fs_verity_in_progress(inode)) {
-		struct RangeLock* range = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE]);
+		struct RangeLock* range = f3fs_down_write_range3(
+				&F3FS_I(inode)->i_gc_rwsem[WRITE],
+				i_size >> PAGE_SHIFT, MAX_SIZE,
+				RL_SITE_TRUNCATE);
 		filemap_invalidate_lock(inode->i_mapping);
 
 		truncate_pagecache(inode, i_size);
@@ -4187,7 +4340,10 @@ static int f3fs_migrate_blocks(struct inode *inode, block_t start_blk,
 	unsigned int end_sec = secidx + blkcnt / blk_per_sec;
 	int ret = 0;
 
-	struct RangeLock* range = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE]);
+	struct RangeLock* range = f3fs_down_write_range3(
+			&F3FS_I(inode)->i_gc_rwsem[WRITE],
+			secidx * blk_per_sec, (end_sec - secidx) * blk_per_sec,
+			RL_SITE_OTHER);
 	filemap_invalidate_lock(inode->i_mapping);
 
 	set_inode_flag(inode, FI_ALIGNED_WRITE);
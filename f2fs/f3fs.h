@@ -109,6 +109,7 @@ extern const char *f3fs_fault_name[FAULT_MAX];
 #define F3FS_MOUNT_MERGE_CHECKPOINT	0x10000000
 #define	F3FS_MOUNT_GC_MERGE		0x20000000
 #define F3FS_MOUNT_COMPRESS_CACHE	0x40000000
+#define F3FS_MOUNT_RANGE_LOCK_FAIR	0x80000000
 
 #define F3FS_OPTION(sbi)	((sbi)->mount_opt)
 #define clear_opt(sbi, option)	(F3FS_OPTION(sbi).opt &= ~F3FS_MOUNT_##option)
@@ -163,6 +164,9 @@ struct f3fs_mount_info {
 	int fs_mode;			/* fs mode: LFS or ADAPTIVE */
 	int bggc_mode;			/* bggc mode: off, on or sync */
 	int memory_mode;		/* memory mode */
+	int range_lock_mode;		/* i_gc_rwsem backend */
+	unsigned int gc_max_workers;	/* GC worker threads to start */
+	unsigned int warm_data_logs;	/* logs warm data is spread over */
 	int discard_unit;		/*
 					 * discard command's offset/size should
 					 * be aligned to this unit: block,
@@ -1004,9 +1008,18 @@ static inline void set_new_dnode(struct dnode_of_data *dn, struct inode *inode,
  */
 
 #define MAX_GC_WORKER (58)
+
+/*
+ * The GC logs are split into GC_AGE_CLASSES groups of consecutive logs,
+ * youngest data first; see gc_dst_log().
+ */
+#define GC_AGE_CLASSES		(4)
+
+/* CURSEG_WARM_DATA plus the in-memory CURSEG_WARM_DATA_LOG_* logs */
+#define MAX_WARM_DATA_LOGS	(32)
 #define	NR_CURSEG_DATA_TYPE	(3 + MAX_GC_WORKER)
 #define NR_CURSEG_NODE_TYPE	(3)
-#define NR_CURSEG_INMEM_TYPE	(2)
+#define NR_CURSEG_INMEM_TYPE	(2 + MAX_GC_WORKER + MAX_WARM_DATA_LOGS - 1)
 #define NR_CURSEG_RO_TYPE	(2)
 #define NR_CURSEG_PERSIST_TYPE	(NR_CURSEG_DATA_TYPE + NR_CURSEG_NODE_TYPE)
 #define NR_CURSEG_TYPE		(NR_CURSEG_INMEM_TYPE + NR_CURSEG_PERSIST_TYPE)
@@ -1024,6 +1037,11 @@ enum {
 	CURSEG_COLD_DATA_PINNED = NR_PERSISTENT_LOG,
 				/* pinned file that needs consecutive block address */
 	CURSEG_ALL_DATA_ATGC,	/* SSR alloctor in hot/warm/cold data area */
+	CURSEG_COLD_GC_NODE_START,	/* node blocks migrated by GC workers */
+	CURSEG_COLD_GC_NODE_END = CURSEG_COLD_GC_NODE_START + MAX_GC_WORKER - 1,
+	CURSEG_WARM_DATA_LOG_START,	/* warm data written on other CPUs */
+	CURSEG_WARM_DATA_LOG_END = CURSEG_WARM_DATA_LOG_START +
+						MAX_WARM_DATA_LOGS - 2,
 	NO_CHECK_TYPE,		/* number of persistent & inmem log */
 };
 
@@ -1075,6 +1093,7 @@ struct f3fs_sm_info {
 	unsigned int min_seq_blocks;	/* threshold for sequential blocks */
 	unsigned int min_hot_blocks;	/* threshold for hot block allocation */
 	unsigned int min_ssr_sections;	/* threshold to trigger SSR allocation */
+	atomic_t open_inmem_logs;	/* GC node and warm data logs in use */
 
 	/* for flush command control */
 	struct flush_cmd_control *fcc_info;
@@ -1138,6 +1157,8 @@ enum temp_type {
 	COLD,
   COLD_GC_START,
   COLD_GC_END = COLD_GC_START + MAX_GC_WORKER - 1,
+	WARM_LOG_START,
+	WARM_LOG_END = WARM_LOG_START + MAX_WARM_DATA_LOGS - 2,
   NR_TEMP_TYPE,
 };
 
@@ -1290,6 +1311,21 @@ struct f3fs_gc_control {
 	bool err_gc_skipped;		/* return EAGAIN if GC skipped */
 	unsigned int nr_free_secs;	/* # of free sections to do GC */
   atomic_t freed;
+	struct f3fs_gc_request *req;	/* async request served, or NULL */
+};
+
+/*
+ * A GC round queued to the GC thread by f3fs_gc_submit(). Waiters are woken
+ * each time the round frees a section, and when it ends.
+ */
+struct f3fs_gc_request {
+	struct f3fs_gc_control gc_control;
+	struct list_head list;		/* in the GC thread's req_list */
+	refcount_t ref;			/* submitters and the GC thread */
+	bool cancel;			/* take no new victims */
+	bool done;
+	int ret;			/* of f3fs_gc(), once done */
+	wait_queue_head_t wq;
 };
 
 /* For s_flag in struct f3fs_sb_info */
@@ -1382,6 +1418,19 @@ enum {
 	MEMORY_MODE_LOW,	/* memory mode for low memry devices */
 };
 
+/* i_gc_rwsem trylock failures of GC on one block, in a row */
+#define GC_MISS_SLOTS		64
+struct gc_rwsem_miss {
+	nid_t ino;
+	block_t bidx;
+	unsigned int cnt;
+};
+
+enum {
+	RANGE_LOCK_LIST,	/* sorted lock-free lists */
+	RANGE_LOCK_SKIPLIST,	/* the same, writers indexed by a skip list */
+};
+
 
 
 static inline int f3fs_test_bit(unsigned int nr, char *addr);
@@ -1744,6 +1793,9 @@ struct f3fs_sb_info {
 	/* for skip statistic */
 	unsigned int atomic_files;		/* # of opened atomic file */
 	unsigned long long skipped_gc_rwsem;		/* FG_GC only */
+	unsigned int gc_rwsem_bypass;		/* failures before GC waits */
+	struct gc_rwsem_miss gc_miss[GC_MISS_SLOTS];	/* hashed by block */
+	struct rl_sem_stat __percpu *rl_stat;	/* i_gc_rwsem contention */
 
 	/* threshold for gc trials on pinned files */
 	u64 gc_pin_file_threshold;
@@ -1824,6 +1876,7 @@ struct f3fs_sb_info {
 	/* For reclaimed segs statistics per each GC mode */
 	unsigned int gc_segment_mode;		/* GC state for reclaimed segments */
 	unsigned int gc_reclaimed_segs[MAX_GC_MODE];	/* Reclaimed segs for each mode */
+	atomic_long_t gc_age_victims[GC_AGE_CLASSES];	/* data victims per age class */
 
 	unsigned long seq_file_ra_mul;		/* multiplier for ra_pages of seq. files in fadvise */
 
@@ -1870,8 +1923,10 @@ struct f3fs_sb_info {
   atomic_t total_written_direct_request_blocks;
   atomic_t gc_read_blocks;
   atomic_t gc_written_blocks;
-  int num_gc_thread;
-	struct mutex gc_internal_cp;		/* lock for segment bitmaps */
+	struct mutex gc_internal_cp;		/* one GC checkpoint at a time */
+	atomic64_t gc_cp_gen;			/* GC checkpoints started */
+	u64 gc_cp_done;				/* last one finished */
+	int gc_cp_ret;				/* and its result */
 };
 
 #ifdef CONFIG_F3FS_FAULT_INJECTION
@@ -2183,9 +2238,10 @@ static inline void f3fs_down_read2(struct f3fs_rwsem2 *sem)
   f3fs_down_range(sem, 0, MAX_SIZE, false);
 }
 
-static inline struct RangeLock* f3fs_down_read3(struct f3fs_rwsem3 *sem)
+static inline struct RangeLock* f3fs_down_read3(struct f3fs_rwsem3 *sem,
+  enum rl_site site)
 {
-  return RWRangeAcquire(&sem->list_rl, 0, MAX_SIZE, false);
+  return RWSemAcquire(sem, 0, MAX_SIZE, false, site);
 }
 static inline void f3fs_down_read(struct f3fs_rwsem *sem)
 {
@@ -2201,9 +2257,30 @@ static inline int f3fs_down_read_trylock2(struct f3fs_rwsem2 *sem)
 	return f3fs_down_range_trylock(sem, 0, MAX_SIZE, false);
 }
 
-static inline struct RangeLock* f3fs_down_read_trylock3(struct f3fs_rwsem3 *sem)
+static inline struct RangeLock* f3fs_down_read_trylock3(struct f3fs_rwsem3 *sem,
+  enum rl_site site)
+{
+  return RWSemTryAcquire(sem, 0, MAX_SIZE, false, site);
+}
+
+/*
+ * Range variants lock blocks [start, start + size); a size running past
+ * MAX_SIZE locks everything from start to the end of the file.
+ */
+static inline struct RangeLock* f3fs_down_read_range3(
+  struct f3fs_rwsem3 *sem, unsigned start, unsigned size,
+  enum rl_site site)
+{
+  return RWSemAcquire(sem, start,
+      (unsigned long long)start + size, false, site);
+}
+
+static inline struct RangeLock* f3fs_down_read_range_trylock3(
+  struct f3fs_rwsem3 *sem, unsigned start, unsigned size,
+  enum rl_site site)
 {
-  return RWRangeTryAcquire(&sem->list_rl, 0, MAX_SIZE, false);
+  return RWSemTryAcquire(sem, start,
+      (unsigned long long)start + size, false, site);
 }
 
 static inline int f3fs_down_read_trylock(struct f3fs_rwsem *sem)
@@ -2227,7 +2304,7 @@ static inline void f3fs_up_read2(struct f3fs_rwsem2 *sem)
 
 static inline void f3fs_up_read3(struct RangeLock* range)
 {
-  MutexRangeRelease(range);
+  RWSemRelease(range);
 }
 
 static inline void f3fs_up_read(struct f3fs_rwsem *sem)
@@ -2240,9 +2317,18 @@ static inline void f3fs_down_write2(struct f3fs_rwsem2 *sem)
   f3fs_down_range(sem, 0, MAX_SIZE, true);
 }
 
-static inline struct RangeLock* f3fs_down_write3(struct f3fs_rwsem3* sem)
+static inline struct RangeLock* f3fs_down_write3(struct f3fs_rwsem3* sem,
+  enum rl_site site)
 {
-  return RWRangeAcquire(&sem->list_rl, 0, MAX_SIZE, true);
+  return RWSemAcquire(sem, 0, MAX_SIZE, true, site);
+}
+
+static inline struct RangeLock* f3fs_down_write_range3(
+  struct f3fs_rwsem3 *sem, unsigned start, unsigned size,
+  enum rl_site site)
+{
+  return RWSemAcquire(sem, start,
+      (unsigned long long)start + size, true, site);
 }
 
 static inline void f3fs_down_write(struct f3fs_rwsem *sem)
@@ -2262,14 +2348,33 @@ static inline int f3fs_down_write_trylock2(struct f3fs_rwsem2 *sem)
 }
 
 static inline struct RangeLock* f3fs_down_write_range_trylock3(
-  struct f3fs_rwsem3 *sem, unsigned start, unsigned size)
+  struct f3fs_rwsem3 *sem, unsigned start, unsigned size,
+  enum rl_site site)
+{
+  return RWSemTryAcquire(sem, start,
+      (unsigned long long)start + size, true, site);
+}
+
+static inline struct RangeLock* f3fs_down_write_trylock3(struct f3fs_rwsem3 *sem,
+  enum rl_site site)
+{
+  return RWSemTryAcquire(sem, 0, MAX_SIZE, true, site);
+}
+
+static inline struct RangeLock* f3fs_down_write_range_timeout3(
+  struct f3fs_rwsem3 *sem, unsigned start, unsigned size, u64 timeout_ns,
+  enum rl_site site)
 {
-  return RWRangeTryAcquire(&sem->list_rl, start, start + size, true);
+  return RWSemAcquireTimeout(sem, start,
+      (unsigned long long)start + size, true, site, timeout_ns);
 }
 
-static inline struct RangeLock* f3fs_down_write_trylock3(struct f3fs_rwsem3 *sem)
+/* Single blocks at ascending offsets, see RWSemTryAcquireBatch() */
+static inline unsigned int f3fs_down_write_blocks_trylock3(
+  struct f3fs_rwsem3 *sem, const unsigned int *blocks, unsigned int nr,
+  enum rl_site site, struct RangeLock **ranges, bool *held)
 {
-  return RWRangeTryAcquire(&sem->list_rl, 0, MAX_SIZE, true);
+  return RWSemTryAcquireBatch(sem, blocks, nr, true, site, ranges, held);
 }
 
 static inline int f3fs_down_write_trylock(struct f3fs_rwsem *sem)
@@ -2290,13 +2395,19 @@ static inline void f3fs_up_write2(struct f3fs_rwsem2 *sem)
 
 static inline void f3fs_up_write_range3(struct RangeLock* range)
 {
-  MutexRangeRelease(range);
+  RWSemRelease(range);
 }
 
 
 static inline void f3fs_up_write3(struct RangeLock* range)
 {
-  MutexRangeRelease(range);
+  RWSemRelease(range);
+}
+
+static inline void f3fs_up_write_blocks3(struct RangeLock **ranges,
+  unsigned int nr)
+{
+  RWSemReleaseBatch(ranges, nr);
 }
 
 static inline void f3fs_up_write(struct f3fs_rwsem *sem)
@@ -3036,6 +3147,22 @@ static inline int f3fs_test_and_clear_bit(unsigned int nr, char *addr)
 	return ret;
 }
 
+/*
+ * Atomic f3fs_test_and_{set,clear}_bit() for the SIT bitmaps that lock-free
+ * block allocation sets without se->local_lock. f3fs counts bits from the
+ * top of each byte and the little-endian bitops from the bottom, so the low
+ * three bits of @nr are flipped. @addr must be long aligned.
+ */
+static inline int f3fs_test_and_set_bit_atomic(unsigned int nr, char *addr)
+{
+	return test_and_set_bit_le(nr ^ 7, addr);
+}
+
+static inline int f3fs_test_and_clear_bit_atomic(unsigned int nr, char *addr)
+{
+	return test_and_clear_bit_le(nr ^ 7, addr);
+}
+
 static inline void f3fs_change_bit(unsigned int nr, char *addr)
 {
 	int mask;
@@ -3161,15 +3288,27 @@ static inline void f3fs_i_blocks_write(struct inode *inode,
 		set_inode_flag(inode, FI_AUTO_RECOVER);
 }
 
+/* Sizes the i_gc_rwsem bucket tables for the current file size */
+static inline void f3fs_resize_gc_rwsem(struct inode *inode)
+{
+	unsigned long long blocks = DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE);
+
+	resize_f3fs_rwsem3(&F3FS_I(inode)->i_gc_rwsem[READ], blocks);
+	resize_f3fs_rwsem3(&F3FS_I(inode)->i_gc_rwsem[WRITE], blocks);
+}
+
 static inline void f3fs_i_size_write(struct inode *inode, loff_t i_size)
 {
 	bool clean = !is_inode_flag_set(inode, FI_DIRTY_INODE);
 	bool recover = is_inode_flag_set(inode, FI_AUTO_RECOVER);
+	bool grow = i_size > i_size_read(inode);
 
 	if (i_size_read(inode) == i_size)
 		return;
 
 	i_size_write(inode, i_size);
+	if (grow && S_ISREG(inode->i_mode))
+		f3fs_resize_gc_rwsem(inode);
 	f3fs_mark_inode_dirty_sync(inode, true);
 	if (clean || recover)
 		set_inode_flag(inode, FI_AUTO_RECOVER);
@@ -3687,7 +3826,7 @@ struct page *f3fs_new_node_page(struct dnode_of_data *dn, unsigned int ofs);
 void f3fs_ra_node_page(struct f3fs_sb_info *sbi, nid_t nid);
 struct page *f3fs_get_node_page(struct f3fs_sb_info *sbi, pgoff_t nid);
 struct page *f3fs_get_node_page_ra(struct page *parent, int start);
-int f3fs_move_node_page(struct page *node_page, int gc_type);
+int f3fs_move_node_page(struct page *node_page, int gc_type, char dst_hint);
 void f3fs_flush_inline_data(struct f3fs_sb_info *sbi);
 int f3fs_fsync_node_pages(struct f3fs_sb_info *sbi, struct inode *inode,
 			struct writeback_control *wbc, bool atomic,
@@ -3740,6 +3879,9 @@ int f3fs_npages_for_summary_flush(struct f3fs_sb_info *sbi, bool for_ra);
 bool f3fs_segment_has_free_slot(struct f3fs_sb_info *sbi, int segno);
 void f3fs_init_inmem_curseg(struct f3fs_sb_info *sbi);
 void f3fs_save_inmem_curseg(struct f3fs_sb_info *sbi);
+void f3fs_close_curseg_windows(struct f3fs_sb_info *sbi);
+void f3fs_release_free_secs(struct f3fs_sb_info *sbi);
+void f3fs_flush_invalidations(struct f3fs_sb_info *sbi);
 void f3fs_restore_inmem_curseg(struct f3fs_sb_info *sbi);
 void f3fs_get_new_segment(struct f3fs_sb_info *sbi,
 			unsigned int *newseg, bool new_sec, int dir);
@@ -3758,6 +3900,8 @@ void f3fs_do_write_meta_page(struct f3fs_sb_info *sbi, struct page *page,
 void f3fs_do_write_node_page(unsigned int nid, struct f3fs_io_info *fio);
 void f3fs_outplace_write_data(struct dnode_of_data *dn,
 			struct f3fs_io_info *fio);
+void f3fs_outplace_write_data_run(struct dnode_of_data *dn,
+			struct f3fs_io_info **fio, unsigned int nr);
 void f3fs_outplace_write_data2(struct dnode_of_data *dn,
 			struct f3fs_io_info *fio);
 int f3fs_inplace_write_data(struct f3fs_io_info *fio);
@@ -3773,6 +3917,9 @@ void f3fs_allocate_data_block2(struct f3fs_sb_info *sbi, struct page *page,
 			block_t old_blkaddr, block_t *new_blkaddr,
 			struct f3fs_summary *sum, int type,
 			struct f3fs_io_info *fio);
+unsigned int f3fs_allocate_data_blocks(struct f3fs_sb_info *sbi, int type,
+			struct f3fs_io_info **fio, struct f3fs_summary *sum,
+			unsigned int nr);
 void f3fs_update_device_state(struct f3fs_sb_info *sbi, nid_t ino,
 					block_t blkaddr, unsigned int blkcnt);
 void f3fs_wait_on_page_writeback(struct page *page,
@@ -3884,8 +4031,8 @@ int f3fs_get_block(struct dnode_of_data *dn, pgoff_t index);
 int f3fs_reserve_block(struct dnode_of_data *dn, pgoff_t index);
 struct page *f3fs_get_read_data_page(struct inode *inode, pgoff_t index,
 			blk_opf_t op_flags, bool for_write);
-struct page *f3fs_get_read_data_page_without_cache(struct inode *inode, pgoff_t index,
-			blk_opf_t op_flags, bool for_write);
+void f3fs_gc_read_block(struct inode *inode, pgoff_t index, block_t blkaddr,
+		struct page *page, struct bio **bio_ret, block_t *last_block_in_bio);
 struct page *f3fs_find_data_page(struct inode *inode, pgoff_t index);
 struct page *f3fs_get_lock_data_page(struct inode *inode, pgoff_t index,
 			bool for_write);
@@ -3924,6 +4071,11 @@ int f3fs_start_gc_thread(struct f3fs_sb_info *sbi);
 void f3fs_stop_gc_thread(struct f3fs_sb_info *sbi);
 block_t f3fs_start_bidx_of_node(unsigned int node_ofs, struct inode *inode);
 int f3fs_gc(struct f3fs_sb_info *sbi, struct f3fs_gc_control *gc_control);
+struct f3fs_gc_request *f3fs_gc_submit(struct f3fs_sb_info *sbi,
+			const struct f3fs_gc_control *gc_control);
+int f3fs_gc_wait(struct f3fs_gc_request *req, unsigned int nr_secs);
+void f3fs_gc_cancel(struct f3fs_gc_request *req);
+void f3fs_gc_put_request(struct f3fs_gc_request *req);
 void f3fs_build_gc_manager(struct f3fs_sb_info *sbi);
 int f3fs_resize_fs(struct f3fs_sb_info *sbi, __u64 block_count);
 int __init f3fs_create_garbage_collection_cache(void);
@@ -954,7 +954,10 @@ int f3fs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry,
 				return err;
 		}
 
-		range = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE]);
+		/* only blocks from the smaller of both sizes can change */
+		range = f3fs_down_write_range3(&F3FS_I(inode)->i_gc_rwsem[WRITE],
+				min_t(loff_t, old_size, attr->ia_size) >> PAGE_SHIFT,
+				MAX_SIZE, RL_SITE_TRUNCATE);
 		filemap_invalidate_lock(inode->i_mapping);
 
 		truncate_setsize(inode, attr->ia_size);
@@ -1109,7 +1112,9 @@ static int punch_hole(struct inode *inode, loff_t offset, loff_t len)
 			blk_start = (loff_t)pg_start << PAGE_SHIFT;
 			blk_end = (loff_t)pg_end << PAGE_SHIFT;
 
-			range = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE]);
+			range = f3fs_down_write_range3(&F3FS_I(inode)->i_gc_rwsem[WRITE],
+					pg_start, pg_end - pg_start,
+					RL_SITE_FALLOCATE);
 			filemap_invalidate_lock(inode->i_mapping);
 
 			truncate_pagecache_range(inode, blk_start, blk_end - 1);
@@ -1353,7 +1358,8 @@ static int f3fs_do_collapse(struct inode *inode, loff_t offset, loff_t len)
 	f3fs_balance_fs(sbi, true);
 
 	/* avoid gc operation during block exchange */
-	range = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE]);
+	range = f3fs_down_write_range3(&F3FS_I(inode)->i_gc_rwsem[WRITE],
+					start, MAX_SIZE, RL_SITE_FALLOCATE);
 	filemap_invalidate_lock(inode->i_mapping);
 
 	f3fs_lock_op(sbi);
@@ -1507,7 +1513,9 @@ static int f3fs_zero_range(struct inode *inode, loff_t offset, loff_t len,
 			pgoff_t end;
       struct RangeLock* range = NULL;
 
-			range = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE]);
+			range = f3fs_down_write_range3(&F3FS_I(inode)->i_gc_rwsem[WRITE],
+					index, pg_end - index,
+					RL_SITE_FALLOCATE);
 			filemap_invalidate_lock(mapping);
 
 			truncate_pagecache_range(inode,
@@ -1608,7 +1616,8 @@ static int f3fs_insert_range(struct inode *inode, loff_t offset, loff_t len)
 	idx = DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE);
 
 	/* avoid gc operation during block exchange */
-	range = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE]);
+	range = f3fs_down_write_range3(&F3FS_I(inode)->i_gc_rwsem[WRITE],
+					pg_start, MAX_SIZE, RL_SITE_FALLOCATE);
 	filemap_invalidate_lock(mapping);
 	truncate_pagecache(inode, offset);
 
@@ -2023,7 +2032,7 @@ static int f3fs_ioc_start_atomic_write(struct file *filp)
 	if (ret)
 		goto out;
 
-	range = f3fs_down_write3(&fi->i_gc_rwsem[WRITE]);
+	range = f3fs_down_write3(&fi->i_gc_rwsem[WRITE], RL_SITE_OTHER);
 
 	/*
 	 * Should wait end_io to count F3FS_WB_CP_DATA correctly by
@@ -2777,10 +2786,12 @@ static int f3fs_move_file_range(struct file *file_in, loff_t pos_in,
 
 	f3fs_balance_fs(sbi, true);
 
-	range_src = f3fs_down_write3(&F3FS_I(src)->i_gc_rwsem[WRITE]);
+	range_src = f3fs_down_write3(&F3FS_I(src)->i_gc_rwsem[WRITE],
+				RL_SITE_OTHER);
 	if (src != dst) {
 		ret = -EBUSY;
-    range_dst = f3fs_down_write_trylock3(&F3FS_I(dst)->i_gc_rwsem[WRITE]);
+    range_dst = f3fs_down_write_trylock3(&F3FS_I(dst)->i_gc_rwsem[WRITE],
+				RL_SITE_OTHER);
 		if (range_dst == NULL)
 			goto out_src;
 	}
@@ -3172,7 +3183,7 @@ int f3fs_precache_extents(struct inode *inode)
     struct RangeLock* range = NULL;
 		map.m_len = end - map.m_lblk;
 
-		range = f3fs_down_write3(&fi->i_gc_rwsem[WRITE]);
+		range = f3fs_down_write3(&fi->i_gc_rwsem[WRITE], RL_SITE_OTHER);
 		err = f3fs_map_blocks(inode, &map, 0, F3FS_GET_BLOCK_PRECACHE);
 		f3fs_up_write3(range);
 		if (err)
@@ -3420,7 +3431,8 @@ static int f3fs_release_compress_blocks(struct file *filp, unsigned long arg)
 	if (!atomic_read(&F3FS_I(inode)->i_compr_blocks))
 		goto out;
 
-	range = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE]);
+	range = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE],
+				RL_SITE_OTHER);
 	filemap_invalidate_lock(inode->i_mapping);
 
 	last_idx = DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE);
@@ -3574,7 +3586,8 @@ static int f3fs_reserve_compress_blocks(struct file *filp, unsigned long arg)
 		goto unlock_inode;
 	}
 
-	range = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE]);
+	range = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE],
+				RL_SITE_OTHER);
 	filemap_invalidate_lock(inode->i_mapping);
 
 	last_idx = DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE);
@@ -3730,7 +3743,8 @@ static int f3fs_sec_trim_file(struct file *filp, unsigned long arg)
 	if (ret)
 		goto err;
 
-	range_lock = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE]);
+	range_lock = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE],
+				RL_SITE_OTHER);
 	filemap_invalidate_lock(mapping);
 
 	ret = filemap_write_and_wait_range(mapping, range.start,
@@ -4241,6 +4255,8 @@ static ssize_t f3fs_dio_read_iter(struct kiocb *iocb, struct iov_iter *to)
 	struct f3fs_inode_info *fi = F3FS_I(inode);
 	const loff_t pos = iocb->ki_pos;
 	const size_t count = iov_iter_count(to);
+	const pgoff_t blk_start = pos >> PAGE_SHIFT;
+	const pgoff_t blk_len = DIV_ROUND_UP(pos + count, PAGE_SIZE) - blk_start;
 	struct iomap_dio *dio;
 	ssize_t ret;
   struct RangeLock* range = NULL;
@@ -4251,13 +4267,15 @@ static ssize_t f3fs_dio_read_iter(struct kiocb *iocb, struct iov_iter *to)
 	trace_f3fs_direct_IO_enter(inode, iocb, count, READ);
 
 	if (iocb->ki_flags & IOCB_NOWAIT) {
-		range = f3fs_down_read_trylock3(&fi->i_gc_rwsem[READ]);
+		range = f3fs_down_read_range_trylock3(&fi->i_gc_rwsem[READ],
+				blk_start, blk_len, RL_SITE_DIO_READ);
 		if (!range) {
 			ret = -EAGAIN;
 			goto out;
 		}
 	} else {
-		range = f3fs_down_read3(&fi->i_gc_rwsem[READ]);
+		range = f3fs_down_read_range3(&fi->i_gc_rwsem[READ],
+				blk_start, blk_len, RL_SITE_DIO_READ);
 	}
 
 	/*
@@ -4464,6 +4482,8 @@ static ssize_t f3fs_dio_write_iter(struct kiocb *iocb, struct iov_iter *from,
 	const bool do_opu = f3fs_lfs_mode(sbi);
 	const loff_t pos = iocb->ki_pos;
 	const ssize_t count = iov_iter_count(from);
+	const pgoff_t blk_start = pos >> PAGE_SHIFT;
+	const pgoff_t blk_len = DIV_ROUND_UP(pos + count, PAGE_SIZE) - blk_start;
 	unsigned int dio_flags;
 	struct iomap_dio *dio;
 	ssize_t ret;
@@ -4480,13 +4500,15 @@ static ssize_t f3fs_dio_write_iter(struct kiocb *iocb, struct iov_iter *from,
 			goto out;
 		}
 
-		range_w = f3fs_down_read_trylock3(&fi->i_gc_rwsem[WRITE]);
+		range_w = f3fs_down_read_range_trylock3(&fi->i_gc_rwsem[WRITE],
+				blk_start, blk_len, RL_SITE_DIO_WRITE);
 		if (!range_w) {
 			ret = -EAGAIN;
 			goto out;
 		}
 		if (do_opu) {
-       range_r = f3fs_down_read_trylock3(&fi->i_gc_rwsem[READ]);
+       range_r = f3fs_down_read_range_trylock3(&fi->i_gc_rwsem[READ],
+				blk_start, blk_len, RL_SITE_DIO_WRITE);
        if (!range_r) {
 			  f3fs_up_read3(range_w);
         ret = -EAGAIN;
@@ -4498,9 +4520,11 @@ static ssize_t f3fs_dio_write_iter(struct kiocb *iocb, struct iov_iter *from,
 		if (ret)
 			goto out;
 
-		range_w = f3fs_down_read3(&fi->i_gc_rwsem[WRITE]);
+		range_w = f3fs_down_read_range3(&fi->i_gc_rwsem[WRITE],
+				blk_start, blk_len, RL_SITE_DIO_WRITE);
 		if (do_opu)
-			range_r = f3fs_down_read3(&fi->i_gc_rwsem[READ]);
+			range_r = f3fs_down_read_range3(&fi->i_gc_rwsem[READ],
+					blk_start, blk_len, RL_SITE_DIO_WRITE);
 	}
 
 	/*
@@ -4650,7 +4674,10 @@ skip_write_trace:
 
 	/* Don't leave any preallocated blocks around past i_size. */
 	if (preallocated && i_size_read(inode) < target_size) {
-		struct RangeLock* range = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE]);
+		struct RangeLock* range = f3fs_down_write_range3(
+				&F3FS_I(inode)->i_gc_rwsem[WRITE],
+				i_size_read(inode) >> PAGE_SHIFT, MAX_SIZE,
+				RL_SITE_TRUNCATE);
 		filemap_invalidate_lock(inode->i_mapping);
 		if (!f3fs_truncate(inode))
 			file_dont_truncate(inode);
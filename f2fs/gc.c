@@ -15,6 +15,7 @@
 #include <linux/sched/signal.h>
 #include <linux/random.h>
 #include <linux/sched/mm.h>
+#include <linux/sort.h>
 
 #include "f3fs.h"
 #include "node.h"
@@ -28,12 +29,39 @@ static struct kmem_cache *victim_entry_slab;
 static unsigned int count_bits(const unsigned long *addr,
 				unsigned int offset, unsigned int len);
 
+static bool gc_has_request(struct f3fs_gc_kthread *gc_th)
+{
+	return !list_empty_careful(&gc_th->req_list);
+}
+
+static struct f3fs_gc_request *gc_pop_request(struct f3fs_gc_kthread *gc_th)
+{
+	struct f3fs_gc_request *req;
+
+	spin_lock(&gc_th->req_lock);
+	req = list_first_entry_or_null(&gc_th->req_list,
+					struct f3fs_gc_request, list);
+	if (req)
+		list_del_init(&req->list);
+	spin_unlock(&gc_th->req_lock);
+	return req;
+}
+
+/* Ends the round of @req and drops the GC thread's reference */
+static void gc_complete_request(struct f3fs_gc_request *req, int ret)
+{
+	req->ret = ret;
+	smp_store_release(&req->done, true);
+	wake_up_all(&req->wq);
+	f3fs_gc_put_request(req);
+}
+
 static int gc_thread_func(void *data)
 {
 	struct f3fs_sb_info *sbi = data;
 	struct f3fs_gc_kthread *gc_th = sbi->gc_thread;
 	wait_queue_head_t *wq = &sbi->gc_thread->gc_wait_queue_head;
-	wait_queue_head_t *fggc_wq = &sbi->gc_thread->fggc_wq;
+	struct f3fs_gc_request *req;
 	unsigned int wait_ms;
 	struct f3fs_gc_control gc_control = {
 		.victim_segno = NULL_SEGNO,
@@ -45,14 +73,15 @@ static int gc_thread_func(void *data)
 	set_freezable();
 	do {
 		bool sync_mode, foreground = false;
+		int ret;
 
 		wait_event_interruptible_timeout(*wq,
 				kthread_should_stop() || freezing(current) ||
-				waitqueue_active(fggc_wq) ||
+				gc_has_request(gc_th) ||
 				gc_th->gc_wake,
 				msecs_to_jiffies(wait_ms));
 
-		if (test_opt(sbi, GC_MERGE) && waitqueue_active(fggc_wq))
+		if (gc_has_request(gc_th))
 			foreground = true;
 
 		/* give it a try one time */
@@ -146,18 +175,22 @@ do_gc:
 			sync_mode = false;
 
 		gc_control.init_gc_type = sync_mode ? FG_GC : BG_GC;
-		gc_control.no_bg_gc = foreground;
-		gc_control.nr_free_secs = foreground ? 1 : 0;
+		gc_control.no_bg_gc = false;
+		gc_control.nr_free_secs = 0;
+
+		/* foreground GC was requested through f3fs_gc_submit() */
+		req = foreground ? gc_pop_request(gc_th) : NULL;
 
 		/* if return value is not zero, no victim was selected */
-		if (f3fs_gc(sbi, &gc_control)) {
+		ret = f3fs_gc(sbi, req ? &req->gc_control : &gc_control);
+		if (ret) {
 			/* don't bother wait_ms by foreground gc */
 			if (!foreground)
 				wait_ms = gc_th->no_gc_sleep_time;
 		}
 
-		if (foreground)
-			wake_up_all(&gc_th->fggc_wq);
+		if (req)
+			gc_complete_request(req, ret);
 
 		trace_f3fs_background_gc(sbi->sb, wait_ms,
 				prefree_segments(sbi), free_segments(sbi));
@@ -171,6 +204,63 @@ next:
 	return 0;
 }
 
+/* An arena of @nr pages on @node, plus a slot per block of a segment */
+static struct gc_page_arena *gc_arena_alloc(struct f3fs_sb_info *sbi,
+						unsigned int nr, int node)
+{
+	struct gc_page_arena *arena;
+
+	arena = kvzalloc_node(struct_size(arena, page, nr + sbi->blocks_per_seg),
+							GFP_NOFS, node);
+	if (!arena)
+		return NULL;
+
+	arena->batch = kvzalloc_node(sizeof(*arena->batch), GFP_NOFS, node);
+	if (!arena->batch) {
+		kvfree(arena);
+		return NULL;
+	}
+
+	arena->slot = &arena->page[nr];
+	for (arena->nr = 0; arena->nr < nr; arena->nr++) {
+		arena->page[arena->nr] = alloc_pages_node(node, GFP_NOFS, 0);
+		if (!arena->page[arena->nr])
+			break;
+	}
+	return arena;
+}
+
+/* Pages still under I/O are freed when their write completes */
+static void gc_arena_free(struct gc_page_arena *arena)
+{
+	unsigned int i;
+
+	if (!arena)
+		return;
+	for (i = 0; i < arena->nr; i++)
+		put_page(arena->page[i]);
+	kvfree(arena->batch);
+	kvfree(arena);
+}
+
+/* An idle page of @arena with a reference for the caller, or NULL */
+static struct page *gc_arena_get(struct gc_page_arena *arena)
+{
+	unsigned int i;
+
+	for (i = 0; i < arena->nr; i++) {
+		struct page *page = arena->page[arena->next];
+
+		if (++arena->next == arena->nr)
+			arena->next = 0;
+		if (page_count(page) == 1) {
+			get_page(page);
+			return page;
+		}
+	}
+	return NULL;
+}
+
 static int gc_worker_func(void* data)
 {
   struct worker_arg* worker_arg = (struct worker_arg*)data;
@@ -180,11 +270,25 @@ static int gc_worker_func(void* data)
         msecs_to_jiffies(300));
 
     if (worker_arg->state == 1) {
-      worker_arg->ret = do_gc(worker_arg->sbi, worker_arg->gc_control, worker_arg->idx, worker_arg->multiple_victim);
+      struct f3fs_gc_kthread *gc_th = worker_arg->gc_th;
+      u64 start = ktime_get_ns();
+
+      /* allocated here so that the pages are local to this worker */
+      if (!worker_arg->arena)
+        worker_arg->arena = gc_arena_alloc(worker_arg->sbi,
+            worker_arg->sbi->blocks_per_seg, numa_node_id());
+      worker_arg->ret = do_gc(worker_arg->sbi, worker_arg->gc_control,
+          worker_arg->idx, &gc_th->victim_pool, worker_arg->arena);
+      worker_arg->last_ns = ktime_get_ns() - start;
+      worker_arg->busy_ns += worker_arg->last_ns;
+      worker_arg->runs++;
       worker_arg->state = 0;
-      wake_up(&worker_arg->caller_wq);
+      if (atomic_dec_and_test(&gc_th->busy_workers))
+        wake_up(&gc_th->done_wq);
     }
   }
+  gc_arena_free(worker_arg->arena);
+  worker_arg->arena = NULL;
   return 0;
 }
 
@@ -193,7 +297,7 @@ int f3fs_start_gc_thread(struct f3fs_sb_info *sbi)
 	struct f3fs_gc_kthread *gc_th;
 	dev_t dev = sbi->sb->s_bdev->bd_dev;
 	int err = 0;
-  int num_gc_thread = sbi->num_gc_thread;
+  int num_gc_thread = F3FS_OPTION(sbi).gc_max_workers;
 
 	gc_th = f3fs_kmalloc(sbi, sizeof(struct f3fs_gc_kthread), GFP_KERNEL);
 	if (!gc_th) {
@@ -227,18 +331,34 @@ int f3fs_start_gc_thread(struct f3fs_sb_info *sbi)
 
 	sbi->gc_thread = gc_th;
 	init_waitqueue_head(&sbi->gc_thread->gc_wait_queue_head);
-	init_waitqueue_head(&sbi->gc_thread->fggc_wq);
+	spin_lock_init(&gc_th->req_lock);
+	INIT_LIST_HEAD(&gc_th->req_list);
+	init_waitqueue_head(&gc_th->done_wq);
+	atomic_set(&gc_th->busy_workers, 0);
+	spin_lock_init(&gc_th->victim_pool.lock);
+	mutex_init(&gc_th->victim_pool.refill_lock);
+	gc_th->victim_pool.nr = 0;
+	gc_th->victim_pool.next = 0;
+	gc_th->victim_pool.gen = 0;
+	gc_th->nr_workers = num_gc_thread;
+	gc_th->max_workers = num_gc_thread;
+	gc_th->nr_active = 0;
+	gc_th->worker_rate = 0;
+	gc_th->last_fg_blocks = total_written_request_blocks(sbi);
+	gc_th->last_jiffies = jiffies;
+	gc_th->start_ns = ktime_get_ns();
   for (int i = 0 ; i < num_gc_thread ; i++) {
     sbi->gc_thread->worker_args[i].state = 0;
+    sbi->gc_thread->worker_args[i].busy_ns = 0;
+    sbi->gc_thread->worker_args[i].last_ns = 0;
+    sbi->gc_thread->worker_args[i].runs = 0;
+    sbi->gc_thread->worker_args[i].arena = NULL;
     sbi->gc_thread->worker_args[i].sbi = sbi;
+    sbi->gc_thread->worker_args[i].gc_th = gc_th;
     sbi->gc_thread->worker_args[i].gc_control = NULL;
     sbi->gc_thread->worker_args[i].idx = i;
-    for (int j = 0 ; j < VICTIM_COUNT ; j++) {
-      sbi->gc_thread->worker_args[i].multiple_victim[j] = NULL_SEGNO;
-    }
 
     init_waitqueue_head(&sbi->gc_thread->worker_args[i].wq);
-    init_waitqueue_head(&sbi->gc_thread->worker_args[i].caller_wq);
     sbi->gc_thread->gc_workers[i] = kthread_run(
       gc_worker_func,
       &sbi->gc_thread->worker_args[i],
@@ -258,17 +378,19 @@ out:
 void f3fs_stop_gc_thread(struct f3fs_sb_info *sbi)
 {
 	struct f3fs_gc_kthread *gc_th = sbi->gc_thread;
+	struct f3fs_gc_request *req;
 
 	if (!gc_th)
 		return;
 
 	sbi->gc_thread = NULL;
 	kthread_stop(gc_th->f3fs_gc_task);
-  for (int i = 0 ; i < sbi->num_gc_thread ; i++) {
+  for (int i = 0 ; i < gc_th->nr_workers ; i++) {
     kthread_stop(gc_th->gc_workers[i]);
   }
 
-	wake_up_all(&gc_th->fggc_wq);
+	while ((req = gc_pop_request(gc_th)))
+		gc_complete_request(req, -ESRCH);
   kfree(gc_th->gc_workers);
   kfree(gc_th->worker_args);
 	kfree(gc_th);
@@ -974,37 +1096,123 @@ out:
 	return ret;
 }
 
-static unsigned int get_local_max(unsigned int* selected, int count, int* max_idx) {
-  unsigned int local_max = 0;
-  for (int i = 0 ; i < VICTIM_COUNT ; i++) {
-    if (local_max < selected[i]) {
-      local_max = selected[i];
-      *max_idx = i;
-    }
-  }
+/* Index of the most expensive of @nr picked victims */
+static unsigned int gc_victim_max(struct gc_victim *victim, unsigned int nr)
+{
+	unsigned int i, max = 0;
+
+	for (i = 1; i < nr; i++)
+		if (victim[i].cost > victim[max].cost)
+			max = i;
+	return max;
+}
+
+/* Lowest cost any segment in bucket @b of the dirty index can have */
+static unsigned long dirty_index_min_cost(struct f3fs_sb_info *sbi,
+				struct victim_sel_policy *p, unsigned int b)
+{
+	unsigned int u;
+
+	if (p->gc_mode == GC_GREEDY)
+		return b << DIRTY_I(sbi)->index.shift;
+
+	/* best case for cost-benefit: fewest valid blocks and oldest mtime */
+	u = ((b << DIRTY_I(sbi)->index.shift) * 100) >> sbi->log_blocks_per_seg;
+	return UINT_MAX - ((100 * (100 - u) * 100) / (100 + u));
+}
+
+/*
+ * Pick up to @count victims by walking the dirty index cheapest bucket
+ * first. Buckets only bound the cost from below, so keep walking until
+ * the next bucket cannot beat the worst victim picked so far. Greedy
+ * stops once @count are picked, as costs within a bucket differ by less
+ * than one bucket width.
+ *
+ * Each bucket is copied to di->snap under its lock and costed after
+ * dropping it, so writers moving segments between buckets only wait for
+ * the copy. Caller holds seglist_lock, which also guards di->snap.
+ */
+static unsigned int get_victims_from_index(struct f3fs_sb_info *sbi,
+			struct victim_sel_policy *p, struct gc_victim *result,
+			unsigned int count, int gc_type)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	struct dirty_index *di = &dirty_i->index;
+	unsigned int nr = 0, max_idx = 0, nsearched = 0;
+	unsigned int b, i, nr_snap, segno, secno;
+	unsigned long cost;
+
+	for (b = 0; b < DIRTY_INDEX_BUCKETS; b++) {
+		if (nsearched >= p->max_search)
+			break;
+		if (nr == count && (p->gc_mode == GC_GREEDY ||
+			result[max_idx].cost <= dirty_index_min_cost(sbi, p, b)))
+			break;
+
+		nr_snap = 0;
+		spin_lock(&di->lock[b]);
+		for (segno = di->head[b]; segno != NULL_SEGNO &&
+				nsearched + nr_snap < p->max_search;
+						segno = di->next[segno])
+			di->snap[nr_snap++] = segno;
+		spin_unlock(&di->lock[b]);
+		nsearched += nr_snap;
+
+		for (i = 0; i < nr_snap; i++) {
+			segno = di->snap[i];
+
+			if (!test_bit(segno, p->dirty_bitmap))
+				continue;
+
+			secno = GET_SEC_FROM_SEG(sbi, segno);
+			if (sec_usage_check(sbi, secno))
+				continue;
+			if (test_bit(secno, dirty_i->victim_secmap))
+				continue;
+			if (gc_type == FG_GC &&
+					f3fs_section_is_pinned(dirty_i, secno))
+				continue;
 
-  return local_max;
+			cost = get_gc_cost(sbi, segno, p);
+			if (nr < count) {
+				result[nr].segno = segno;
+				result[nr].cost = cost;
+				if (++nr == count) {
+					max_idx = gc_victim_max(result, nr);
+					if (p->gc_mode == GC_GREEDY)
+						goto out;
+				}
+			} else if (cost < result[max_idx].cost) {
+				result[max_idx].segno = segno;
+				result[max_idx].cost = cost;
+				max_idx = gc_victim_max(result, nr);
+			}
+		}
+	}
+out:
+	return nr;
 }
 
+/*
+ * Picks up to @count of the cheapest victims, from the dirty index when
+ * the policy allows, otherwise in one walk of the dirty bitmap bounded
+ * by max_search like get_victim_by_default(), and marks them in
+ * victim_secmap. Returns how many were picked, or -ENODATA.
+ */
 static int get_multiple_victim_by_default(struct f3fs_sb_info *sbi,
-			unsigned int *result, int gc_type, int type,
-			char alloc_mode, unsigned long long age)
+			struct gc_victim *result, unsigned int count,
+			int gc_type, int type, char alloc_mode,
+			unsigned long long age)
 {
-  // last_victim
 	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
 	struct sit_info *sm = SIT_I(sbi);
 	struct victim_sel_policy p;
 	unsigned int secno, last_victim;
 	unsigned int last_segment;
 	unsigned int nsearched;
-	bool is_atgc;
-	int ret = 0;
-  unsigned int local_max = 0;
-  int local_max_idx = 0;
-  unsigned int selected_cost[VICTIM_COUNT] = {0,};
-  int selected_count = 0;
-  bool changed = false;
+	unsigned int nr = 0, max_idx = 0;
 
+	mutex_lock(&dirty_i->seglist_lock);
 	last_segment = MAIN_SECS(sbi) * sbi->segs_per_sec;
 
 	p.alloc_mode = alloc_mode;
@@ -1016,14 +1224,18 @@ static int get_multiple_victim_by_default(struct f3fs_sb_info *sbi,
 	p.oldest_age = 0;
 	p.min_cost = get_max_cost(sbi, &p);
 
-	is_atgc = (p.gc_mode == GC_AT || p.alloc_mode == AT_SSR);
-  f3fs_bug_on(sbi, is_atgc);
+	f3fs_bug_on(sbi, p.gc_mode == GC_AT || p.alloc_mode == AT_SSR);
 	nsearched = 0;
 
-	ret = -ENODATA;
 	if (p.max_search == 0)
 		goto out;
 
+	if (dirty_i->index.bucket && p.alloc_mode == LFS &&
+		(p.gc_mode == GC_GREEDY || p.gc_mode == GC_CB)) {
+		nr = get_victims_from_index(sbi, &p, result, count, gc_type);
+		goto out;
+	}
+
 	last_victim = sm->last_victim[p.gc_mode];
 
 	while (1) {
@@ -1061,28 +1273,16 @@ static int get_multiple_victim_by_default(struct f3fs_sb_info *sbi,
 			goto next;
 
 		cost = get_gc_cost(sbi, segno, &p);
-    changed = false;
-    if (selected_count < VICTIM_COUNT) {
-      if (!test_and_set_bit(segno, dirty_i->victim_secmap)) {
-        clear_bit(result[selected_count], dirty_i->victim_secmap);
-        result[selected_count] = segno;
-        selected_cost[selected_count] = cost;
-        selected_count++;
-        changed = true;
-      }
-    } else if (local_max > cost) {
-      if (!test_and_set_bit(segno, dirty_i->victim_secmap)) {
-        clear_bit(result[local_max_idx], dirty_i->victim_secmap);
-        result[local_max_idx] = segno;
-        selected_cost[local_max_idx] = cost;
-        changed = true;
-      }
-    }
-
-    if (changed) {
-      local_max = get_local_max(selected_cost, selected_count, &local_max_idx);
-      ret = 0;
-    }
+		if (nr < count) {
+			result[nr].segno = segno;
+			result[nr].cost = cost;
+			if (++nr == count)
+				max_idx = gc_victim_max(result, nr);
+		} else if (cost < result[max_idx].cost) {
+			result[max_idx].segno = segno;
+			result[max_idx].cost = cost;
+			max_idx = gc_victim_max(result, nr);
+		}
 
 next:
 		if (nsearched >= p.max_search) {
@@ -1098,16 +1298,12 @@ next:
 	}
 
 out:
-  for (int i = 0 ; i < selected_count ; i++) {
-    set_bit(result[i], dirty_i->victim_secmap);
-  }
-
-	if (p.min_segno != NULL_SEGNO)
-		trace_f3fs_get_victim(sbi->sb, type, gc_type, &p,
-				sbi->cur_victim_sec,
-				prefree_segments(sbi), free_segments(sbi));
+	for (unsigned int i = 0; i < nr; i++)
+		set_bit(GET_SEC_FROM_SEG(sbi, result[i].segno),
+					dirty_i->victim_secmap);
+	mutex_unlock(&dirty_i->seglist_lock);
 
-	return ret;
+	return nr ? nr : -ENODATA;
 }
 
 static const struct victim_selection default_v_ops = {
@@ -1173,7 +1369,8 @@ static int check_valid_map(struct f3fs_sb_info *sbi,
  * ignore that.
  */
 static int gc_node_segment(struct f3fs_sb_info *sbi,
-		struct f3fs_summary *sum, unsigned int segno, int gc_type)
+		struct f3fs_summary *sum, unsigned int segno, int gc_type,
+		char dst_hint)
 {
 	struct f3fs_summary *entry;
 	block_t start_addr;
@@ -1236,8 +1433,8 @@ next_step:
 			continue;
 		}
 
-		err = f3fs_move_node_page(node_page, gc_type);
-		if (!err && gc_type == FG_GC)
+		err = f3fs_move_node_page(node_page, gc_type, dst_hint);
+		if (!err && (gc_type == FG_GC || dst_hint >= 0))
 			submitted++;
 		stat_inc_node_blk_count(sbi, 1, gc_type);
 	}
@@ -1627,6 +1824,12 @@ static int move_data_page2(struct inode *inode, block_t bidx, int gc_type,
     return err;
   }
   lock_page(gc_buf);
+  /* the read failed, let the caller go through the page cache instead */
+  if (!PageUptodate(gc_buf)) {
+    unlock_page(gc_buf);
+    __free_page(gc_buf);
+    return -EIO;
+  }
 retry:
 
   err = f3fs_do_write_data_page2(&fio, bidx);
@@ -1707,6 +1910,201 @@ out:
 	return err;
 }
 
+/*
+ * GC log for the blocks of data victim @segno collected by worker
+ * @worker_idx. The age class comes from the segment's mtime within the
+ * range seen so far. Blocks found in a GC log go at least one class colder
+ * than that log, so data that keeps surviving GC sinks to the coldest logs
+ * instead of being mixed again with younger data. Within a class, workers
+ * spread over its logs.
+ */
+static unsigned int gc_class_first_log(unsigned int class)
+{
+	return class * MAX_GC_WORKER / GC_AGE_CLASSES;
+}
+
+static char gc_dst_log(struct f3fs_sb_info *sbi, unsigned int segno,
+			char worker_idx)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	struct seg_entry *se = get_seg_entry(sbi, segno);
+	unsigned long long max_mtime = atomic64_read(&sit_i->max_mtime);
+	unsigned int class = 0, first, nr;
+
+	if (worker_idx < 0)
+		return worker_idx;
+
+	if (max_mtime > sit_i->min_mtime && se->mtime < max_mtime)
+		class = div64_u64((max_mtime - max(se->mtime, sit_i->min_mtime)) *
+				GC_AGE_CLASSES, max_mtime - sit_i->min_mtime + 1);
+
+	if (se->type >= CURSEG_COLD_GC_DATA_START &&
+			se->type <= CURSEG_COLD_GC_DATA_END) {
+		unsigned int src = GC_AGE_CLASSES - 1;
+
+		while (gc_class_first_log(src) >
+				se->type - CURSEG_COLD_GC_DATA_START)
+			src--;
+		class = max(class, src + 1);
+	}
+
+	class = min(class, GC_AGE_CLASSES - 1);
+	atomic_long_inc(&sbi->gc_age_victims[class]);
+
+	/* classes split all MAX_GC_WORKER logs, the last ones included */
+	first = gc_class_first_log(class);
+	nr = gc_class_first_log(class + 1) - first;
+	return first + worker_idx % nr;
+}
+
+static void gc_unlock_batch(struct gc_lock_batch *b)
+{
+	unsigned int i;
+
+	if (b->bypass_w) {
+		f3fs_up_write_range3(b->bypass_r);
+		f3fs_up_write_range3(b->bypass_w);
+		b->bypass_w = NULL;
+		b->bypass_r = NULL;
+	}
+	f3fs_up_write_blocks3(b->range_w, b->nr_w);
+	f3fs_up_write_blocks3(b->range_r, b->nr);
+	for (i = 0; i < b->nr; i++) {
+		b->batched[b->off[i]] = false;
+		b->held[b->off[i]] = false;
+	}
+	b->cur_ino = 0;
+	b->nr = 0;
+	b->nr_w = 0;
+}
+
+/* Locks the blocks @inode owns at offsets @first..@nr_off - 1 */
+static void gc_lock_batch(struct inode *inode, struct gc_lock_batch *b,
+				unsigned int first, unsigned int nr_off)
+{
+	struct f3fs_inode_info *fi = F3FS_I(inode);
+	unsigned int i, j, off;
+
+	gc_unlock_batch(b);
+	b->cur_ino = inode->i_ino;
+
+	/* mostly in order already, so insertion sort is about linear */
+	for (off = first; off < nr_off; off++) {
+		if (b->ino[off] != inode->i_ino)
+			continue;
+		for (i = b->nr; i > 0 && b->bidx[b->off[i - 1]] > b->bidx[off];
+									i--)
+			b->off[i] = b->off[i - 1];
+		b->off[i] = off;
+		b->nr++;
+	}
+
+	/* a stale summary may repeat a block, lock it for one offset only */
+	for (i = 0, j = 0; i < b->nr; i++) {
+		if (j && b->bidx[b->off[i]] == b->blocks[j - 1])
+			continue;
+		b->off[j] = b->off[i];
+		b->blocks[j] = b->bidx[b->off[i]];
+		b->batched[b->off[j]] = true;
+		j++;
+	}
+	b->nr = j;
+
+	if (!f3fs_down_write_blocks_trylock3(&fi->i_gc_rwsem[READ], b->blocks,
+			b->nr, RL_SITE_GC_PHASE4, b->range_r, b->held_r))
+		return;
+
+	for (i = 0; i < b->nr; i++)
+		if (b->held_r[i])
+			b->wblocks[b->nr_w++] = b->blocks[i];
+
+	if (!f3fs_down_write_blocks_trylock3(&fi->i_gc_rwsem[WRITE],
+			b->wblocks, b->nr_w, RL_SITE_GC_PHASE4, b->range_w,
+			b->held_w))
+		return;
+
+	for (i = 0, j = 0; i < b->nr; i++)
+		if (b->held_r[i])
+			b->held[b->off[i]] = b->held_w[j++];
+
+	/* wait for all inflight aio data */
+	inode_dio_wait(inode);
+}
+
+static struct gc_rwsem_miss *gc_miss_slot(struct f3fs_sb_info *sbi,
+				struct inode *inode, block_t bidx)
+{
+	return &sbi->gc_miss[hash_32(inode->i_ino ^ bidx * 31,
+						ilog2(GC_MISS_SLOTS))];
+}
+
+/*
+ * Counts a failed i_gc_rwsem trylock on block @bidx of @inode. Returns true
+ * once the same block failed gc_rwsem_bypass times in a row, so that GC
+ * waits for it for a while rather than losing to foreground users forever.
+ * Racing GC threads and slot collisions only blur the counts, which are a
+ * heuristic anyway.
+ */
+static bool gc_rwsem_miss(struct f3fs_sb_info *sbi, struct inode *inode,
+							block_t bidx)
+{
+	struct gc_rwsem_miss *miss;
+
+	if (!sbi->gc_rwsem_bypass)
+		return false;
+
+	miss = gc_miss_slot(sbi, inode, bidx);
+	if (miss->ino != inode->i_ino || miss->bidx != bidx) {
+		miss->ino = inode->i_ino;
+		miss->bidx = bidx;
+		miss->cnt = 0;
+	}
+	if (++miss->cnt < sbi->gc_rwsem_bypass)
+		return false;
+	miss->cnt = 0;
+	return true;
+}
+
+/* A block phase 4 did lock starts counting its failures over */
+static void gc_rwsem_hit(struct f3fs_sb_info *sbi, struct inode *inode,
+							block_t bidx)
+{
+	struct gc_rwsem_miss *miss = gc_miss_slot(sbi, inode, bidx);
+
+	if (miss->cnt && miss->ino == inode->i_ino && miss->bidx == bidx)
+		miss->cnt = 0;
+}
+
+/*
+ * Drops the batch and waits a bounded time for block @bidx alone. Takes
+ * i_gc_rwsem[WRITE] before i_gc_rwsem[READ], the order direct writes use,
+ * so the two waits cannot deadlock with them.
+ */
+static bool gc_lock_bypass(struct inode *inode, struct gc_lock_batch *b,
+							block_t bidx)
+{
+	struct f3fs_inode_info *fi = F3FS_I(inode);
+
+	gc_unlock_batch(b);
+
+	b->bypass_w = f3fs_down_write_range_timeout3(&fi->i_gc_rwsem[WRITE],
+			bidx, 1, DEF_GC_RWSEM_BYPASS_WAIT, RL_SITE_GC_PHASE4);
+	if (!b->bypass_w)
+		return false;
+
+	b->bypass_r = f3fs_down_write_range_timeout3(&fi->i_gc_rwsem[READ],
+			bidx, 1, DEF_GC_RWSEM_BYPASS_WAIT, RL_SITE_GC_PHASE4);
+	if (!b->bypass_r) {
+		f3fs_up_write_range3(b->bypass_w);
+		b->bypass_w = NULL;
+		return false;
+	}
+
+	/* wait for all inflight aio data */
+	inode_dio_wait(inode);
+	return true;
+}
+
 /*
  * This function tries to get parent node of victim data block, and identifies
  * data block validity. If the block is valid, copy that with cold status and
@@ -1716,7 +2114,7 @@ out:
  */
 static int gc_data_segment(struct f3fs_sb_info *sbi, struct f3fs_summary *sum,
 		struct gc_inode_list *gc_list, unsigned int segno, int gc_type,
-		bool force_migrate, char dst_hint)
+		bool force_migrate, char dst_hint, struct gc_page_arena *arena)
 {
 	struct super_block *sb = sbi->sb;
 	struct f3fs_summary *entry;
@@ -1726,8 +2124,28 @@ static int gc_data_segment(struct f3fs_sb_info *sbi, struct f3fs_summary *sum,
 	int submitted = 0;
 	unsigned int usable_blks_in_seg = f3fs_usable_blks_in_seg(sbi, segno);
   struct RangeLock* range_w = NULL;
-  struct RangeLock* range_r = NULL;
-  struct page* gc_buf[512] = {0,};
+  struct gc_page_arena *local_arena = NULL;
+  struct page **gc_buf;
+	struct gc_lock_batch *batch;
+	struct bio *read_bio = NULL;	/* phase 3 reads, see f3fs_gc_read_block() */
+	block_t last_read_blkaddr = NULL_ADDR;
+
+	/* no worker arena: only use its slots, pages come from the allocator */
+	if (!arena) {
+		local_arena = gc_arena_alloc(sbi, 0, NUMA_NO_NODE);
+		if (!local_arena) {
+			sbi->skipped_gc_rwsem++;
+			return 0;
+		}
+		arena = local_arena;
+	}
+	gc_buf = arena->slot;
+
+	/* offsets this victim does not reach must not match an old owner */
+	batch = arena->batch;
+	memset(batch->ino, 0, sizeof(batch->ino));
+
+	dst_hint = gc_dst_log(sbi, segno, dst_hint);
 
 	start_addr = START_BLOCK(sbi, segno);
 
@@ -1751,7 +2169,7 @@ next_step:
 		if ((gc_type == BG_GC && has_not_enough_free_secs(sbi, 0, 0)) ||
 			(!force_migrate && get_valid_blocks(sbi, segno, true) ==
 							CAP_BLKS_PER_SEC(sbi)))
-			return submitted;
+			goto out;
 
 		if (check_valid_map(sbi, segno, off) == 0)
 			continue;
@@ -1789,16 +2207,23 @@ next_step:
 			err = f3fs_gc_pinned_control(inode, gc_type, segno);
 			if (err == -EAGAIN) {
 				iput(inode);
-				return submitted;
+				goto out;
 			}
 
 			start_bidx = f3fs_start_bidx_of_node(nofs, inode) +
 								ofs_in_node;
+			batch->ino[off] = dni.ino;
+			batch->bidx[off] = start_bidx;
 
 			range_w = f3fs_down_write_range_trylock3(
         &F3FS_I(inode)->i_gc_rwsem[WRITE],
         start_bidx,
-        1);
+        1, RL_SITE_GC_PHASE3);
+			if (!range_w && gc_rwsem_miss(sbi, inode, start_bidx))
+				range_w = f3fs_down_write_range_timeout3(
+					&F3FS_I(inode)->i_gc_rwsem[WRITE],
+					start_bidx, 1, DEF_GC_RWSEM_BYPASS_WAIT,
+					RL_SITE_GC_PHASE3);
 
 			if (!range_w) {
 				iput(inode);
@@ -1818,8 +2243,14 @@ next_step:
 				continue;
 			}
 
-      gc_buf[off] = f3fs_get_read_data_page_without_cache(inode, start_bidx, REQ_RAHEAD, true);
-      if (!gc_buf[off]) {
+      gc_buf[off] = gc_arena_get(arena);
+      if (!gc_buf[off])
+        gc_buf[off] = alloc_page(GFP_NOIO);
+      if (gc_buf[off]) {
+        f3fs_gc_read_block(inode, start_bidx, expected_blkaddr, gc_buf[off],
+            &read_bio, &last_read_blkaddr);
+        f3fs_up_write_range3(range_w);
+      } else {
 			data_page = f3fs_get_read_data_page(inode,
 						start_bidx, REQ_RAHEAD, true);
 			f3fs_up_write_range3(range_w);
@@ -1830,8 +2261,6 @@ next_step:
 			}
 
 			f3fs_put_page(data_page, 0);
-      } else {
-			  f3fs_up_write_range3(range_w);
       }
 			add_gc_inode(gc_list, inode);
 			continue;
@@ -1840,134 +2269,186 @@ next_step:
 		/* phase 4 */
 		inode = find_gc_inode(gc_list, dni.ino);
 		if (inode) {
-			struct f3fs_inode_info *fi = F3FS_I(inode);
-			bool locked = false;
 			int err;
 
 			start_bidx = f3fs_start_bidx_of_node(nofs, inode)
 								+ ofs_in_node;
 
 			if (S_ISREG(inode->i_mode)) {
-        range_r = f3fs_down_write_range_trylock3(
-          &fi->i_gc_rwsem[READ], start_bidx, 1);
-        if (!range_r) {
+				batch->ino[off] = dni.ino;
+				batch->bidx[off] = start_bidx;
+				if (batch->cur_ino != dni.ino ||
+						!batch->batched[off])
+					gc_lock_batch(inode, batch, off,
+							usable_blks_in_seg);
+				if (batch->held[off])
+					gc_rwsem_hit(sbi, inode, start_bidx);
+				else if (!gc_rwsem_miss(sbi, inode, start_bidx) ||
+					!gc_lock_bypass(inode, batch, start_bidx)) {
 					sbi->skipped_gc_rwsem++;
-        //count[6]++;
 					continue;
 				}
-        range_w = f3fs_down_write_range_trylock3(
-						&fi->i_gc_rwsem[WRITE], start_bidx, 1);
-        if (!range_w) {
-          f3fs_up_write_range3(range_r);
-        //count[7]++;
-					sbi->skipped_gc_rwsem++;
-					continue;
-				}
-				locked = true;
-
-				/* wait for all inflight aio data */
-				inode_dio_wait(inode);
 			}
 			if (f3fs_post_read_required(inode))
 				err = move_data_block(inode, start_bidx,
 							gc_type, segno, off);
 			else {
+        err = -EIO;
         if (gc_buf[off]) {
-          move_data_page2(inode, start_bidx, gc_type, segno, off, dst_hint,
-            gc_buf[off], expected_blkaddr);
+          err = move_data_page2(inode, start_bidx, gc_type, segno, off,
+            dst_hint, gc_buf[off], expected_blkaddr);
           gc_buf[off] = NULL;
-        } else {
+        }
+        /* no page read for it, or its read failed */
+        if (err == -EIO)
 				err = move_data_page(inode, start_bidx, gc_type,
 								segno, off, dst_hint);
-        }
       }
 
 			if (!err && (gc_type == FG_GC ||
 					f3fs_post_read_required(inode)))
 				submitted++;
 
-			if (locked) {
-				f3fs_up_write_range3(range_w);
-				f3fs_up_write_range3(range_r);
-			}
+			/* the next block of the inode gets a new batch */
+			if (batch->bypass_w)
+				gc_unlock_batch(batch);
 
 			stat_inc_data_blk_count(sbi, 1, gc_type);
     }
 	}
 
+	/* phase 4 waits on the pages of this bio */
+	if (phase == 3 && read_bio) {
+		submit_bio(read_bio);
+		read_bio = NULL;
+	}
+
 	if (++phase < 5)
 		goto next_step;
 
-  for (int i = 0 ; i < 512; i++) {
+out:
+	if (read_bio)
+		submit_bio(read_bio);
+	gc_unlock_batch(batch);
+  for (int i = 0 ; i < sbi->blocks_per_seg; i++) {
     if (gc_buf[i]) {
       lock_page(gc_buf[i]);
       unlock_page(gc_buf[i]);
       __free_page(gc_buf[i]);
+      gc_buf[i] = NULL;
     }
   }
+  gc_arena_free(local_arena);
 
 	return submitted;
 }
 
-static int __get_victim(struct f3fs_sb_info *sbi, unsigned int *victim,
-			int gc_type, unsigned int* multiple_victim)
+static int gc_victim_cmp(const void *a, const void *b)
 {
-	struct sit_info *sit_i = SIT_I(sbi);
-	int ret;
+	const struct gc_victim *va = a, *vb = b;
 
-  if (*victim == NULL_SEGNO) {
-    if (multiple_victim) {
-	    struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	if (va->cost != vb->cost)
+		return va->cost < vb->cost ? -1 : 1;
+	return 0;
+}
 
-      for (int i = 0 ; i < VICTIM_COUNT ; i++) {
-        unsigned int candidate = multiple_victim[i];
-        unsigned long *dirty_bitmap = dirty_i->dirty_segmap[DIRTY];
-        if (candidate == NULL_SEGNO) {
-          continue;
-        }
+/* Picks the next batch of victims, cheapest first */
+static int gc_pool_refill(struct f3fs_sb_info *sbi,
+			struct gc_victim_pool *pool, int gc_type)
+{
+	int nr;
 
-        multiple_victim[i] = NULL_SEGNO;
+	f3fs_flush_invalidations(sbi);
+	nr = DIRTY_I(sbi)->v_ops->get_multiple_victim(sbi, pool->victim,
+				GC_VICTIM_POOL, gc_type, NO_CHECK_TYPE, LFS, 0);
+	if (nr < 0)
+		return nr;
 
-        if (!get_valid_blocks(sbi, candidate, false)) {
-          continue;
-        }
+	sort(pool->victim, nr, sizeof(struct gc_victim), gc_victim_cmp, NULL);
 
-        if (sec_usage_check(sbi, GET_SEC_FROM_SEG(sbi, candidate))) {
-          continue;
-        }
+	spin_lock(&pool->lock);
+	pool->nr = nr;
+	pool->next = 0;
+	pool->gen++;
+	spin_unlock(&pool->lock);
+	return 0;
+}
 
-        if (!test_bit(candidate, dirty_bitmap)) {
-          clear_bit(candidate, dirty_i->victim_secmap);
-          continue;
-        }
+/* Gives back the victims nobody took, so that later rounds see them again */
+static void gc_pool_drain(struct f3fs_sb_info *sbi, struct gc_victim_pool *pool)
+{
+	spin_lock(&pool->lock);
+	while (pool->next < pool->nr)
+		clear_bit(GET_SEC_FROM_SEG(sbi, pool->victim[pool->next++].segno),
+					DIRTY_I(sbi)->victim_secmap);
+	spin_unlock(&pool->lock);
+}
 
-        *victim = candidate;
-        break;
-      }
+static bool gc_victim_stale(struct f3fs_sb_info *sbi, unsigned int segno)
+{
+	return !get_valid_blocks(sbi, segno, false) ||
+		sec_usage_check(sbi, GET_SEC_FROM_SEG(sbi, segno)) ||
+		!test_bit(segno, DIRTY_I(sbi)->dirty_segmap[DIRTY]);
+}
 
-      if (*victim == NULL_SEGNO) {
-        ret = DIRTY_I(sbi)->v_ops->get_multiple_victim(
-          sbi,
-          multiple_victim,
-          gc_type,
-          NO_CHECK_TYPE,
-          LFS,
-          0);
-        *victim = multiple_victim[0];
-        multiple_victim[0] = NULL_SEGNO;
-      } else {
-        ret = 0;
-      }
+/*
+ * Takes the cheapest victim left in the pool shared by the GC workers, so
+ * a worker that finished an easy section steals the next one rather than
+ * idling while another still works through a private list. The worker
+ * that finds the pool empty refills it while the others wait on it.
+ */
+static int gc_pool_take(struct f3fs_sb_info *sbi,
+			struct gc_victim_pool *pool, int gc_type,
+			unsigned int *victim)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	unsigned int gen;
+	int ret;
 
-      if (*victim != NULL_SEGNO) {
-        if (gc_type == FG_GC)
-          sbi->cur_victim_sec = *victim;
-      }
+	while (1) {
+		unsigned int segno;
 
-      return ret;
-    }
-  }
+		spin_lock(&pool->lock);
+		if (pool->next < pool->nr) {
+			segno = pool->victim[pool->next++].segno;
+			spin_unlock(&pool->lock);
 
+			/* it may have changed since the pool was filled */
+			if (gc_victim_stale(sbi, segno)) {
+				clear_bit(GET_SEC_FROM_SEG(sbi, segno),
+						dirty_i->victim_secmap);
+				continue;
+			}
+			*victim = segno;
+			return 0;
+		}
+		gen = pool->gen;
+		spin_unlock(&pool->lock);
+
+		mutex_lock(&pool->refill_lock);
+		/* unless somebody else refilled it meanwhile */
+		ret = READ_ONCE(pool->gen) != gen ? 0 :
+				gc_pool_refill(sbi, pool, gc_type);
+		mutex_unlock(&pool->refill_lock);
+		if (ret)
+			return ret;
+	}
+}
+
+static int __get_victim(struct f3fs_sb_info *sbi, unsigned int *victim,
+			int gc_type, struct gc_victim_pool *pool)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	int ret;
+
+	if (*victim == NULL_SEGNO && pool) {
+		ret = gc_pool_take(sbi, pool, gc_type, victim);
+		if (!ret && gc_type == FG_GC)
+			sbi->cur_victim_sec = *victim;
+		return ret;
+	}
+
+	f3fs_flush_invalidations(sbi);
   down_write(&sit_i->last_victim_lock);
 	ret = DIRTY_I(sbi)->v_ops->get_victim(sbi, victim, gc_type,
 					      NO_CHECK_TYPE, LFS, 0);
@@ -1975,10 +2456,103 @@ static int __get_victim(struct f3fs_sb_info *sbi, unsigned int *victim,
 	return ret;
 }
 
+/*
+ * Victims each active worker may reserve ahead, so that with the ones
+ * being collected they take at most the whole pool and a worker that
+ * finds it empty is not starved by the reservations of the others.
+ */
+static unsigned int gc_pipeline_depth(struct f3fs_sb_info *sbi)
+{
+	unsigned int share = GC_VICTIM_POOL /
+			max(READ_ONCE(sbi->gc_thread->nr_active), 1U);
+
+	return share > 1 ? min(share - 1, (unsigned int)GC_PIPELINE_DEPTH) : 0;
+}
+
+/* Tops up @pl from the pool; a victim taken here is still ours to give back */
+static void gc_pipeline_fill(struct f3fs_sb_info *sbi, struct gc_pipeline *pl,
+			struct gc_victim_pool *pool, int gc_type)
+{
+	unsigned int depth = gc_pipeline_depth(sbi);
+
+	while (pl->nr < depth) {
+		if (gc_pool_take(sbi, pool, gc_type, &pl->ahead[pl->nr]))
+			break;
+		pl->nr++;
+	}
+}
+
+static bool gc_pipeline_pop(struct f3fs_sb_info *sbi, struct gc_pipeline *pl,
+			unsigned int *victim)
+{
+	while (pl->nr) {
+		unsigned int segno = pl->ahead[0];
+
+		memmove(pl->ahead, pl->ahead + 1, --pl->nr * sizeof(pl->ahead[0]));
+		if (!gc_victim_stale(sbi, segno)) {
+			*victim = segno;
+			return true;
+		}
+		clear_bit(GET_SEC_FROM_SEG(sbi, segno),
+					DIRTY_I(sbi)->victim_secmap);
+	}
+	return false;
+}
+
+static void gc_pipeline_drain(struct f3fs_sb_info *sbi, struct gc_pipeline *pl)
+{
+	while (pl->nr)
+		clear_bit(GET_SEC_FROM_SEG(sbi, pl->ahead[--pl->nr]),
+					DIRTY_I(sbi)->victim_secmap);
+}
+
+/*
+ * Read ahead for the victims after the one about to be collected: the
+ * summary block of the second, and the NAT blocks of the first, whose
+ * summary was read ahead a victim earlier. Everything is async, so it
+ * overlaps with the current victim's reads and writes, and phase 0 of
+ * the next victim finds its NAT blocks cached.
+ */
+static void gc_pipeline_prefetch(struct f3fs_sb_info *sbi,
+			struct gc_pipeline *pl)
+{
+	struct f3fs_summary *entry;
+	struct page *sum_page;
+	unsigned int segno, off;
+	block_t last_nat = NULL_ADDR;
+
+	if (pl->nr > 1)
+		f3fs_ra_meta_pages(sbi, GET_SUM_BLOCK(sbi, pl->ahead[1]), 1,
+							META_SSA, true);
+	if (!pl->nr)
+		return;
+
+	segno = pl->ahead[0];
+	sum_page = find_get_page(META_MAPPING(sbi), GET_SUM_BLOCK(sbi, segno));
+	if (!sum_page)
+		return;
+	if (!PageUptodate(sum_page))
+		goto out;
+
+	entry = ((struct f3fs_summary_block *)page_address(sum_page))->entries;
+	for (off = 0; off < f3fs_usable_blks_in_seg(sbi, segno); off++, entry++) {
+		nid_t nid = le32_to_cpu(entry->nid);
+
+		if (!check_valid_map(sbi, segno, off) ||
+				NAT_BLOCK_OFFSET(nid) == last_nat)
+			continue;
+		last_nat = NAT_BLOCK_OFFSET(nid);
+		f3fs_ra_meta_pages(sbi, last_nat, 1, META_NAT, true);
+	}
+out:
+	f3fs_put_page(sum_page, 0);
+}
+
 static int do_garbage_collect(struct f3fs_sb_info *sbi,
 				unsigned int start_segno,
 				struct gc_inode_list *gc_list, int gc_type,
-				bool force_migrate, char dst_hint)
+				bool force_migrate, char dst_hint,
+				struct gc_page_arena *arena)
 {
 	struct page *sum_page;
 	struct f3fs_summary_block *sum;
@@ -2062,20 +2636,23 @@ static int do_garbage_collect(struct f3fs_sb_info *sbi,
 		 */
 		if (type == SUM_TYPE_NODE)
 			submitted += gc_node_segment(sbi, sum->entries, segno,
-								gc_type);
+							gc_type, dst_hint);
 		else
 			submitted += gc_data_segment(sbi, sum->entries, gc_list,
 							segno, gc_type,
-							force_migrate, dst_hint);
+							force_migrate, dst_hint, arena);
 
 		stat_inc_seg_count(sbi, type, gc_type);
 		sbi->gc_reclaimed_segs[sbi->gc_mode]++;
 		migrated++;
 
 freed:
-		if (gc_type == FG_GC &&
-				get_valid_blocks(sbi, segno, false) == 0)
-			seg_freed++;
+		if (gc_type == FG_GC) {
+			/* the blocks just moved out may still be pending */
+			f3fs_flush_invalidations(sbi);
+			if (get_valid_blocks(sbi, segno, false) == 0)
+				seg_freed++;
+		}
 
 		if (__is_large_section(sbi) && segno + 1 < end_segno)
 			sbi->next_victim_seg[gc_type] = segno + 1;
@@ -2094,7 +2671,40 @@ skip:
 	return seg_freed;
 }
 
-int do_gc(struct f3fs_sb_info *sbi, struct f3fs_gc_control *gc_control, char worker_idx, unsigned int* multiple_victim)
+/*
+ * Checkpoint for a GC worker. Only a checkpoint started after the worker
+ * asked for one will do, so workers that ask while one is running wait
+ * for it and then share the next one instead of each writing their own.
+ * A checkpoint asked for to reclaim prefree sections is skipped when
+ * another path released them all while the worker waited.
+ */
+static int gc_checkpoint(struct f3fs_sb_info *sbi, struct cp_control *cpc,
+						bool for_prefree)
+{
+	u64 want, gen;
+	int ret;
+
+	/* order the caller's check of free/prefree sections before this */
+	smp_mb();
+	want = atomic64_read(&sbi->gc_cp_gen) + 1;
+
+	mutex_lock(&sbi->gc_internal_cp);
+	if (sbi->gc_cp_done >= want) {
+		ret = sbi->gc_cp_ret;
+	} else if (for_prefree && !prefree_segments(sbi)) {
+		ret = 0;
+	} else {
+		gen = atomic64_inc_return(&sbi->gc_cp_gen);
+		ret = f3fs_write_checkpoint(sbi, cpc);
+		sbi->gc_cp_done = gen;
+		sbi->gc_cp_ret = ret;
+	}
+	mutex_unlock(&sbi->gc_internal_cp);
+	return ret;
+}
+
+int do_gc(struct f3fs_sb_info *sbi, struct f3fs_gc_control *gc_control, char worker_idx, struct gc_victim_pool *pool,
+		struct gc_page_arena *arena)
 {
 	int gc_type = gc_control->init_gc_type;
 	unsigned int segno = gc_control->victim_segno;
@@ -2106,6 +2716,7 @@ int do_gc(struct f3fs_sb_info *sbi, struct f3fs_gc_control *gc_control, char wor
 		.iroot = RADIX_TREE_INIT(gc_list.iroot, GFP_NOFS),
 	};
 	unsigned int skipped_round = 0, round = 0;
+	struct gc_pipeline pipeline = { .nr = 0 };
   
 	trace_f3fs_gc_begin(sbi->sb, gc_type, gc_control->no_bg_gc,
 				gc_control->nr_free_secs,
@@ -2136,9 +2747,7 @@ gc_more:
 		 * secure free segments which doesn't need fggc any more.
 		 */
     if (prefree_segments(sbi)) {
-      mutex_lock(&sbi->gc_internal_cp);
-      ret = f3fs_write_checkpoint(sbi, &cpc);
-      mutex_unlock(&sbi->gc_internal_cp);
+      ret = gc_checkpoint(sbi, &cpc, true);
       if (ret)
         goto stop;
     }
@@ -2152,7 +2761,22 @@ gc_more:
 		goto stop;
 	}
 retry:
-	ret = __get_victim(sbi, &segno, gc_type, multiple_victim);
+	if (gc_control->req && READ_ONCE(gc_control->req->cancel))
+		goto stop;
+
+	/* the other workers already freed what the caller asked for */
+	if (pool && gc_control->nr_free_secs &&
+		atomic_read(&gc_control->freed) >= gc_control->nr_free_secs)
+		goto stop;
+
+	if (pool && segno == NULL_SEGNO &&
+			gc_pipeline_pop(sbi, &pipeline, &segno)) {
+		if (gc_type == FG_GC)
+			sbi->cur_victim_sec = segno;
+		ret = 0;
+	} else {
+		ret = __get_victim(sbi, &segno, gc_type, pool);
+	}
 	if (ret) {
 		/* allow to search victim from sections has pinned data */
 		if (ret == -ENODATA && gc_type == FG_GC &&
@@ -2163,13 +2787,20 @@ retry:
 		goto stop;
 	}
 
+	if (pool) {
+		gc_pipeline_fill(sbi, &pipeline, pool, gc_type);
+		gc_pipeline_prefetch(sbi, &pipeline);
+	}
+
 	seg_freed = do_garbage_collect(sbi, segno, &gc_list, gc_type,
-				gc_control->should_migrate_blocks, worker_idx);
+				gc_control->should_migrate_blocks, worker_idx, arena);
   //printk("%s victim cleand? %d %d", current->comm, segno, get_valid_blocks(sbi, segno, false));
 	total_freed += seg_freed;
 
 	if (seg_freed == f3fs_usable_segs_in_sec(sbi, segno)) {
 		atomic_inc(&gc_control->freed);
+		if (gc_control->req)
+			wake_up_all(&gc_control->req->wq);
   } else {
     if (get_valid_blocks(sbi, segno, false) > 0) {
       clear_bit(GET_SEC_FROM_SEG(sbi, segno), DIRTY_I(sbi)->victim_secmap);
@@ -2195,9 +2826,7 @@ retry:
 		round++;
 		if (skipped_round > MAX_SKIP_GC_COUNT &&
 				skipped_round * 2 >= round) {
-      mutex_lock(&sbi->gc_internal_cp);
-			ret = f3fs_write_checkpoint(sbi, &cpc);
-      mutex_unlock(&sbi->gc_internal_cp);
+			ret = gc_checkpoint(sbi, &cpc, false);
 			goto stop;
 		}
 	}
@@ -2205,21 +2834,16 @@ retry:
 	/* Write checkpoint to reclaim prefree segments */
 	if (free_sections(sbi) < NR_CURSEG_PERSIST_TYPE &&
 				prefree_segments(sbi)) {
-    mutex_lock(&sbi->gc_internal_cp);
-    if (free_sections(sbi) < NR_CURSEG_PERSIST_TYPE &&
-        prefree_segments(sbi)) {
-      ret = f3fs_write_checkpoint(sbi, &cpc);
-      if (ret) {
-        goto stop;
-      }
-    }
-    mutex_unlock(&sbi->gc_internal_cp);
+		ret = gc_checkpoint(sbi, &cpc, true);
+		if (ret)
+			goto stop;
 	}
 go_gc_more:
 	segno = NULL_SEGNO;
 	goto gc_more;
 
 stop:
+	gc_pipeline_drain(sbi, &pipeline);
 	SIT_I(sbi)->last_victim[ALLOC_NEXT] = 0;
 	SIT_I(sbi)->last_victim[FLUSH_DEVICE] = gc_control->victim_segno;
 
@@ -2243,41 +2867,183 @@ stop:
 
 }
 
+/* Workers the device queue still has room for, a segment of IO each */
+static unsigned int gc_device_room(struct f3fs_sb_info *sbi)
+{
+	struct request_queue *q = bdev_get_queue(sbi->sb->s_bdev);
+	s64 depth, inflight;
+
+	depth = (s64)q->nr_requests *
+		(queue_max_sectors(q) >> F3FS_LOG_SECTORS_PER_BLOCK);
+	inflight = get_pages(sbi, F3FS_RD_DATA) + get_pages(sbi, F3FS_RD_NODE) +
+		get_pages(sbi, F3FS_WB_DATA) + get_pages(sbi, F3FS_WB_CP_DATA) +
+		get_pages(sbi, F3FS_DIO_READ) + get_pages(sbi, F3FS_DIO_WRITE);
+	if (inflight >= depth)
+		return 1;
+	return max_t(s64, 1, div_u64(depth - inflight, sbi->blocks_per_seg));
+}
+
+/*
+ * How many of the max_workers workers to wake for this round. All of them
+ * when free sections are close to the reserve; otherwise enough to keep
+ * up with the foreground write rate at the per-worker rate of the last
+ * round, and no more than the device queue has room for.
+ */
+static unsigned int gc_nr_active_workers(struct f3fs_sb_info *sbi,
+		struct f3fs_gc_kthread *gc_th, struct f3fs_gc_control *gc_control)
+{
+	unsigned int cap = READ_ONCE(gc_th->max_workers);
+	unsigned int free_secs = free_sections(sbi);
+	unsigned int rsv_secs = reserved_sections(sbi);
+	unsigned int fg_blocks = total_written_request_blocks(sbi);
+	unsigned long now = jiffies;
+	unsigned int nr, fg_rate = 0;
+
+	if (now != gc_th->last_jiffies)
+		fg_rate = div_u64((u64)(fg_blocks - gc_th->last_fg_blocks) * HZ,
+					now - gc_th->last_jiffies);
+	gc_th->last_fg_blocks = fg_blocks;
+	gc_th->last_jiffies = now;
+
+	if (gc_control->init_gc_type == FG_GC ||
+			sbi->gc_mode == GC_URGENT_HIGH || free_secs <= rsv_secs)
+		return cap;
+
+	nr = DIV_ROUND_UP(cap * rsv_secs, free_secs - rsv_secs);
+	if (nr >= cap)
+		return cap;
+	if (gc_th->worker_rate)
+		nr = max(nr, DIV_ROUND_UP(fg_rate, gc_th->worker_rate));
+	nr = min(nr, gc_device_room(sbi));
+	return clamp(nr, 1U, cap);
+}
+
 int f3fs_gc(struct f3fs_sb_info *sbi, struct f3fs_gc_control *gc_control)
 {
   int ret = 0;
 
   if (sbi->gc_thread) {
-    for (int i = 0 ; i < sbi->num_gc_thread ; i++) {
-      atomic_set(&gc_control->freed, 0);
-      sbi->gc_thread->worker_args[i].gc_control = gc_control;
-      sbi->gc_thread->worker_args[i].state = 1;
-      wake_up(&sbi->gc_thread->worker_args[i].wq);
+    struct f3fs_gc_kthread *gc_th = sbi->gc_thread;
+    unsigned int nr = gc_nr_active_workers(sbi, gc_th, gc_control);
+    unsigned int moved = gc_written_blocks(sbi);
+    u64 busy_ns = 0;
+
+    gc_th->nr_active = nr;
+    atomic_set(&gc_control->freed, 0);
+    atomic_set(&gc_th->busy_workers, nr);
+    for (int i = 0 ; i < nr ; i++) {
+      gc_th->worker_args[i].gc_control = gc_control;
+      gc_th->worker_args[i].state = 1;
+      wake_up(&gc_th->worker_args[i].wq);
     }
-    for (int i = 0 ; i < sbi->num_gc_thread ; i++) {
-      int local_ret;
-      while (sbi->gc_thread->worker_args[i].state == 1) {
-        wait_event_interruptible_timeout(sbi->gc_thread->worker_args[i].caller_wq,
-            sbi->gc_thread->worker_args[i].state == 0, msecs_to_jiffies(300));
-      }
-      local_ret = sbi->gc_thread->worker_args[i].ret;
+    while (atomic_read(&gc_th->busy_workers)) {
+      wait_event_interruptible_timeout(gc_th->done_wq,
+          !atomic_read(&gc_th->busy_workers), msecs_to_jiffies(300));
+    }
+    gc_pool_drain(sbi, &gc_th->victim_pool);
+    moved = gc_written_blocks(sbi) - moved;
+    for (int i = 0 ; i < nr ; i++) {
+      int local_ret = gc_th->worker_args[i].ret;
+
+      busy_ns += gc_th->worker_args[i].last_ns;
+
       if (ret >= 0) {
         if (local_ret < 0) {
           ret = local_ret;
         }
       }
     }
+    if (moved && busy_ns)
+      gc_th->worker_rate = div64_u64((u64)moved * NSEC_PER_SEC, busy_ns);
     if (ret >= 0) {
       ret = atomic_read(&gc_control->freed);
     }
   } else {
-    ret = do_gc(sbi, gc_control, 0, NULL);
+    ret = do_gc(sbi, gc_control, 0, NULL, NULL);
   }
 
   f3fs_up_write(&sbi->gc_lock);
 	return ret;
 }
 
+/*
+ * Queue a GC round to the GC thread and return without waiting for it. A
+ * queued round of the same kind that has not started yet is shared, so
+ * many writers short of space cost one round. The caller gets a reference
+ * and drops it with f3fs_gc_put_request(), right away to fire and forget.
+ */
+struct f3fs_gc_request *f3fs_gc_submit(struct f3fs_sb_info *sbi,
+			const struct f3fs_gc_control *gc_control)
+{
+	struct f3fs_gc_kthread *gc_th = sbi->gc_thread;
+	struct f3fs_gc_request *req, *last;
+
+	if (!gc_th)
+		return ERR_PTR(-ESRCH);
+
+	req = f3fs_kmalloc(sbi, sizeof(*req), GFP_NOFS);
+	if (!req)
+		return ERR_PTR(-ENOMEM);
+
+	spin_lock(&gc_th->req_lock);
+	last = list_empty(&gc_th->req_list) ? NULL :
+		list_last_entry(&gc_th->req_list, struct f3fs_gc_request, list);
+	if (last && !last->cancel &&
+		last->gc_control.init_gc_type == gc_control->init_gc_type &&
+		last->gc_control.no_bg_gc == gc_control->no_bg_gc &&
+		last->gc_control.victim_segno == gc_control->victim_segno) {
+		last->gc_control.nr_free_secs = max(last->gc_control.nr_free_secs,
+						gc_control->nr_free_secs);
+		refcount_inc(&last->ref);
+		spin_unlock(&gc_th->req_lock);
+		kfree(req);
+		return last;
+	}
+
+	req->gc_control = *gc_control;
+	atomic_set(&req->gc_control.freed, 0);
+	req->gc_control.req = req;
+	refcount_set(&req->ref, 2);
+	req->cancel = false;
+	req->done = false;
+	req->ret = 0;
+	init_waitqueue_head(&req->wq);
+	list_add_tail(&req->list, &gc_th->req_list);
+	spin_unlock(&gc_th->req_lock);
+
+	wake_up(&gc_th->gc_wait_queue_head);
+	return req;
+}
+
+/*
+ * Wait until the round of @req has freed @nr_secs sections or has ended.
+ * Returns 0 in the first case, else the error of the round or -EAGAIN.
+ */
+int f3fs_gc_wait(struct f3fs_gc_request *req, unsigned int nr_secs)
+{
+	wait_event(req->wq, smp_load_acquire(&req->done) ||
+			atomic_read(&req->gc_control.freed) >= nr_secs);
+
+	if (atomic_read(&req->gc_control.freed) >= nr_secs)
+		return 0;
+	return req->ret < 0 ? req->ret : -EAGAIN;
+}
+
+/*
+ * Stop the round from taking new victims, for everybody sharing it. The
+ * victims being collected are finished, and waiters are woken at the end.
+ */
+void f3fs_gc_cancel(struct f3fs_gc_request *req)
+{
+	WRITE_ONCE(req->cancel, true);
+}
+
+void f3fs_gc_put_request(struct f3fs_gc_request *req)
+{
+	if (refcount_dec_and_test(&req->ref))
+		kfree(req);
+}
+
 int __init f3fs_create_garbage_collection_cache(void)
 {
 	victim_entry_slab = f3fs_kmem_cache_create("f3fs_victim_entry",
@@ -2315,6 +3081,7 @@ void f3fs_build_gc_manager(struct f3fs_sb_info *sbi)
 	DIRTY_I(sbi)->v_ops = &default_v_ops;
 
 	sbi->gc_pin_file_threshold = DEF_GC_FAILED_PINNED_FILES;
+	sbi->gc_rwsem_bypass = DEF_GC_RWSEM_BYPASS;
 
 	/* give warm/cold data area from slower device */
 	if (f3fs_is_multi_device(sbi) && !__is_large_section(sbi))
@@ -2348,9 +3115,15 @@ static int free_segment_range(struct f3fs_sb_info *sbi,
 			sbi->next_victim_seg[gc_type] = NULL_SEGNO;
 	mutex_unlock(&DIRTY_I(sbi)->seglist_lock);
 
+	/* sections logs claimed ahead may lie in the target range */
+	f3fs_release_free_secs(sbi);
+
 	/* Move out cursegs from the target range */
 	for (type = CURSEG_HOT_DATA; type < NR_CURSEG_PERSIST_TYPE; type++)
 		f3fs_allocate_segment_for_resize(sbi, type, start, end);
+	for (type = CURSEG_COLD_GC_NODE_START; type <= CURSEG_WARM_DATA_LOG_END;
+								type++)
+		f3fs_allocate_segment_for_resize(sbi, type, start, end);
 
 	/* do GC to move out valid blocks in the range */
 	for (segno = start; segno <= end; segno += sbi->segs_per_sec) {
@@ -2359,7 +3132,7 @@ static int free_segment_range(struct f3fs_sb_info *sbi,
 			.iroot = RADIX_TREE_INIT(gc_list.iroot, GFP_NOFS),
 		};
 
-		do_garbage_collect(sbi, segno, &gc_list, FG_GC, true, -1);
+		do_garbage_collect(sbi, segno, &gc_list, FG_GC, true, -1, NULL);
 		put_gc_inode(&gc_list);
 
 		if (!gc_only && get_valid_blocks(sbi, segno, true)) {
@@ -27,22 +27,106 @@
 
 #define DEF_GC_FAILED_PINNED_FILES	2048
 
+/*
+ * After this many i_gc_rwsem trylock failures in a row on the same block,
+ * GC waits up to DEF_GC_RWSEM_BYPASS_WAIT for it instead of skipping it.
+ */
+#define DEF_GC_RWSEM_BYPASS		8
+#define DEF_GC_RWSEM_BYPASS_WAIT	(10 * NSEC_PER_MSEC)
+
 /* Search max. number of dirty segments to select a victim segment */
 #define DEF_MAX_VICTIM_SEARCH 4096 /* covers 8GB */
 
 #define NUM_GC_WORKER (32)
 
-#define VICTIM_COUNT (16)
+/* Victims one refill of the shared GC victim pool picks */
+#define GC_VICTIM_POOL (64)
+
+/* As many blocks as a segment of gc_data_segment() holds */
+#define GC_LOCK_BATCH	512
+
+/*
+ * i_gc_rwsem ranges held by phase 4 of gc_data_segment(). Phase 3 records
+ * the inode and file block of each offset, so that all the blocks of one
+ * inode are locked with a single batch per rwsem rather than one by one.
+ */
+struct gc_lock_batch {
+	nid_t ino[GC_LOCK_BATCH];		/* owner of each offset, 0 if none */
+	block_t bidx[GC_LOCK_BATCH];		/* file block of each offset */
+	bool batched[GC_LOCK_BATCH];		/* offset is part of the batch */
+	bool held[GC_LOCK_BATCH];		/* offset is locked in both rwsems */
+	nid_t cur_ino;				/* inode of the batch */
+	unsigned int nr;			/* blocks of the batch */
+	unsigned int nr_w;			/* blocks tried on i_gc_rwsem[WRITE] */
+	unsigned int off[GC_LOCK_BATCH];	/* batch offsets by file block */
+	unsigned int blocks[GC_LOCK_BATCH];
+	unsigned int wblocks[GC_LOCK_BATCH];
+	struct RangeLock *range_r[GC_LOCK_BATCH];
+	struct RangeLock *range_w[GC_LOCK_BATCH];
+	bool held_r[GC_LOCK_BATCH];
+	bool held_w[GC_LOCK_BATCH];
+	struct RangeLock *bypass_r;		/* one block, see gc_lock_bypass() */
+	struct RangeLock *bypass_w;
+};
+
+/*
+ * Pages a GC worker reads victim blocks into, reused from one victim to
+ * the next. The arena holds a reference on each page, so the __free_page()
+ * done once a page is written only drops the I/O reference; a page whose
+ * count is back to one is free to hand out again.
+ */
+struct gc_page_arena {
+	unsigned int nr;		/* pages owned */
+	unsigned int next;		/* where the next search starts */
+	struct page **slot;		/* page read for each block of the victim */
+	struct gc_lock_batch *batch;	/* i_gc_rwsem ranges of phase 4 */
+	struct page *page[];
+};
 
 struct worker_arg {
   struct f3fs_sb_info* sbi;
+  struct f3fs_gc_kthread* gc_th;
   struct f3fs_gc_control* gc_control;
   int ret;
   bool state;
   char idx;
-  unsigned int multiple_victim[VICTIM_COUNT];
 	wait_queue_head_t wq;
-  wait_queue_head_t caller_wq;
+	u64 busy_ns;			/* time spent in do_gc() */
+	u64 last_ns;			/* ... in the last round */
+	unsigned long runs;		/* rounds this worker took part in */
+	struct gc_page_arena *arena;	/* allocated on the first round */
+};
+
+struct gc_victim {
+	unsigned int segno;
+	unsigned long cost;
+};
+
+/*
+ * Victims shared by the GC workers. A refill picks the GC_VICTIM_POOL
+ * cheapest sections in one walk and sorts them by cost; workers take them
+ * in that order. Whatever is left when f3fs_gc() returns is given back.
+ */
+struct gc_victim_pool {
+	spinlock_t lock;		/* protects @nr, @next and @gen */
+	struct mutex refill_lock;	/* one refill at a time */
+	unsigned int nr;		/* victims of the last refill */
+	unsigned int next;		/* next victim to hand out */
+	unsigned int gen;		/* bumped by every refill */
+	struct gc_victim victim[GC_VICTIM_POOL];
+};
+
+/* Most victims a GC worker reserves ahead, see gc_pipeline_depth() */
+#define GC_PIPELINE_DEPTH (2)
+
+/*
+ * Victims a worker took from the pool but has not started yet. Their
+ * summary and NAT blocks are read ahead while the current one is
+ * collected; see gc_pipeline_prefetch().
+ */
+struct gc_pipeline {
+	unsigned int nr;
+	unsigned int ahead[GC_PIPELINE_DEPTH];	/* next victim first */
 };
 
 struct f3fs_gc_kthread {
@@ -58,13 +142,23 @@ struct f3fs_gc_kthread {
 	/* for changing gc mode */
 	unsigned int gc_wake;
 
-	/* for GC_MERGE mount option */
-	wait_queue_head_t fggc_wq;		/*
-						 * caller of f3fs_balance_fs()
-						 * will wait on this wait queue.
-						 */
+	/* rounds queued by f3fs_gc_submit(), e.g. from f3fs_balance_fs() */
+	spinlock_t req_lock;
+	struct list_head req_list;
   struct worker_arg* worker_args;
   struct task_struct** gc_workers;
+	struct gc_victim_pool victim_pool;
+	atomic_t busy_workers;			/* workers still in this round */
+	wait_queue_head_t done_wq;		/* f3fs_gc() waits for them here */
+
+	/* adaptive worker count, see gc_nr_active_workers() */
+	unsigned int nr_workers;		/* workers started */
+	unsigned int max_workers;		/* runtime cap, <= nr_workers */
+	unsigned int nr_active;			/* workers woken last round */
+	unsigned int worker_rate;		/* blocks/s one worker moved */
+	unsigned int last_fg_blocks;		/* foreground write sample */
+	unsigned long last_jiffies;
+	u64 start_ns;				/* for worker utilization */
 };
 
 struct gc_inode_list {
@@ -192,4 +286,5 @@ static inline bool has_enough_invalid_blocks(struct f3fs_sb_info *sbi)
 			limit_free_user_blocks(invalid_user_blocks));
 }
 
-int do_gc(struct f3fs_sb_info *sbi, struct f3fs_gc_control *gc_control, char worker_idx, unsigned int* multiple_victim);
+int do_gc(struct f3fs_sb_info *sbi, struct f3fs_gc_control *gc_control, char worker_idx, struct gc_victim_pool *pool,
+		struct gc_page_arena *arena);
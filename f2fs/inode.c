@@ -527,6 +527,7 @@ make_now:
 		inode->i_op = &f3fs_file_inode_operations;
 		inode->i_fop = &f3fs_file_operations;
 		inode->i_mapping->a_ops = &f3fs_dblock_aops;
+		f3fs_resize_gc_rwsem(inode);
 	} else if (S_ISDIR(inode->i_mode)) {
 		inode->i_op = &f3fs_dir_inode_operations;
 		inode->i_fop = &f3fs_dir_operations;
@@ -4,28 +4,522 @@
 #define assert
 #endif
 
+#define RL_TABLE_SIZE(nr) \
+  (sizeof(struct rl_table) + ((nr) - 1) * sizeof(struct rl_bucket))
+
+/* What one acquisition ran into, folded into the site counters at the end */
+struct rl_trace {
+  unsigned int cas_retry;
+  unsigned int restart;
+  unsigned long long wait_ns;
+  unsigned long long deadline;  /* give up waiting after this, 0 for never */
+};
+
 #if IN_KERNEL2
-#define mem_alloc(size) kmalloc(size, GFP_KERNEL)
-#define mem_free(ptr) kfree(ptr)
 #define CAS(ptr, cur, next) cmpxchg(ptr, cur, next) == cur
 
 #define RCU_LOCK() rcu_read_lock()
 #define RCU_UNLOCK() rcu_read_unlock()
 #define RCU_DREF(ptr) rcu_dereference(ptr)
-#define RCU_KFREE(ptr) kfree_rcu(ptr, rcu)
+
+/*
+ * LNode and RangeLock objects come from dedicated slabs fronted by per-CPU
+ * magazines, so taking a range lock normally never reaches the allocator.
+ * Unlinked nodes are collected per CPU and handed to RCU in batches; once
+ * the grace period ends they are refilled into the magazines.
+ */
+#define RL_MAGAZINE_SIZE (64)
+#define RL_RCU_BATCH (32)
+
+struct rl_magazine {
+  unsigned int nr;
+  void* objs[RL_MAGAZINE_SIZE];
+};
+
+struct rl_pool {
+  const char* name;
+  size_t size;
+  struct kmem_cache* cache;
+  struct rl_magazine __percpu* mag;
+};
+
+struct rl_rcu_batch {
+  struct LNode* head;
+  unsigned int nr;
+};
+
+static struct rl_pool lnode_pool = {
+  .name = "f3fs_range_lnode", .size = sizeof(struct LNode) };
+static struct rl_pool range_pool = {
+  .name = "f3fs_range_lock", .size = sizeof(struct RangeLock) };
+static struct rl_pool skip_pool = {
+  .name = "f3fs_range_skip", .size = sizeof(struct rl_skip_tower) };
+static DEFINE_PER_CPU(struct rl_rcu_batch, rl_rcu_pending);
+static DEFINE_PER_CPU(struct rl_pool_stat, rl_pool_stats);
+
+/*
+ * Waiters for a held node spin for a per-CPU budget first, which doubles
+ * when spinning was enough and halves when the waiter had to sleep anyway.
+ * Sleepers park on a wait queue hashed by the address of the blocking node.
+ */
+#define RL_SPIN_MIN (64)
+#define RL_SPIN_MAX (8192)
+#define RL_WAIT_TABLE_BITS (8)
+
+static wait_queue_head_t rl_wait_table[1 << RL_WAIT_TABLE_BITS];
+static DEFINE_PER_CPU(unsigned int, rl_spin_budget) = RL_SPIN_MIN;
+static DEFINE_PER_CPU(struct rl_wait_stat, rl_wait_stats);
+
+static inline wait_queue_head_t* rl_waitqueue(void* key) {
+  return &rl_wait_table[hash_ptr(key, RL_WAIT_TABLE_BITS)];
+}
+
+static void* rl_pool_alloc(struct rl_pool* pool) {
+  struct rl_magazine* mag;
+  unsigned long flags;
+  void* obj = NULL;
+
+  local_irq_save(flags);
+  mag = this_cpu_ptr(pool->mag);
+  if (mag->nr) {
+    obj = mag->objs[--mag->nr];
+  }
+  local_irq_restore(flags);
+
+  if (!obj) {
+    this_cpu_inc(rl_pool_stats.slab_alloc);
+    obj = kmem_cache_alloc(pool->cache, GFP_NOFS | __GFP_NOFAIL);
+  }
+  return obj;
+}
+
+static void rl_pool_free(struct rl_pool* pool, void* obj) {
+  struct rl_magazine* mag;
+  unsigned long flags;
+
+  local_irq_save(flags);
+  mag = this_cpu_ptr(pool->mag);
+  if (mag->nr < RL_MAGAZINE_SIZE) {
+    mag->objs[mag->nr++] = obj;
+    obj = NULL;
+  }
+  local_irq_restore(flags);
+
+  if (obj) {
+    kmem_cache_free(pool->cache, obj);
+  }
+}
+
+/* An indexed node takes its index links back to the pool with it */
+static void lnode_release(struct LNode* node) {
+  if (node->skip) {
+    rl_pool_free(&skip_pool, node->skip);
+  }
+  rl_pool_free(&lnode_pool, node);
+}
+
+/* The list holds one reference, every sleeping waiter holds another. */
+static void lnode_put(struct LNode* node) {
+  if (atomic_dec_and_test(&node->ref)) {
+    lnode_release(node);
+  }
+}
+
+static void lnode_free_batch(struct rcu_head* head) {
+  struct LNode* node = container_of(head, struct LNode, rcu);
+
+  while (node) {
+    struct LNode* next = node->free_next;
+
+    lnode_put(node);
+    node = next;
+  }
+}
+
+/*
+ * Concurrent traversals may still be looking at an unlinked node, so it
+ * can only be recycled after a grace period. One call_rcu() per batch keeps
+ * the callback backlog small under heavy lock traffic.
+ */
+static void lnode_free_rcu(struct LNode* node) {
+  struct rl_rcu_batch* batch;
+  struct LNode* full = NULL;
+  unsigned long flags;
+
+  local_irq_save(flags);
+  batch = this_cpu_ptr(&rl_rcu_pending);
+  node->free_next = batch->head;
+  batch->head = node;
+  if (++batch->nr == RL_RCU_BATCH) {
+    full = batch->head;
+    batch->head = NULL;
+    batch->nr = 0;
+  }
+  local_irq_restore(flags);
+
+  if (full) {
+    this_cpu_inc(rl_pool_stats.rcu_batch);
+    call_rcu(&full->rcu, lnode_free_batch);
+  }
+}
+
+static int rl_pool_create(struct rl_pool* pool) {
+  pool->cache = kmem_cache_create(pool->name, pool->size, 0,
+      SLAB_RECLAIM_ACCOUNT, NULL);
+  if (!pool->cache) {
+    return -ENOMEM;
+  }
+  pool->mag = alloc_percpu(struct rl_magazine);
+  if (!pool->mag) {
+    kmem_cache_destroy(pool->cache);
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+static void rl_pool_destroy(struct rl_pool* pool) {
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    struct rl_magazine* mag = per_cpu_ptr(pool->mag, cpu);
+
+    while (mag->nr) {
+      kmem_cache_free(pool->cache, mag->objs[--mag->nr]);
+    }
+  }
+  free_percpu(pool->mag);
+  kmem_cache_destroy(pool->cache);
+}
+
+int __init f3fs_create_range_lock_cache(void) {
+  int err;
+
+  for (int i = 0 ; i < ARRAY_SIZE(rl_wait_table) ; i++) {
+    init_waitqueue_head(&rl_wait_table[i]);
+  }
+
+  err = rl_pool_create(&lnode_pool);
+  if (err) {
+    return err;
+  }
+  err = rl_pool_create(&range_pool);
+  if (err) {
+    rl_pool_destroy(&lnode_pool);
+    return err;
+  }
+  err = rl_pool_create(&skip_pool);
+  if (err) {
+    rl_pool_destroy(&range_pool);
+    rl_pool_destroy(&lnode_pool);
+  }
+  return err;
+}
+
+void f3fs_destroy_range_lock_cache(void) {
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    struct rl_rcu_batch* batch = per_cpu_ptr(&rl_rcu_pending, cpu);
+
+    if (batch->head) {
+      call_rcu(&batch->head->rcu, lnode_free_batch);
+      batch->head = NULL;
+      batch->nr = 0;
+    }
+  }
+  rcu_barrier();
+  rl_pool_destroy(&range_pool);
+  rl_pool_destroy(&lnode_pool);
+  rl_pool_destroy(&skip_pool);
+}
+
+void f3fs_range_lock_pool_stat(struct rl_pool_stat* stat) {
+  int cpu;
+
+  memset(stat, 0, sizeof(*stat));
+  for_each_possible_cpu(cpu) {
+    struct rl_pool_stat* s = per_cpu_ptr(&rl_pool_stats, cpu);
+
+    stat->acquire += s->acquire;
+    stat->lnode_alloc += s->lnode_alloc;
+    stat->range_alloc += s->range_alloc;
+    stat->slab_alloc += s->slab_alloc;
+    stat->rcu_batch += s->rcu_batch;
+  }
+}
+
+void f3fs_range_lock_wait_stat(struct rl_wait_stat* stat) {
+  int cpu;
+
+  memset(stat, 0, sizeof(*stat));
+  for_each_possible_cpu(cpu) {
+    struct rl_wait_stat* s = per_cpu_ptr(&rl_wait_stats, cpu);
+
+    stat->spin += s->spin;
+    stat->sleep += s->sleep;
+    stat->wait_ns += s->wait_ns;
+    stat->max_wait_ns = max(stat->max_wait_ns, s->max_wait_ns);
+  }
+}
+
+void f3fs_range_lock_site_stat(struct rl_sem_stat __percpu* percpu,
+  enum rl_site site, struct rl_site_stat* stat) {
+  int cpu;
+
+  memset(stat, 0, sizeof(*stat));
+  if (!percpu) {
+    return;
+  }
+  for_each_possible_cpu(cpu) {
+    struct rl_site_stat* s = &per_cpu_ptr(percpu, cpu)->site[site];
+
+    stat->shared_range += s->shared_range;
+    stat->shared_full += s->shared_full;
+    stat->excl_range += s->excl_range;
+    stat->excl_full += s->excl_full;
+    stat->try_fail += s->try_fail;
+    stat->cas_retry += s->cas_retry;
+    stat->restart += s->restart;
+    stat->wait_ns += s->wait_ns;
+  }
+}
+
+#define STAT_INC(name) this_cpu_inc(rl_pool_stats.name)
+#define lnode_alloc() rl_pool_alloc(&lnode_pool)
+#define lnode_free(ptr) lnode_release(ptr)
+#define skip_tower_alloc() rl_pool_alloc(&skip_pool)
+#define range_alloc() rl_pool_alloc(&range_pool)
+#define range_free(ptr) rl_pool_free(&range_pool, ptr)
+#define RCU_KFREE(ptr) lnode_free_rcu(ptr)
+#define SKIP_READ(ptr) READ_ONCE(ptr)
+#define RL_MB() smp_mb()
+#define SKIP_PUBLISH(ptr, val) smp_store_release(&(ptr), val)
+#define SKIP_LOCK_INIT(lock) spin_lock_init(lock)
+#define SKIP_LOCK(lock) spin_lock(lock)
+#define SKIP_UNLOCK(lock) spin_unlock(lock)
+#define SKIP_RANDOM() prandom_u32()
+#define skip_alloc(nr) kcalloc(nr, sizeof(struct rl_skip_head), \
+    GFP_NOWAIT | __GFP_NOWARN)
+#define skip_free(ptr) kfree(ptr)
+#define table_alloc(nr) kzalloc(RL_TABLE_SIZE(nr), GFP_NOWAIT | __GFP_NOWARN)
+#define table_free(ptr) kfree(ptr)
+#define RL_NOW_NS() ktime_get_ns()
+#define PENDING_READ(b) atomic_read(&(b)->pending)
+#define PENDING_INC(b) atomic_inc(&(b)->pending)
+#define PENDING_DEC_AND_TEST(b) atomic_dec_and_test(&(b)->pending)
 #else
-#define mem_alloc(size) malloc(size)
-#define mem_free(ptr) free(ptr)
 #define CAS(ptr, cur, next) __sync_bool_compare_and_swap(ptr, cur, next)
 
-#define RCU_LOCK()
-#define RCU_UNLOCK()
+/*
+ * Userspace stand-in for RCU so that the lock_test benchmarks do not leak
+ * every unlinked node: epoch based reclamation. A thread inside RCU_LOCK()
+ * publishes the global epoch it saw; a node retired in epoch e is freed once
+ * the global epoch reaches e + 3, which needs every active thread to have
+ * caught up twice. Slots of exited threads are reused along with whatever
+ * they still had retired.
+ */
+#define EBR_MAX_THREADS (1024)
+#define EBR_ADVANCE_BATCH (128)
+
+struct ebr_slot {
+  volatile unsigned long epoch;
+  volatile unsigned int active;   /* RCU_LOCK() nesting depth */
+  volatile unsigned int in_use;
+  unsigned long limbo_epoch;
+  struct LNode* limbo[3];         /* retired nodes by epoch % 3 */
+  unsigned int nr_retired;
+} __attribute__((aligned(64)));
+
+static struct ebr_slot ebr_slots[EBR_MAX_THREADS];
+static volatile unsigned long ebr_epoch;
+static pthread_key_t ebr_key;
+static pthread_once_t ebr_once = PTHREAD_ONCE_INIT;
+static __thread struct ebr_slot* ebr_self;
+
+static void ebr_release_slot(void* slot) {
+  __sync_lock_release(&((struct ebr_slot*)slot)->in_use);
+}
+
+static void ebr_init(void) {
+  pthread_key_create(&ebr_key, ebr_release_slot);
+}
+
+static struct ebr_slot* ebr_slot(void) {
+  if (!ebr_self) {
+    pthread_once(&ebr_once, ebr_init);
+    for (int i = 0 ; i < EBR_MAX_THREADS ; i++) {
+      if (!__sync_lock_test_and_set(&ebr_slots[i].in_use, 1)) {
+        ebr_self = &ebr_slots[i];
+        break;
+      }
+    }
+    if (!ebr_self) {
+      fprintf(stderr, "lockfree_list: more than %d threads\n",
+          EBR_MAX_THREADS);
+      abort();
+    }
+    pthread_setspecific(ebr_key, ebr_self);
+  }
+  return ebr_self;
+}
+
+static void ebr_enter(void) {
+  struct ebr_slot* self = ebr_slot();
+
+  if (self->active++ == 0) {
+    self->epoch = ebr_epoch;
+    __sync_synchronize();
+  }
+}
+
+static void ebr_exit(void) {
+  __sync_synchronize();
+  ebr_self->active--;
+}
+
+static void ebr_try_advance(void) {
+  unsigned long epoch = ebr_epoch;
+
+  for (int i = 0 ; i < EBR_MAX_THREADS ; i++) {
+    struct ebr_slot* slot = &ebr_slots[i];
+
+    if (slot->in_use && slot->active && slot->epoch != epoch) {
+      return;
+    }
+  }
+  __sync_bool_compare_and_swap(&ebr_epoch, epoch, epoch + 1);
+}
+
+static void lnode_free(struct LNode* node) {
+  free(node->skip);
+  free(node);
+}
+
+static void ebr_free_list(struct LNode* node) {
+  while (node) {
+    struct LNode* next = node->free_next;
+
+    lnode_free(node);
+    node = next;
+  }
+}
+
+static void ebr_retire(struct LNode* node) {
+  struct ebr_slot* self = ebr_slot();
+  unsigned long epoch = ebr_epoch;
+
+  if (self->limbo_epoch != epoch) {
+    // Everything filed under this index was retired three epochs ago.
+    ebr_free_list(self->limbo[epoch % 3]);
+    self->limbo[epoch % 3] = NULL;
+    self->limbo_epoch = epoch;
+  }
+  node->free_next = self->limbo[epoch % 3];
+  self->limbo[epoch % 3] = node;
+  if (++self->nr_retired % EBR_ADVANCE_BATCH == 0) {
+    ebr_try_advance();
+  }
+}
+
+#define RCU_LOCK() ebr_enter()
+#define RCU_UNLOCK() ebr_exit()
 #define RCU_DREF(ptr) ptr
-#define RCU_KFREE(ptr)
+
+#define STAT_INC(name)
+#define lnode_alloc() malloc(sizeof(struct LNode))
+#define skip_tower_alloc() malloc(sizeof(struct rl_skip_tower))
+#define range_alloc() malloc(sizeof(struct RangeLock))
+#define range_free(ptr) free(ptr)
+#define RCU_KFREE(ptr) ebr_retire(ptr)
+#define SKIP_READ(ptr) __atomic_load_n(&(ptr), __ATOMIC_ACQUIRE)
+#define RL_MB() __sync_synchronize()
+#define SKIP_PUBLISH(ptr, val) __atomic_store_n(&(ptr), val, __ATOMIC_RELEASE)
+#define SKIP_LOCK_INIT(lock) pthread_mutex_init(lock, NULL)
+#define SKIP_LOCK(lock) pthread_mutex_lock(lock)
+#define SKIP_UNLOCK(lock) pthread_mutex_unlock(lock)
+#define skip_alloc(nr) calloc(nr, sizeof(struct rl_skip_head))
+#define skip_free(ptr) free(ptr)
+#define table_alloc(nr) calloc(1, RL_TABLE_SIZE(nr))
+#define table_free(ptr) free(ptr)
+#define PENDING_READ(b) __atomic_load_n(&(b)->pending, __ATOMIC_ACQUIRE)
+#define PENDING_INC(b) __sync_add_and_fetch(&(b)->pending, 1)
+#define PENDING_DEC_AND_TEST(b) (__sync_sub_and_fetch(&(b)->pending, 1) == 0)
+
+static unsigned long long RL_NOW_NS(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Spins until @cond holds; false if @deadline, when set, passed first */
+#define RL_SPIN_UNTIL(cond, deadline) ({                        \
+  unsigned int __spin = 0;                                      \
+  bool __ok = true;                                             \
+  while (!(cond)) {                                             \
+    if ((deadline) && !(++__spin & 1023) &&                     \
+        RL_NOW_NS() >= (deadline)) {                            \
+      __ok = (cond);                                            \
+      break;                                                    \
+    }                                                           \
+    __sync_synchronize();                                       \
+  }                                                             \
+  __ok; })
+
+static __thread unsigned int skip_seed;
+
+static unsigned int SKIP_RANDOM(void) {
+  if (!skip_seed) {
+    skip_seed = (unsigned int)(unsigned long)&skip_seed | 1;
+  }
+  skip_seed ^= skip_seed << 13;
+  skip_seed ^= skip_seed >> 17;
+  skip_seed ^= skip_seed << 5;
+  return skip_seed;
+}
 #endif
 
 void init_f3fs_rwsem3(struct f3fs_rwsem3* sem) {
-  memset(&sem->list_rl, 0, sizeof(struct ListRL));
+  memset(sem, 0, sizeof(struct f3fs_rwsem3));
+  sem->list_rl.single.nr_bucket = 1;
+  sem->list_rl.table = &sem->list_rl.single;
+}
+
+static void destroy_list(volatile struct LNode* cur) {
+  struct LNode* node = (struct LNode*)((unsigned long long)(cur) & ~1ULL);
+
+  while (node) {
+    struct LNode* next =
+      (struct LNode*)((unsigned long long)(node->next) & ~1ULL);
+
+    lnode_free(node);
+    node = next;
+  }
+}
+
+/*
+ * Nobody holds the lock any more, so every node left behind is a released
+ * one that no traversal happened to unlink yet. Callers guarantee that a
+ * grace period has passed since the last traversal.
+ */
+void destroy_f3fs_rwsem3(struct f3fs_rwsem3* sem) {
+  struct rl_table* table = sem->list_rl.table;
+
+  while (table) {
+    struct rl_table* old = table->old;
+
+    for (unsigned int i = 0 ; i < table->nr_bucket ; i++) {
+      destroy_list(table->bucket[i].head);
+    }
+    skip_free(table->skip);
+    if (table != &sem->list_rl.single) {
+      table_free(table);
+    }
+    table = old;
+  }
+#if IN_KERNEL2
+  free_percpu(sem->read_count);
+#endif
 }
 
 bool marked(volatile struct LNode* node) {
@@ -51,6 +545,9 @@ int compare(struct LNode* lock1, struct LNode* lock2) {
 }
 
 void DeleteNode(struct LNode* lock) {
+  // Once marked, the node may be unlinked and queued for freeing at any
+  // time, so checking for sleepers below needs the read-side section.
+  RCU_LOCK();
   while (true) {
     volatile struct LNode* orig = lock->next;
     unsigned long long marked = (unsigned long long)orig + 1;
@@ -58,24 +555,182 @@ void DeleteNode(struct LNode* lock) {
       break;
     }
   }
+#if IN_KERNEL2
+  // Pairs with the barrier after the waiter takes its reference.
+  if (atomic_read(&lock->ref) > 1) {
+    wake_up_all(rl_waitqueue(lock));
+  }
+#endif
+  RCU_UNLOCK();
 }
 
-void MutexRangeRelease(struct RangeLock* rl) {
-#if HASH_MODE
-  if (rl->bucket == ALL_RANGE) {
-    for (int i = 0 ; i < BUCKET_CNT ; i++) {
-      DeleteNode(rl->node[i]);
+/*
+ * Waits until the conflicting node @cur is released, or until the deadline
+ * of @trace passes, in which case it returns false. Called under
+ * RCU_LOCK(); a sleeping waiter leaves the read-side section while parked,
+ * so callers must restart their traversal from a node they own afterwards.
+ */
+bool WaitNode(struct LNode* cur, struct rl_trace* trace) {
+#if IN_KERNEL2
+  unsigned int budget = this_cpu_read(rl_spin_budget);
+  u64 start = ktime_get_ns();
+  bool released;
+  u64 delta;
+
+  for (unsigned int spin = 0 ; spin < budget && !need_resched() ; spin++) {
+    if (marked(cur->next)) {
+      break;
     }
+    cpu_relax();
+  }
+
+  released = marked(cur->next);
+  if (released) {
+    this_cpu_write(rl_spin_budget, min_t(unsigned int, budget * 2, RL_SPIN_MAX));
+    this_cpu_inc(rl_wait_stats.spin);
   } else {
-    DeleteNode(rl->node[rl->bucket]);
+    // The reference keeps @cur from being recycled outside of RCU.
+    atomic_inc(&cur->ref);
+    smp_mb__after_atomic();
+    RCU_UNLOCK();
+    if (trace->deadline) {
+      s64 left = trace->deadline - ktime_get_ns();
+
+      if (left > 0) {
+        wait_event_timeout(*rl_waitqueue(cur), marked(cur->next),
+            nsecs_to_jiffies(left));
+      }
+    } else {
+      wait_event(*rl_waitqueue(cur), marked(cur->next));
+    }
+    released = marked(cur->next);
+    lnode_put(cur);
+    RCU_LOCK();
+    this_cpu_write(rl_spin_budget, max_t(unsigned int, budget / 2, RL_SPIN_MIN));
+    this_cpu_inc(rl_wait_stats.sleep);
+  }
+
+  delta = ktime_get_ns() - start;
+  trace->wait_ns += delta;
+  this_cpu_add(rl_wait_stats.wait_ns, delta);
+  if (delta > this_cpu_read(rl_wait_stats.max_wait_ns)) {
+    this_cpu_write(rl_wait_stats.max_wait_ns, delta);
   }
-  mem_free(rl);
+  return released;
 #else
-  DeleteNode(rl->node);
-  mem_free(rl);
+  return RL_SPIN_UNTIL(marked(cur->next), trace->deadline);
 #endif
 }
 
+/*
+ * The skip list orders writers by start. Validated writers never overlap,
+ * so equal starts only show up while one of them is on its way out; the
+ * address breaks the tie so that unlinking can find the exact node.
+ */
+static inline bool skip_before(struct LNode* a, struct LNode* b) {
+  return a->start < b->start || (a->start == b->start && a < b);
+}
+
+/*
+ * Returns the indexed writer with the greatest start not above @start.
+ * Every writer linked before a live indexed writer ends at or before its
+ * start, and any reader spanning it is still waiting for it, so traversals
+ * may begin right behind the returned node. Called under RCU_LOCK().
+ */
+static struct LNode* SkipFind(struct rl_skip_head* skip, unsigned int start) {
+  volatile struct LNode** next = skip->next;
+  struct LNode* found = NULL;
+
+  for (int l = RL_SKIP_LEVELS - 1 ; l >= 0 ; l--) {
+    struct LNode* cur = (struct LNode*)SKIP_READ(next[l]);
+
+    while (cur && cur->start <= start) {
+      found = cur;
+      next = cur->skip->next;
+      cur = (struct LNode*)SKIP_READ(next[l]);
+    }
+  }
+  return found;
+}
+
+/* Indexes a writer that just passed w_validate() */
+static void SkipInsert(struct rl_skip_head* skip, struct LNode* node) {
+  volatile struct LNode** prev[RL_SKIP_LEVELS];
+  volatile struct LNode** next = skip->next;
+  struct rl_skip_tower* tower = skip_tower_alloc();
+  unsigned int height = 1;
+
+  while (height < RL_SKIP_LEVELS && !(SKIP_RANDOM() & 3)) {
+    height++;
+  }
+  tower->head = skip;
+  node->skip = tower;
+
+  SKIP_LOCK(&skip->lock);
+  for (int l = RL_SKIP_LEVELS - 1 ; l >= 0 ; l--) {
+    struct LNode* cur = (struct LNode*)next[l];
+
+    while (cur && skip_before(cur, node)) {
+      next = cur->skip->next;
+      cur = (struct LNode*)next[l];
+    }
+    prev[l] = &next[l];
+  }
+  for (unsigned int l = 0 ; l < RL_SKIP_LEVELS ; l++) {
+    tower->next[l] = l < height ? *prev[l] : NULL;
+  }
+  // the links above are published along with the node
+  for (unsigned int l = 0 ; l < height ; l++) {
+    SKIP_PUBLISH(*prev[l], node);
+  }
+  SKIP_UNLOCK(&skip->lock);
+}
+
+/* Takes a writer out of the index before it is marked released */
+static void SkipRemove(struct LNode* node) {
+  struct rl_skip_tower* tower = node->skip;
+  struct rl_skip_head* skip;
+  volatile struct LNode** next;
+
+  if (!tower || !tower->head) {
+    return;
+  }
+  skip = tower->head;
+
+  SKIP_LOCK(&skip->lock);
+  next = skip->next;
+  for (int l = RL_SKIP_LEVELS - 1 ; l >= 0 ; l--) {
+    struct LNode* cur = (struct LNode*)next[l];
+
+    while (cur && cur != node && skip_before(cur, node)) {
+      next = cur->skip->next;
+      cur = (struct LNode*)next[l];
+    }
+    if (cur == node) {
+      // concurrent lookups standing on @node still find their way on
+      SKIP_PUBLISH(next[l], tower->next[l]);
+    }
+  }
+  SKIP_UNLOCK(&skip->lock);
+  tower->head = NULL;
+}
+
+static void ReleaseNode(struct LNode* node) {
+  SkipRemove(node);
+  DeleteNode(node);
+}
+
+static void ReleaseNodes(struct RangeLock* rl) {
+  for (unsigned int i = 0 ; i < rl->nr_bucket ; i++) {
+    ReleaseNode(rl->node[(rl->bucket + i) & (rl->table->nr_bucket - 1)]);
+  }
+}
+
+void MutexRangeRelease(struct RangeLock* rl) {
+  ReleaseNodes(rl);
+  range_free(rl);
+}
+
 int compareRW(struct LNode* lock1, struct LNode* lock2) {
   if (!lock1) {
     return 1;
@@ -97,17 +752,43 @@ int compareRW(struct LNode* lock1, struct LNode* lock2) {
   }
 }
 
-int w_validate(volatile struct LNode** listrl, struct LNode* lock) {
+/*
+ * Return values of InsertNodeRW(). A node that was linked and then lost its
+ * validation is logically deleted and reclaimed by later list traversals, so
+ * only a node that was never linked may be freed by the caller.
+ */
+#define RL_ACQUIRED (0)
+#define RL_RETRY (1)
+#define RL_BUSY (-1)
+#define RL_BUSY_LINKED (-2)
+
+int w_validate(volatile struct LNode** listrl, struct rl_skip_head* skip,
+  struct LNode* lock, struct rl_trace* trace) {
   volatile struct LNode** prev = listrl;
-  struct LNode* cur = unmark(*prev);
+  struct LNode* cur;
+
+  if (skip) {
+    struct LNode* jump = SkipFind(skip, lock->start);
+
+    // @jump must still be live now that @lock is linked
+    if (jump && !marked(jump->next)) {
+      if (jump->end > lock->start) {
+        DeleteNode(lock);
+        trace->restart++;
+        return RL_RETRY;
+      }
+      prev = &jump->next;
+    }
+  }
+  cur = unmark(*prev);
 
   while (true) {
     if (!cur) {
-      return 0;
+      return RL_ACQUIRED;
     }
 
     if (cur == lock) {
-      return 0;
+      return RL_ACQUIRED;
     }
     if (marked(cur->next)) {
       struct LNode* next = unmark(cur->next);
@@ -121,22 +802,24 @@ int w_validate(volatile struct LNode** listrl, struct LNode* lock) {
         cur = unmark(*prev);
       } else {
         DeleteNode(lock);
-        return 1;
+        trace->restart++;
+        return RL_RETRY;
       }
     }
   }
 }
 
-int r_validate(struct LNode* lock, bool try) {
+int r_validate(struct LNode* lock, bool try, struct rl_trace* trace) {
   volatile struct LNode** prev = &lock->next;
   struct LNode* cur = unmark(*prev);
 
   while (true) {
-    if (!cur) {
-      return 0;
+    // the list is sorted by start, nothing further on can overlap
+    if (!cur || cur->start >= lock->end) {
+      return RL_ACQUIRED;
     }
     if (cur == lock) {
-      return 0;
+      return RL_ACQUIRED;
     }
     if (marked(cur->next)) {
       struct LNode* next = unmark(cur->next);
@@ -149,21 +832,38 @@ int r_validate(struct LNode* lock, bool try) {
       prev = &cur->next;
       cur = unmark(*prev);
     } else {
-      if (try) {
-        return -1;
-      }
-      while (!marked(cur->next)) {
-        cur = *prev;
+      if (try || !WaitNode(cur, trace)) {
+        DeleteNode(lock);
+        return RL_BUSY_LINKED;
       }
+      trace->restart++;
+      prev = &lock->next;
+      cur = unmark(*prev);
     }
   }
 }
 
-int InsertNodeRW(volatile struct LNode** listrl, struct LNode* lock, bool try) {
+int InsertNodeRW(volatile struct LNode** listrl, struct rl_skip_head* skip,
+  struct LNode* lock, bool try, struct rl_trace* trace) {
   RCU_LOCK();
   while (true) {
     volatile struct LNode** prev = listrl;
-    struct LNode* cur = *prev;
+    struct LNode* jump = skip ? SkipFind(skip, lock->start) : NULL;
+    struct LNode* cur;
+
+    if (jump) {
+      if (jump->end > lock->start) {
+        if (try || !WaitNode(jump, trace)) {
+          RCU_UNLOCK();
+
+          return RL_BUSY;
+        }
+        continue;
+      }
+      // a released @jump leaves a marked pointer here and forces a restart
+      prev = &jump->next;
+    }
+    cur = *prev;
 
     while (true) {
       if (marked(cur)){
@@ -184,28 +884,36 @@ int InsertNodeRW(volatile struct LNode** listrl, struct LNode* lock, bool try) {
             prev = &cur->next;
             cur = *prev;
           } else if (ret == 0) {
-            if (try) {
+            if (try || !WaitNode(cur, trace)) {
               RCU_UNLOCK();
 
-              return -1;
-            }
-            while (!marked(cur->next)) {
-              cur = *prev;
+              return RL_BUSY;
             }
+            // restart from the head, the path may be gone after a sleep
+            break;
           } else if (ret == 1) {
             lock->next = cur;
             if (CAS(prev, cur, lock)) {
-              int ret = 0;
+              int ret = RL_ACQUIRED;
               if (lock->reader) {
-                ret = r_validate(lock, try);
+                // a writer may have slipped in before us once @jump is gone
+                if (jump && marked(jump->next)) {
+                  DeleteNode(lock);
+                  trace->restart++;
+                  RCU_UNLOCK();
+
+                  return RL_RETRY;
+                }
+                ret = r_validate(lock, try, trace);
               } else {
-                ret = w_validate(listrl, lock);
+                ret = w_validate(listrl, skip, lock, trace);
               }
 
               RCU_UNLOCK();
 
               return ret;
             }
+            trace->cas_retry++;
             cur = *prev;
           }
         }
@@ -213,79 +921,335 @@ int InsertNodeRW(volatile struct LNode** listrl, struct LNode* lock, bool try) {
     }
   }
   RCU_UNLOCK();
-  return -1;
+  return RL_BUSY;
 }
 
 struct LNode* InitNode(
   unsigned long long start, unsigned long long end, bool writer) {
-  struct LNode* ret = mem_alloc(sizeof(struct LNode));
+  struct LNode* ret = lnode_alloc();
 
   ret->start = start;
   ret->end = end;
   ret->next = NULL;
   ret->reader = !writer;
+  ret->skip = NULL;
+#if IN_KERNEL2
+  atomic_set(&ret->ref, 1);
+#endif
   return ret;
 }
 
-struct RangeLock* RWRangeTryAcquire(
-  struct ListRL* list_rl,
+/*
+ * Links a node covering [start, end) into one list and waits until it is
+ * validated. A node that lost validation is left to the list for reclaim and
+ * a fresh one is inserted. Returns NULL only if @try and the range is busy.
+ */
+struct LNode* AcquireNode(volatile struct LNode** listrl,
+  struct rl_skip_head* skip,
   unsigned long long start,
   unsigned long long end,
-  bool writer) {
-  struct RangeLock* rl = mem_alloc(sizeof(struct RangeLock));
-  int ret = 0;
-
-#if HASH_MODE
-  if (end == MAX_SIZE) {
-    assert(start == 0);
-    rl->bucket = ALL_RANGE;
-    for (int i = 0 ; i < BUCKET_CNT ; i++) {
-      rl->node[i] = InitNode(0, MAX_SIZE, writer);
-
-      do {
-        ret = InsertNodeRW(&list_rl->head[i], rl->node[i], true);
-        mem_free(rl->node[i]);
-        if (ret < 0) {
-          for (int j = i - 1 ; j>= 0 ; j--) {
-            // Deferred Physical deletion of already inserted node
-            DeleteNode(rl->node[j]);
-          }
-          mem_free(rl);
-          return NULL;
-        }
-      } while(ret);
+  bool writer,
+  bool try,
+  struct rl_trace* trace) {
+  while (true) {
+    struct LNode* node = InitNode(start, end, writer);
+    int ret;
+
+    STAT_INC(lnode_alloc);
+    ret = InsertNodeRW(listrl, skip, node, try, trace);
+
+    if (ret == RL_ACQUIRED) {
+      if (writer && skip) {
+        SkipInsert(skip, node);
+      }
+      return node;
+    }
+    if (ret == RL_BUSY) {
+      lnode_free(node);
+      return NULL;
+    }
+    if (ret == RL_BUSY_LINKED) {
+      return NULL;
+    }
+  }
+}
+
+/*
+ * Returns the skip-list index of @table, or NULL if it is not indexed.
+ * Only writers get indexed, so only they allocate it; readers that find
+ * nothing yet simply walk the lists from their heads.
+ */
+static struct rl_skip_head* GetSkip(struct ListRL* list_rl,
+  struct rl_table* table, bool writer) {
+  struct rl_skip_head* skip;
+
+  if (!list_rl->skiplist) {
+    return NULL;
+  }
+  skip = SKIP_READ(table->skip);
+  if (skip || !writer) {
+    return skip;
+  }
+
+  skip = skip_alloc(table->nr_bucket);
+  if (!skip) {
+    return NULL;
+  }
+  for (unsigned int i = 0 ; i < table->nr_bucket ; i++) {
+    SKIP_LOCK_INIT(&skip[i].lock);
+  }
+  if (!CAS(&table->skip, NULL, skip)) {
+    skip_free(skip);
+    skip = SKIP_READ(table->skip);
+  }
+  return skip;
+}
+
+/*
+ * Chunk c hashes to bucket c % nr_bucket, so [start, end) touches
+ * min(chunks spanned, nr_bucket) consecutive buckets starting from the
+ * bucket of its first chunk, wrapping around at the last one.
+ */
+static inline bool range_in_bucket(struct RangeLock* rl, unsigned int i) {
+  unsigned int mask = rl->table->nr_bucket - 1;
+
+  return ((i - rl->bucket) & mask) < rl->nr_bucket;
+}
+
+/*
+ * Fair mode: a blocking writer raises the pending count of the bucket it
+ * is getting into, and readers new to that bucket wait for it to drop.
+ * Only the current bucket is flagged, so a reader already holding lower
+ * buckets can never be made to wait by a writer that waits for it.
+ */
+static bool WaitPending(struct rl_bucket* bucket, bool try,
+  struct rl_trace* trace) {
+  unsigned long long start;
+  bool clear;
+
+  if (!PENDING_READ(bucket)) {
+    return true;
+  }
+  if (try) {
+    return false;
+  }
+  start = RL_NOW_NS();
+#if IN_KERNEL2
+  if (trace->deadline) {
+    s64 left = trace->deadline - start;
+
+    if (left > 0) {
+      wait_event_timeout(*rl_waitqueue(&bucket->pending),
+          !PENDING_READ(bucket), nsecs_to_jiffies(left));
     }
   } else {
-    int i = start % BUCKET_CNT;
-
-    assert(start + 1 == end);
-    rl->bucket = i;
-    rl->node[i] = InitNode(start, 1, writer);
-    
-    do {
-      ret = InsertNodeRW(&list_rl->head[i], rl->node[i], true);
-      if (ret < 0) {
-        mem_free(rl->node[i]);
-        mem_free(rl);
-        return NULL;
+    wait_event(*rl_waitqueue(&bucket->pending), !PENDING_READ(bucket));
+  }
+  clear = !PENDING_READ(bucket);
+#else
+  clear = RL_SPIN_UNTIL(!PENDING_READ(bucket), trace->deadline);
+#endif
+  trace->wait_ns += RL_NOW_NS() - start;
+  return clear;
+}
+
+static void PendingPut(struct rl_bucket* bucket) {
+  if (PENDING_DEC_AND_TEST(bucket)) {
+#if IN_KERNEL2
+    wake_up_all(rl_waitqueue(&bucket->pending));
+#endif
+  }
+}
+
+/* Links one node per bucket of @table touched by [start, end) */
+static bool AcquireNodes(struct ListRL* list_rl, struct RangeLock* rl,
+  unsigned long long start,
+  unsigned long long end,
+  bool writer,
+  bool try,
+  struct rl_trace* trace) {
+  struct rl_table* table = rl->table;
+  struct rl_skip_head* skip = GetSkip(list_rl, table, writer);
+  bool fair = list_rl->fair;
+  unsigned long long first = start >> RL_CHUNK_SHIFT;
+  unsigned long long chunks = end > start ?
+    ((end - 1) >> RL_CHUNK_SHIFT) - first + 1 : 1;
+
+  if (chunks >= table->nr_bucket) {
+    rl->bucket = 0;
+    rl->nr_bucket = table->nr_bucket;
+  } else {
+    rl->bucket = first & (table->nr_bucket - 1);
+    rl->nr_bucket = chunks;
+  }
+
+  // Buckets are always taken in ascending order, so two ranges that share
+  // several buckets can not end up waiting for each other.
+  for (unsigned int i = 0 ; i < table->nr_bucket ; i++) {
+    struct rl_bucket* bucket = &table->bucket[i];
+
+    if (!range_in_bucket(rl, i)) {
+      continue;
+    }
+    rl->node[i] = NULL;
+    if (fair && writer && !try) {
+      PENDING_INC(bucket);
+      rl->node[i] = AcquireNode(&bucket->head, skip ? &skip[i] : NULL,
+          start, end, writer, try, trace);
+      PendingPut(bucket);
+    } else if (!fair || writer || WaitPending(bucket, try, trace)) {
+      rl->node[i] = AcquireNode(&bucket->head, skip ? &skip[i] : NULL,
+          start, end, writer, try, trace);
+    }
+    if (!rl->node[i]) {
+      for (int j = i - 1 ; j >= 0 ; j--) {
+        // Deferred Physical deletion of already inserted node
+        if (range_in_bucket(rl, j)) {
+          ReleaseNode(rl->node[j]);
+        }
       }
-    } while(ret);
+      return false;
+    }
+  }
+  return true;
+}
+
+static struct RangeLock* RWRangeLock(
+  struct ListRL* list_rl,
+  unsigned long long start,
+  unsigned long long end,
+  bool writer,
+  bool try,
+  struct rl_trace* trace) {
+  struct RangeLock* rl = range_alloc();
 
+  STAT_INC(acquire);
+  STAT_INC(range_alloc);
+  rl->sem = NULL;
+  rl->list_rl = list_rl;
+  if (end > MAX_SIZE) {
+    end = MAX_SIZE;
   }
-  return rl;
-#else
-  rl->node = InitNode(start, end, writer);
+  assert(start <= end);
 
-  do {
-    ret = InsertNodeRW(&list_rl->head, rl->node, true);
-    if (ret < 0) {
-      mem_free(rl->node);
-      mem_free(rl);
+  while (true) {
+    rl->table = SKIP_READ(list_rl->table);
+    if (!AcquireNodes(list_rl, rl, start, end, writer, try, trace)) {
+      range_free(rl);
       return NULL;
     }
-  } while(ret); 
+    // A resize swaps tables while holding the whole old one, so ranges
+    // granted in a table that is no longer current must be taken again.
+    // Order the check after the reads that saw the resizer's nodes go.
+    RL_MB();
+    if (SKIP_READ(list_rl->table) == rl->table) {
+      break;
+    }
+    ReleaseNodes(rl);
+    trace->restart++;
+  }
   return rl;
-#endif
+}
+
+static unsigned int rl_buckets_for(unsigned long long blocks) {
+  unsigned long long chunks = blocks >> RL_CHUNK_SHIFT;
+  unsigned int nr = 1;
+
+  while (nr < chunks && nr < BUCKET_CNT) {
+    nr <<= 2;
+  }
+  return nr < BUCKET_CNT ? nr : BUCKET_CNT;
+}
+
+/* Remembers the largest size a resize could not be done for yet */
+static void rl_resize_defer(struct ListRL* list_rl, unsigned long long blocks) {
+  unsigned long size = blocks < MAX_SIZE ? blocks : MAX_SIZE;
+  unsigned long cur;
+
+  do {
+    cur = SKIP_READ(list_rl->resize_blocks);
+    if (cur >= size) {
+      return;
+    }
+  } while (!(CAS(&list_rl->resize_blocks, cur, size)));
+}
+
+/* Forgets a deferred size that a table of @blocks blocks covers */
+static void rl_resize_done(struct ListRL* list_rl, unsigned long long blocks) {
+  unsigned long cur = SKIP_READ(list_rl->resize_blocks);
+
+  while (cur && cur <= blocks &&
+      !(CAS(&list_rl->resize_blocks, cur, 0UL))) {
+    cur = SKIP_READ(list_rl->resize_blocks);
+  }
+}
+
+/*
+ * Moves @list_rl to a table sized for a file of @blocks blocks. The swap
+ * happens under a try-acquired exclusive lock of the whole current table,
+ * so it never waits. While anything is held the size is kept in
+ * @resize_blocks, and whoever releases a range next tries again; callers
+ * may therefore hold a range of the same lock.
+ */
+void RWRangeResize(struct ListRL* list_rl, unsigned long long blocks) {
+  struct rl_table* table = SKIP_READ(list_rl->table);
+  unsigned int nr = rl_buckets_for(blocks);
+  struct rl_table* new_table;
+  struct RangeLock* rl;
+  struct rl_trace trace = {};
+
+  if (nr <= table->nr_bucket) {
+    rl_resize_done(list_rl, blocks);
+    return;
+  }
+  new_table = table_alloc(nr);
+  if (!new_table) {
+    rl_resize_defer(list_rl, blocks);
+    return;
+  }
+  new_table->nr_bucket = nr;
+
+  rl = range_alloc();
+  rl->sem = NULL;
+  rl->table = table;
+  rl->list_rl = list_rl;
+  if (!AcquireNodes(list_rl, rl, 0, MAX_SIZE, true, true, &trace)) {
+    range_free(rl);
+    table_free(new_table);
+    rl_resize_defer(list_rl, blocks);
+    return;
+  }
+  if (SKIP_READ(list_rl->table) == table) {
+    new_table->old = table;
+    SKIP_PUBLISH(list_rl->table, new_table);
+  } else {
+    table_free(new_table);
+  }
+  MutexRangeRelease(rl);
+  rl_resize_done(list_rl, blocks);
+}
+
+/* Retries a resize that found the lock held, once a range was released */
+static void rl_resize_pending(struct ListRL* list_rl) {
+  unsigned long blocks = SKIP_READ(list_rl->resize_blocks);
+
+  if (blocks) {
+    RWRangeResize(list_rl, blocks);
+  }
+}
+
+void resize_f3fs_rwsem3(struct f3fs_rwsem3* sem, unsigned long long blocks) {
+  RWRangeResize(&sem->list_rl, blocks);
+}
+
+struct RangeLock* RWRangeTryAcquire(
+  struct ListRL* list_rl,
+  unsigned long long start,
+  unsigned long long end,
+  bool writer) {
+  struct rl_trace trace = {};
+
+  return RWRangeLock(list_rl, start, end, writer, true, &trace);
 }
 
 struct RangeLock* RWRangeAcquire(
@@ -293,38 +1257,368 @@ struct RangeLock* RWRangeAcquire(
   unsigned long long start,
   unsigned long long end,
   bool writer) {
-  struct RangeLock* rl = mem_alloc(sizeof(struct RangeLock));
-  int ret = 0;
+  struct rl_trace trace = {};
+
+  return RWRangeLock(list_rl, start, end, writer, false, &trace);
+}
+
+#if IN_KERNEL2
+/* A fast-path reader holds no RangeLock, only a tagged pointer to the sem. */
+#define RL_FAST_READER(sem) ((struct RangeLock*)((unsigned long)(sem) | 0x1))
+
+static int fast_readers(struct f3fs_rwsem3* sem) {
+  int __percpu* read_count = READ_ONCE(sem->read_count);
+  int sum = 0;
+  int cpu;
+
+  if (!read_count) {
+    return 0;
+  }
+  for_each_possible_cpu(cpu) {
+    sum += *per_cpu_ptr(read_count, cpu);
+  }
+  return sum;
+}
 
-#if HASH_MODE
-  if (end == MAX_SIZE) {
-    assert(start == 0);
-    rl->bucket = ALL_RANGE;
-    for (int i = 0 ; i < BUCKET_CNT ; i++) {
-      rl->node[i] = InitNode(0, MAX_SIZE, writer);
+static bool fast_read_acquire(struct f3fs_rwsem3* sem) {
+  int __percpu* read_count = READ_ONCE(sem->read_count);
 
-      do {
-        ret = InsertNodeRW(&list_rl->head[i], rl->node[i], false);
-      } while(ret);
+  if (atomic_read(&sem->slow)) {
+    return false;
+  }
+  if (!read_count) {
+    read_count = alloc_percpu_gfp(int, GFP_NOWAIT | __GFP_NOWARN);
+    if (!read_count) {
+      return false;
+    }
+    if (cmpxchg(&sem->read_count, NULL, read_count)) {
+      free_percpu(read_count);
+      read_count = READ_ONCE(sem->read_count);
+    }
+  }
+
+  this_cpu_inc(*read_count);
+  // Pairs with the barrier after an exclusive locker raises @slow.
+  smp_mb();
+  if (likely(!atomic_read(&sem->slow))) {
+    return true;
+  }
+  this_cpu_dec(*read_count);
+  wake_up_all(rl_waitqueue(sem));
+  return false;
+}
+
+static void fast_read_release(struct f3fs_rwsem3* sem) {
+  this_cpu_dec(*sem->read_count);
+  smp_mb();
+  if (atomic_read(&sem->slow)) {
+    wake_up_all(rl_waitqueue(sem));
+  }
+}
+
+/*
+ * Once an exclusive locker saw the fast readers drained, none can come
+ * back until @slow drops to zero, so the lockers that pile on meanwhile
+ * skip summing the per-CPU counts. The last one out clears the mark,
+ * unless somebody raised @slow again in between.
+ */
+#define RL_SLOW_DRAINED (1)
+#define RL_SLOW_ONE (2)
+
+static void slow_mode_exit(struct f3fs_rwsem3* sem) {
+  smp_mb__before_atomic();
+  if (atomic_sub_return(RL_SLOW_ONE, &sem->slow) == RL_SLOW_DRAINED) {
+    atomic_cmpxchg(&sem->slow, RL_SLOW_DRAINED, 0);
+  }
+}
+
+static bool slow_mode_enter(struct f3fs_rwsem3* sem, bool try,
+  struct rl_trace* trace) {
+  u64 start;
+
+  if (atomic_add_return(RL_SLOW_ONE, &sem->slow) & RL_SLOW_DRAINED) {
+    return true;
+  }
+  if (!fast_readers(sem)) {
+    atomic_or(RL_SLOW_DRAINED, &sem->slow);
+    return true;
+  }
+  if (try) {
+    slow_mode_exit(sem);
+    return false;
+  }
+  start = ktime_get_ns();
+  if (trace->deadline) {
+    s64 left = trace->deadline - start;
+
+    if (left <= 0 || !wait_event_timeout(*rl_waitqueue(sem),
+          !fast_readers(sem), nsecs_to_jiffies(left))) {
+      trace->wait_ns += ktime_get_ns() - start;
+      slow_mode_exit(sem);
+      return false;
     }
   } else {
-    int i = start % BUCKET_CNT;
+    wait_event(*rl_waitqueue(sem), !fast_readers(sem));
+  }
+  trace->wait_ns += ktime_get_ns() - start;
+  atomic_or(RL_SLOW_DRAINED, &sem->slow);
+  return true;
+}
 
-    assert(start + 1 == end);
-    rl->bucket = i;
-    rl->node[i] = InitNode(start, 1, writer);
-   do {
-      ret = InsertNodeRW(&list_rl->head[i], rl->node[i], false);
-    } while(ret);
+static void rl_account(struct f3fs_rwsem3* sem, enum rl_site site,
+  unsigned long long start, unsigned long long end, bool writer,
+  struct RangeLock* rl, struct rl_trace* trace) {
+  struct rl_site_stat __percpu* stat;
+  bool full = start == 0 && end >= MAX_SIZE;
 
+  if (!sem->stat) {
+    return;
+  }
+  stat = &sem->stat->site[site];
+  if (!rl) {
+    this_cpu_inc(stat->try_fail);
+  } else if (writer) {
+    if (full) {
+      this_cpu_inc(stat->excl_full);
+    } else {
+      this_cpu_inc(stat->excl_range);
+    }
+  } else {
+    if (full) {
+      this_cpu_inc(stat->shared_full);
+    } else {
+      this_cpu_inc(stat->shared_range);
+    }
   }
+  if (trace->cas_retry) {
+    this_cpu_add(stat->cas_retry, trace->cas_retry);
+  }
+  if (trace->restart) {
+    this_cpu_add(stat->restart, trace->restart);
+  }
+  if (trace->wait_ns) {
+    this_cpu_add(stat->wait_ns, trace->wait_ns);
+  }
+}
+
+static struct RangeLock* RWSemLock(
+  struct f3fs_rwsem3* sem,
+  unsigned long long start,
+  unsigned long long end,
+  bool writer,
+  bool try,
+  struct rl_trace* trace) {
+  struct RangeLock* rl;
+
+  if (!writer) {
+    if (start == 0 && end >= MAX_SIZE && fast_read_acquire(sem)) {
+      return RL_FAST_READER(sem);
+    }
+    return RWRangeLock(&sem->list_rl, start, end, false, try, trace);
+  }
+
+  if (!slow_mode_enter(sem, try, trace)) {
+    return NULL;
+  }
+  rl = RWRangeLock(&sem->list_rl, start, end, true, try, trace);
+  if (!rl) {
+    slow_mode_exit(sem);
+    return NULL;
+  }
+  rl->sem = sem;
   return rl;
+}
+
+void RWSemRelease(struct RangeLock* rl) {
+  struct f3fs_rwsem3* sem;
+  struct ListRL* list_rl;
+
+  // Fast readers are not in the list, so they never hold up a resize.
+  if ((unsigned long)rl & 0x1) {
+    fast_read_release((struct f3fs_rwsem3*)((unsigned long)rl & ~0x1UL));
+    return;
+  }
+  sem = rl->sem;
+  list_rl = rl->list_rl;
+  MutexRangeRelease(rl);
+  if (sem) {
+    slow_mode_exit(sem);
+  }
+  rl_resize_pending(list_rl);
+}
 #else
-  rl->node = InitNode(start, end, writer);
+#define rl_account(sem, site, start, end, writer, rl, trace)
 
-  do {
-    ret = InsertNodeRW(&list_rl->head, rl->node, false);
-  } while(ret); 
+static struct RangeLock* RWSemLock(
+  struct f3fs_rwsem3* sem,
+  unsigned long long start,
+  unsigned long long end,
+  bool writer,
+  bool try,
+  struct rl_trace* trace) {
+  return RWRangeLock(&sem->list_rl, start, end, writer, try, trace);
+}
+
+void RWSemRelease(struct RangeLock* rl) {
+  struct ListRL* list_rl = rl->list_rl;
+
+  MutexRangeRelease(rl);
+  rl_resize_pending(list_rl);
+}
+#endif
+
+struct RangeLock* RWSemTryAcquire(
+  struct f3fs_rwsem3* sem,
+  unsigned long long start,
+  unsigned long long end,
+  bool writer,
+  enum rl_site site) {
+  struct rl_trace trace = {};
+  struct RangeLock* rl = RWSemLock(sem, start, end, writer, true, &trace);
+
+  rl_account(sem, site, start, end, writer, rl, &trace);
+  return rl;
+}
+
+struct RangeLock* RWSemAcquire(
+  struct f3fs_rwsem3* sem,
+  unsigned long long start,
+  unsigned long long end,
+  bool writer,
+  enum rl_site site) {
+  struct rl_trace trace = {};
+  struct RangeLock* rl = RWSemLock(sem, start, end, writer, false, &trace);
+
+  rl_account(sem, site, start, end, writer, rl, &trace);
+  return rl;
+}
+
+struct RangeLock* RWSemAcquireTimeout(
+  struct f3fs_rwsem3* sem,
+  unsigned long long start,
+  unsigned long long end,
+  bool writer,
+  enum rl_site site,
+  unsigned long long timeout_ns) {
+  struct rl_trace trace = {};
+  struct RangeLock* rl;
+
+  trace.deadline = RL_NOW_NS() + timeout_ns;
+  rl = RWSemLock(sem, start, end, writer, false, &trace);
+  rl_account(sem, site, start, end, writer, rl, &trace);
   return rl;
+}
+
+#if IN_KERNEL2
+/*
+ * A batch of exclusive runs drains the fast readers once; each run it
+ * takes then keeps @slow raised on its own until released.
+ */
+static bool batch_enter(struct f3fs_rwsem3* sem, bool writer,
+  struct rl_trace* trace) {
+  return !writer || slow_mode_enter(sem, true, trace);
+}
+
+static void batch_exit(struct f3fs_rwsem3* sem, bool writer) {
+  if (writer) {
+    slow_mode_exit(sem);
+  }
+}
+
+static struct RangeLock* batch_lock(
+  struct f3fs_rwsem3* sem,
+  unsigned long long start,
+  unsigned long long end,
+  bool writer,
+  struct rl_trace* trace) {
+  struct RangeLock* rl;
+
+  if (!writer) {
+    return RWSemLock(sem, start, end, false, true, trace);
+  }
+  rl = RWRangeLock(&sem->list_rl, start, end, true, true, trace);
+  if (rl) {
+    atomic_add(RL_SLOW_ONE, &sem->slow);
+    rl->sem = sem;
+  }
+  return rl;
+}
+#else
+#define batch_enter(sem, writer, trace) ((void)(trace), true)
+#define batch_exit(sem, writer)
+#define batch_lock(sem, start, end, writer, trace) \
+  RWSemLock(sem, start, end, writer, true, trace)
 #endif
+
+static struct RangeLock* batch_try(
+  struct f3fs_rwsem3* sem,
+  unsigned long long start,
+  unsigned long long end,
+  bool writer,
+  enum rl_site site) {
+  struct rl_trace trace = {};
+  struct RangeLock* rl = batch_lock(sem, start, end, writer, &trace);
+
+  rl_account(sem, site, start, end, writer, rl, &trace);
+  return rl;
+}
+
+unsigned int RWSemTryAcquireBatch(
+  struct f3fs_rwsem3* sem,
+  const unsigned int* blocks,
+  unsigned int nr,
+  bool writer,
+  enum rl_site site,
+  struct RangeLock** ranges,
+  bool* held) {
+  struct rl_trace trace = {};
+  unsigned int acquired = 0;
+  unsigned int i = 0;
+  unsigned int j;
+  unsigned int k;
+
+  memset(ranges, 0, nr * sizeof(*ranges));
+  memset(held, 0, nr * sizeof(*held));
+  if (!nr) {
+    return 0;
+  }
+  if (!batch_enter(sem, writer, &trace)) {
+    rl_account(sem, site, blocks[0], blocks[nr - 1] + 1ULL, writer, NULL,
+      &trace);
+    return 0;
+  }
+
+  while (i < nr) {
+    for (j = i + 1; j < nr && blocks[j] == blocks[j - 1] + 1; j++)
+      ;
+    ranges[i] = batch_try(sem, blocks[i], blocks[j - 1] + 1ULL, writer, site);
+    if (ranges[i]) {
+      for (k = i; k < j; k++) {
+        held[k] = true;
+      }
+      acquired += j - i;
+    } else if (j - i > 1) {
+      // Somebody holds part of the run, take what is left of it.
+      for (k = i; k < j; k++) {
+        ranges[k] = batch_try(sem, blocks[k], blocks[k] + 1ULL, writer, site);
+        held[k] = ranges[k] != NULL;
+        acquired += held[k];
+      }
+    }
+    i = j;
+  }
+
+  batch_exit(sem, writer);
+  return acquired;
+}
+
+void RWSemReleaseBatch(struct RangeLock** ranges, unsigned int nr) {
+  unsigned int i;
+
+  for (i = 0; i < nr; i++) {
+    if (ranges[i]) {
+      RWSemRelease(ranges[i]);
+      ranges[i] = NULL;
+    }
+  }
 }
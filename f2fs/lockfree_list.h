@@ -1,65 +1,206 @@
+#ifndef IN_KERNEL2
 #define IN_KERNEL2 (1)
+#endif
 
 #if IN_KERNEL2
 #include <linux/types.h>
 #include <linux/rcupdate.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/wait.h>
+#include <linux/hash.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/random.h>
 #else
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <glib.h>
 #include <stdio.h>
+#include <time.h>
 #endif
 
+#ifndef HASH_MODE
 #define HASH_MODE (1)
+#endif
+/*
+ * Blocks hash by aligned chunk, so a contiguous range only touches the
+ * buckets of the chunks it spans. BUCKET_CNT bounds the buckets of a table.
+ */
 #if HASH_MODE
 #define BUCKET_CNT (32)
+#define RL_CHUNK_SHIFT (6)
+#else
+#define BUCKET_CNT (1)
+#define RL_CHUNK_SHIFT (0)
 #endif
 
 #define MAX_SIZE (0xFFFFFFFF)
-#define ALL_RANGE (0xFFFFFFFF)
+
+/* Index levels above the list itself, each one about 1/4 as dense */
+#define RL_SKIP_LEVELS (6)
+
+struct rl_skip_head;
+struct rl_skip_tower;
 
 struct LNode {
   unsigned int start;
   unsigned int end;
   volatile struct LNode* next;
   unsigned int reader;
+  struct LNode* free_next;  /* chains nodes waiting for the same grace period */
 #if IN_KERNEL2
   struct rcu_head rcu;
+  atomic_t ref;             /* list reference plus one per sleeping waiter */
 #endif
+  struct rl_skip_tower* skip;  /* index links, NULL if never indexed */
 };
 
-struct ListRL {
-#if HASH_MODE
-  volatile struct LNode* head[BUCKET_CNT];
+/*
+ * Index links of a writer, allocated when it enters the index so that the
+ * nodes of locks without one stay small. They go away with the node, as
+ * lookups may still stand on it after it left the index.
+ */
+struct rl_skip_tower {
+  struct rl_skip_head* head;  /* index holding the node, NULL once out */
+  volatile struct LNode* next[RL_SKIP_LEVELS];
+};
+
+/*
+ * Skip-list index over the validated writers of one list. Lookups walk it
+ * under RCU_LOCK(); only linking and unlinking take @lock. A writer leaves
+ * the index before it is marked, so an indexed node is never reclaimed.
+ */
+struct rl_skip_head {
+#if IN_KERNEL2
+  spinlock_t lock;
 #else
+  pthread_mutex_t lock;
+#endif
+  volatile struct LNode* next[RL_SKIP_LEVELS];
+};
+
+struct rl_bucket {
   volatile struct LNode* head;
+#if IN_KERNEL2
+  atomic_t pending;  /* writers waiting to get in, fair mode only */
+#else
+  int pending;
 #endif
 };
 
+/*
+ * Buckets of a ListRL. A table only grows: the bigger one replaces it
+ * while its whole range is held, and the old one stays chained on @old
+ * until the lock is destroyed, as late lockers may still be walking it.
+ */
+struct rl_table {
+  unsigned int nr_bucket;       /* power of two, at most BUCKET_CNT */
+  struct rl_table* old;
+  struct rl_skip_head* skip;    /* allocated by the first indexed writer */
+  struct rl_bucket bucket[1];   /* nr_bucket entries */
+};
+
+struct ListRL {
+  struct rl_table* table;
+  struct rl_table single;  /* one bucket, until the file grows */
+  bool skiplist;           /* index writers, set before the first acquire */
+  bool fair;               /* new readers yield to waiting writers */
+  unsigned long resize_blocks;  /* size a resize found held, 0 if none */
+};
+
+struct f3fs_rwsem3;
+
 struct RangeLock {
-#if HASH_MODE
+  struct f3fs_rwsem3* sem;  /* set when taken through RWSemAcquire() */
+  struct rl_table* table;   /* the table the nodes were linked in */
+  struct ListRL* list_rl;   /* the lock the range was taken from */
   struct LNode* node[BUCKET_CNT];
-  unsigned int bucket;
-#else
-  struct LNode* node;
-#endif
+  unsigned int bucket;     /* first bucket covered by the range */
+  unsigned int nr_bucket;  /* buckets covered, wrapping after the last */
+};
+
+/* Callers of the f3fs_rwsem3 locks, for the per-superblock counters */
+enum rl_site {
+  RL_SITE_OTHER,
+  RL_SITE_GC_PHASE3,  /* gc_data_segment() readahead */
+  RL_SITE_GC_PHASE4,  /* gc_data_segment() block move */
+  RL_SITE_DIO_READ,
+  RL_SITE_DIO_WRITE,
+  RL_SITE_FALLOCATE,  /* punch, collapse, zero and insert range */
+  RL_SITE_TRUNCATE,   /* setattr and failed writes */
+  RL_SITE_MAX,
+};
+
+/* Contention counters of one call site */
+struct rl_site_stat {
+  unsigned long shared_range;   /* shared acquisitions of a block range */
+  unsigned long shared_full;    /* shared acquisitions of the whole file */
+  unsigned long excl_range;     /* exclusive acquisitions of a block range */
+  unsigned long excl_full;      /* exclusive acquisitions of the whole file */
+  unsigned long try_fail;       /* trylocks that found the range busy */
+  unsigned long cas_retry;      /* lost CAS races while linking a node */
+  unsigned long restart;        /* validations that had to start over */
+  unsigned long long wait_ns;   /* time spent waiting for the range */
 };
 
+/* Per-CPU counters of one superblock, shared by all its inodes */
+struct rl_sem_stat {
+  struct rl_site_stat site[RL_SITE_MAX];
+};
+
+/*
+ * Shared acquisitions of the whole file normally skip the list: they only
+ * bump a per-CPU reader count, allocated the first time the lock is
+ * read-locked. Ranged readers always use the list, so they never hold off
+ * writers of other blocks. An exclusive locker raises @slow, which sends
+ * new readers to the list, and waits for the per-CPU count to drain before
+ * inserting its own nodes.
+ */
 struct f3fs_rwsem3 {
   struct ListRL list_rl;
+#if IN_KERNEL2
+  int __percpu* read_count;
+  atomic_t slow;  /* RL_SLOW_ONE per exclusive locker, | RL_SLOW_DRAINED */
+  struct rl_sem_stat __percpu* stat;  /* NULL if not accounted */
+#endif
 };
 
-void init_f3fs_rwsem3(struct f3fs_rwsem3* sem);
-#if HASH_MODE
-#else
-struct RangeLock* MutexRangeAcquire(struct ListRL* list_rl,
-  unsigned int start,
-  unsigned int end,
-  bool try);
+/* Per-CPU counters of the LNode/RangeLock pool */
+struct rl_pool_stat {
+  unsigned long acquire;      /* range acquisitions */
+  unsigned long lnode_alloc;  /* LNodes handed out, retries included */
+  unsigned long range_alloc;  /* RangeLocks handed out */
+  unsigned long slab_alloc;   /* magazine misses served by the slab */
+  unsigned long rcu_batch;    /* call_rcu() batches of unlinked nodes */
+};
+
+/* Per-CPU counters of waits on a conflicting range */
+struct rl_wait_stat {
+  unsigned long spin;             /* waits that ended while spinning */
+  unsigned long sleep;            /* waits that had to sleep */
+  unsigned long long wait_ns;     /* total time spent waiting */
+  unsigned long long max_wait_ns; /* longest single wait */
+};
+
+#if IN_KERNEL2
+int f3fs_create_range_lock_cache(void);
+void f3fs_destroy_range_lock_cache(void);
+void f3fs_range_lock_pool_stat(struct rl_pool_stat* stat);
+void f3fs_range_lock_wait_stat(struct rl_wait_stat* stat);
+void f3fs_range_lock_site_stat(struct rl_sem_stat __percpu* percpu,
+  enum rl_site site, struct rl_site_stat* stat);
 #endif
+
+void init_f3fs_rwsem3(struct f3fs_rwsem3* sem);
+void destroy_f3fs_rwsem3(struct f3fs_rwsem3* sem);
+void resize_f3fs_rwsem3(struct f3fs_rwsem3* sem, unsigned long long blocks);
 void MutexRangeRelease(struct RangeLock* rl);
 
+void RWRangeResize(struct ListRL* list_rl, unsigned long long blocks);
+
 struct RangeLock* RWRangeTryAcquire(
   struct ListRL* list_rl,
   unsigned long long start,
@@ -72,3 +213,49 @@ struct RangeLock* RWRangeAcquire(
   unsigned long long end,
   bool writer);
 
+struct RangeLock* RWSemTryAcquire(
+  struct f3fs_rwsem3* sem,
+  unsigned long long start,
+  unsigned long long end,
+  bool writer,
+  enum rl_site site);
+
+struct RangeLock* RWSemAcquire(
+  struct f3fs_rwsem3* sem,
+  unsigned long long start,
+  unsigned long long end,
+  bool writer,
+  enum rl_site site);
+
+/*
+ * Like RWSemAcquire(), but gives up and returns NULL once @timeout_ns has
+ * passed without getting the range.
+ */
+struct RangeLock* RWSemAcquireTimeout(
+  struct f3fs_rwsem3* sem,
+  unsigned long long start,
+  unsigned long long end,
+  bool writer,
+  enum rl_site site,
+  unsigned long long timeout_ns);
+
+void RWSemRelease(struct RangeLock* rl);
+
+/*
+ * Try-acquires the @nr strictly ascending @blocks in one call. Contiguous
+ * blocks share a RangeLock and a busy run falls back to its single blocks.
+ * @ranges[i] holds the lock of the run starting at blocks[i], NULL
+ * elsewhere, and @held[i] tells whether blocks[i] was acquired. Returns
+ * the number of blocks acquired; release them with RWSemReleaseBatch().
+ */
+unsigned int RWSemTryAcquireBatch(
+  struct f3fs_rwsem3* sem,
+  const unsigned int* blocks,
+  unsigned int nr,
+  bool writer,
+  enum rl_site site,
+  struct RangeLock** ranges,
+  bool* held);
+
+void RWSemReleaseBatch(struct RangeLock** ranges, unsigned int nr);
+
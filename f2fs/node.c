@@ -1571,7 +1571,8 @@ continue_unlock:
 
 static int __write_node_page(struct page *page, bool atomic, bool *submitted,
 				struct writeback_control *wbc, bool do_balance,
-				enum iostat_type io_type, unsigned int *seq_id)
+				enum iostat_type io_type, unsigned int *seq_id,
+				char dst_hint)
 {
 	struct f3fs_sb_info *sbi = F3FS_P_SB(page);
 	nid_t nid;
@@ -1587,10 +1588,14 @@ static int __write_node_page(struct page *page, bool atomic, bool *submitted,
 		.submitted = false,
 		.io_type = io_type,
 		.io_wbc = wbc,
-    .dst_hint = -1,
+		.dst_hint = dst_hint,
 	};
 	unsigned int seq;
 
+	/* a GC worker's node log has a bio of its own, like its data log */
+	if (dst_hint >= 0)
+		fio.temp = COLD_GC_START + dst_hint;
+
 	trace_f3fs_writepage(page, NODE);
 
 	if (unlikely(f3fs_cp_error(sbi))) {
@@ -1680,11 +1685,16 @@ redirty_out:
 	return AOP_WRITEPAGE_ACTIVATE;
 }
 
-int f3fs_move_node_page(struct page *node_page, int gc_type)
+/*
+ * @dst_hint >= 0 is the GC worker moving @node_page: the page is written
+ * right away into that worker's node log, whatever @gc_type is, so workers
+ * do not all queue on the shared node logs.
+ */
+int f3fs_move_node_page(struct page *node_page, int gc_type, char dst_hint)
 {
 	int err = 0;
 
-	if (gc_type == FG_GC) {
+	if (gc_type == FG_GC || dst_hint >= 0) {
 		struct writeback_control wbc = {
 			.sync_mode = WB_SYNC_ALL,
 			.nr_to_write = 1,
@@ -1701,7 +1711,8 @@ int f3fs_move_node_page(struct page *node_page, int gc_type)
 		}
 
 		if (__write_node_page(node_page, false, NULL,
-					&wbc, false, FS_GC_NODE_IO, NULL)) {
+					&wbc, false, FS_GC_NODE_IO, NULL,
+					dst_hint)) {
 			err = -EAGAIN;
 			unlock_page(node_page);
 		}
@@ -1722,7 +1733,7 @@ static int f3fs_write_node_page(struct page *page,
 				struct writeback_control *wbc)
 {
 	return __write_node_page(page, false, NULL, wbc, false,
-						FS_NODE_IO, NULL);
+						FS_NODE_IO, NULL, -1);
 }
 
 int f3fs_fsync_node_pages(struct f3fs_sb_info *sbi, struct inode *inode,
@@ -1808,7 +1819,7 @@ continue_unlock:
 			ret = __write_node_page(page, atomic &&
 						page == last_page,
 						&submitted, wbc, true,
-						FS_NODE_IO, seq_id);
+						FS_NODE_IO, seq_id, -1);
 			if (ret) {
 				unlock_page(page);
 				f3fs_put_page(last_page, 0);
@@ -2017,7 +2028,7 @@ write_node:
 			set_dentry_mark(page, 0);
 
 			ret = __write_node_page(page, false, &submitted,
-						wbc, do_balance, io_type, NULL);
+						wbc, do_balance, io_type, NULL, -1);
 			if (ret)
 				unlock_page(page);
 			else if (submitted)
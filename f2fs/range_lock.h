@@ -1,4 +1,6 @@
+#ifndef IN_KERNEL
 #define IN_KERNEL (1)
+#endif
 
 #if IN_KERNEL
 typedef struct rw_semaphore my_lock_t;
@@ -167,6 +169,7 @@ struct f3fs_range* f3fs_alloc_range(unsigned start, unsigned size)
   return ret;
 }
 
+#if IN_KERNEL
 static bool is_less(struct rb_node* node, const struct rb_node* parent) {
   struct f3fs_range* node_range = rb_entry(node, struct f3fs_range, node);
   struct f3fs_range* parent_range = rb_entry(parent, struct f3fs_range, node);
@@ -176,6 +179,7 @@ static bool is_less(struct rb_node* node, const struct rb_node* parent) {
     return false;
   }
 }
+#endif
 
 static inline void f3fs_insert_range2(
   struct f3fs_rwsem2* head, struct f3fs_range* new_range)
@@ -196,6 +200,8 @@ static inline void f3fs_remove_range(
   kfree(del_range);
 #else
   head->locked_ranges = g_list_remove(head->locked_ranges, (gpointer) del_range);
+  pthread_rwlock_destroy(&del_range->internal_lock);
+  free(del_range);
 #endif
 }
 
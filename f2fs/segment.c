@@ -17,6 +17,7 @@
 #include <linux/freezer.h>
 #include <linux/sched/signal.h>
 #include <linux/random.h>
+#include <linux/sort.h>
 
 #include "f3fs.h"
 #include "segment.h"
@@ -358,7 +359,7 @@ int f3fs_commit_atomic_write(struct inode *inode)
 	if (err)
 		return err;
 
-	range = f3fs_down_write3(&fi->i_gc_rwsem[WRITE]);
+	range = f3fs_down_write3(&fi->i_gc_rwsem[WRITE], RL_SITE_OTHER);
 	f3fs_lock_op(sbi);
 
 	err = __f3fs_commit_atomic_write(inode);
@@ -392,23 +393,24 @@ void f3fs_balance_fs(struct f3fs_sb_info *sbi, bool need)
 	 * dir/node pages without enough free segments.
 	 */
 	if (has_not_enough_free_secs(sbi, 0, 0)) {
+		struct f3fs_gc_control gc_control = {
+			.victim_segno = NULL_SEGNO,
+			.init_gc_type = BG_GC,
+			.no_bg_gc = true,
+			.should_migrate_blocks = false,
+			.err_gc_skipped = false,
+			.nr_free_secs = 1 };
+		struct f3fs_gc_request *req = ERR_PTR(-ESRCH);
+
 		if (test_opt(sbi, GC_MERGE) && sbi->gc_thread &&
-					sbi->gc_thread->f3fs_gc_task) {
-			DEFINE_WAIT(wait);
-
-			prepare_to_wait(&sbi->gc_thread->fggc_wq, &wait,
-						TASK_UNINTERRUPTIBLE);
-			wake_up(&sbi->gc_thread->gc_wait_queue_head);
-			io_schedule();
-			finish_wait(&sbi->gc_thread->fggc_wq, &wait);
+					sbi->gc_thread->f3fs_gc_task)
+			req = f3fs_gc_submit(sbi, &gc_control);
+
+		if (!IS_ERR(req)) {
+			/* back as soon as a section is freed */
+			f3fs_gc_wait(req, 1);
+			f3fs_gc_put_request(req);
 		} else {
-			struct f3fs_gc_control gc_control = {
-				.victim_segno = NULL_SEGNO,
-				.init_gc_type = BG_GC,
-				.no_bg_gc = true,
-				.should_migrate_blocks = false,
-				.err_gc_skipped = false,
-				.nr_free_secs = 1 };
 			f3fs_down_write(&sbi->gc_lock);
 			f3fs_gc(sbi, &gc_control);
 		}
@@ -706,6 +708,96 @@ int f3fs_flush_device_cache(struct f3fs_sb_info *sbi)
 
 	return ret;
 }
+
+static unsigned char dirty_index_bucket(struct f3fs_sb_info *sbi,
+						unsigned int segno)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+
+	if (!test_bit(segno, dirty_i->dirty_segmap[DIRTY]))
+		return DIRTY_INDEX_NONE;
+	return min_t(unsigned int, DIRTY_INDEX_BUCKETS - 1,
+		get_valid_blocks(sbi, segno, false) >> dirty_i->index.shift);
+}
+
+static void __dirty_index_unlink(struct dirty_index *di, unsigned int segno)
+{
+	unsigned char b = di->bucket[segno];
+
+	if (di->prev[segno] == NULL_SEGNO)
+		di->head[b] = di->next[segno];
+	else
+		di->next[di->prev[segno]] = di->next[segno];
+	if (di->next[segno] != NULL_SEGNO)
+		di->prev[di->next[segno]] = di->prev[segno];
+	di->count[b]--;
+	WRITE_ONCE(di->bucket[segno], DIRTY_INDEX_NONE);
+}
+
+static void __dirty_index_link(struct dirty_index *di, unsigned int segno,
+						unsigned char b)
+{
+	di->prev[segno] = NULL_SEGNO;
+	di->next[segno] = di->head[b];
+	if (di->head[b] != NULL_SEGNO)
+		di->prev[di->head[b]] = segno;
+	di->head[b] = segno;
+	di->count[b]++;
+	WRITE_ONCE(di->bucket[segno], b);
+}
+
+/* Locks buckets @a and @b, lower first; DIRTY_INDEX_NONE has no lock */
+static void dirty_index_lock(struct dirty_index *di, unsigned char a,
+						unsigned char b)
+{
+	if (a > b)
+		swap(a, b);
+	if (a != DIRTY_INDEX_NONE)
+		spin_lock(&di->lock[a]);
+	if (b != DIRTY_INDEX_NONE && b != a)
+		spin_lock_nested(&di->lock[b], SINGLE_DEPTH_NESTING);
+}
+
+static void dirty_index_unlock(struct dirty_index *di, unsigned char a,
+						unsigned char b)
+{
+	if (b != DIRTY_INDEX_NONE && b != a)
+		spin_unlock(&di->lock[b]);
+	if (a != DIRTY_INDEX_NONE)
+		spin_unlock(&di->lock[a]);
+}
+
+/*
+ * Move @segno to the bucket matching its current DIRTY bit and valid block
+ * count. Callers run without seglist_lock. Only a holder of the lock of
+ * the bucket @segno is in moves it, so the move is redone if the bucket
+ * changed before both locks were taken. The loop rechecks after unlocking
+ * in case a racing caller changed the segment and then skipped the locks
+ * on seeing our stale bucket.
+ */
+static void update_dirty_index(struct f3fs_sb_info *sbi, unsigned int segno)
+{
+	struct dirty_index *di = &DIRTY_I(sbi)->index;
+	unsigned char old, b;
+
+	if (!di->bucket)
+		return;
+
+	while ((old = READ_ONCE(di->bucket[segno])) !=
+				(b = dirty_index_bucket(sbi, segno))) {
+		dirty_index_lock(di, old, b);
+		if (di->bucket[segno] == old &&
+				dirty_index_bucket(sbi, segno) == b) {
+			if (old != DIRTY_INDEX_NONE)
+				__dirty_index_unlink(di, segno);
+			if (b != DIRTY_INDEX_NONE)
+				__dirty_index_link(di, segno, b);
+		}
+		dirty_index_unlock(di, old, b);
+		smp_mb();
+	}
+}
+
 static void __locate_dirty_segment2(struct f3fs_sb_info *sbi, unsigned int segno,
 		enum dirty_type dirty_type, enum dirty_type seg_dirty_type)
 {
@@ -727,6 +819,7 @@ static void __locate_dirty_segment2(struct f3fs_sb_info *sbi, unsigned int segno
 		}
 		if (!test_and_set_bit(segno, dirty_i->dirty_segmap[seg_dirty_type]))
 			atomic_inc(&dirty_i->nr_dirty[seg_dirty_type]);
+		update_dirty_index(sbi, segno);
 	}
 }
 
@@ -748,6 +841,7 @@ static void __remove_dirty_segment2(struct f3fs_sb_info *sbi, unsigned int segno
 			clear_bit(GET_SEC_FROM_SEG(sbi, segno),
 						dirty_i->victim_secmap);
 		}
+		update_dirty_index(sbi, segno);
 	}
 }
 
@@ -2127,6 +2221,26 @@ static inline unsigned long long get_segment_mtime(struct f3fs_sb_info *sbi,
 	return get_seg_entry(sbi, segno)->mtime;
 }
 
+/*
+ * Averages @mtime, or the current time if 0, into @se's mtime for @nr
+ * blocks about to be added to it. gc_dst_log() reads the result.
+ */
+static void update_segment_mtime_nr(struct f3fs_sb_info *sbi,
+		struct seg_entry *se, unsigned long long mtime, unsigned int nr)
+{
+	unsigned long long ctime = get_mtime(sbi, false);
+
+	if (!mtime)
+		mtime = ctime;
+
+	if (!se->mtime)
+		se->mtime = mtime;
+	else
+		se->mtime = div_u64(se->mtime * se->valid_blocks + mtime * nr,
+					se->valid_blocks + nr);
+	update_max_mtime_atomic(sbi, ctime);
+}
+
 static void update_sit_entry2(struct f3fs_sb_info *sbi, block_t blkaddr, int del,
   unsigned int* valid_blocks, enum dirty_type* dirty_type, unsigned long long old_mtime)
 {
@@ -2138,9 +2252,6 @@ static void update_sit_entry2(struct f3fs_sb_info *sbi, block_t blkaddr, int del
 #ifdef CONFIG_F3FS_CHECK_FS
 	bool mir_exist;
 #endif
-  unsigned long long ctime = 0;//get_mtime(sbi, false);
-  unsigned long long mtime = old_mtime ? old_mtime : ctime;
-
 	segno = GET_SEGNO(sbi, blkaddr);
 /*
 	f3fs_bug_on(sbi, is_sbi_flag_set(sbi, SBI_CP_DISABLED));
@@ -2151,12 +2262,9 @@ static void update_sit_entry2(struct f3fs_sb_info *sbi, block_t blkaddr, int del
 	new_vblocks = se->valid_blocks + del;
 	offset = GET_BLKOFF_FROM_SEG0(sbi, blkaddr);
 
-  if (!se->mtime)
-    se->mtime = mtime;
-  else
-    se->mtime = div_u64(se->mtime * se->valid_blocks + mtime,
-        se->valid_blocks + 1);
-  update_max_mtime_atomic(sbi, ctime);
+	/* only written blocks age a segment, invalidation leaves it */
+	if (del > 0)
+		update_segment_mtime_nr(sbi, se, old_mtime, 1);
 
 /*	f3fs_bug_on(sbi, (new_vblocks < 0 ||
 			(new_vblocks > f3fs_usable_blks_in_seg(sbi, segno))));
@@ -2166,7 +2274,7 @@ static void update_sit_entry2(struct f3fs_sb_info *sbi, block_t blkaddr, int del
 	/* Update valid block bitmap */
 	if (del > 0) {
 //    down_write(se->cur_valmap_lock);
-		exist = f3fs_test_and_set_bit(offset, se->cur_valid_map);
+		exist = f3fs_test_and_set_bit_atomic(offset, se->cur_valid_map);
 //    up_write(se->cur_valmap_lock);
 		if (unlikely(exist)) {
 //			f3fs_err(sbi, "Bitmap was wrongly set, blk:%u",
@@ -2177,11 +2285,11 @@ static void update_sit_entry2(struct f3fs_sb_info *sbi, block_t blkaddr, int del
 		}
 
 		if (f3fs_block_unit_discard(sbi) &&
-				!f3fs_test_and_set_bit(offset, se->discard_map))
+				!f3fs_test_and_set_bit_atomic(offset, se->discard_map))
 			sbi->discard_blks--;
 	} else {
 //    down_write(se->cur_valmap_lock);
-		exist = f3fs_test_and_clear_bit(offset, se->cur_valid_map);
+		exist = f3fs_test_and_clear_bit_atomic(offset, se->cur_valid_map);
 //    up_write(se->cur_valmap_lock);
 		if (unlikely(!exist)) {
 //			f3fs_err(sbi, "Bitmap was wrongly cleared, blk:%u",
@@ -2192,7 +2300,7 @@ static void update_sit_entry2(struct f3fs_sb_info *sbi, block_t blkaddr, int del
 		}
 
 		if (f3fs_block_unit_discard(sbi) &&
-			f3fs_test_and_clear_bit(offset, se->discard_map))
+			f3fs_test_and_clear_bit_atomic(offset, se->discard_map))
 			sbi->discard_blks++;
 	}
 	if (!test_bit(offset, se->ckpt_valid_map))
@@ -2206,10 +2314,16 @@ static void update_sit_entry2(struct f3fs_sb_info *sbi, block_t blkaddr, int del
   *dirty_type = se->type;
 }
 
+static struct curseg_info *curseg_lock_for_invalidate(struct f3fs_sb_info *sbi,
+						unsigned int segno);
+static void curseg_unlock_for_invalidate(struct f3fs_sb_info *sbi,
+					struct curseg_info *curseg);
+
 void f3fs_invalidate_blocks(struct f3fs_sb_info *sbi, block_t addr)
 {
 	unsigned int segno = GET_SEGNO(sbi, addr);
 	struct sit_info *sit_i = SIT_I(sbi);
+	struct curseg_info *curseg;
 
 	f3fs_bug_on(sbi, addr == NULL_ADDR);
 	if (addr == NEW_ADDR || addr == COMPRESS_ADDR)
@@ -2221,6 +2335,7 @@ void f3fs_invalidate_blocks(struct f3fs_sb_info *sbi, block_t addr)
 	/* add it into sit main buffer */
 //	down_write(&sit_i->sentry_only_lock);
 //	down_write(&sit_i->blk_info_lock);
+  curseg = curseg_lock_for_invalidate(sbi, segno);
   {
     unsigned int valid_blocks;
     enum dirty_type seg_dirty_type;
@@ -2236,10 +2351,112 @@ void f3fs_invalidate_blocks(struct f3fs_sb_info *sbi, block_t addr)
 
 //    locate_dirty_segment2(sbi, segno, seg_dirty_type, valid_blocks);
   }
+  curseg_unlock_for_invalidate(sbi, curseg);
 //	up_write(&sit_i->blk_info_lock);
 //	up_write(&sit_i->sentry_only_lock);
 }
 
+static int inval_addr_cmp(const void *a, const void *b)
+{
+	block_t x = *(const block_t *)a, y = *(const block_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Applies @nr invalidations, taking each segment's local_lock once */
+static void apply_invalidations(struct f3fs_sb_info *sbi, block_t *addr,
+							unsigned int nr)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	unsigned int i = 0;
+
+	sort(addr, nr, sizeof(block_t), inval_addr_cmp, NULL);
+
+	while (i < nr) {
+		unsigned int segno = GET_SEGNO(sbi, addr[i]);
+		struct seg_entry *se = get_seg_entry(sbi, segno);
+		struct curseg_info *curseg;
+		unsigned int valid_blocks;
+		enum dirty_type dirty_type;
+
+		curseg = curseg_lock_for_invalidate(sbi, segno);
+		down_write(&se->local_lock);
+		do {
+			update_sit_entry2(sbi, addr[i], -1, &valid_blocks,
+							&dirty_type, 0);
+		} while (++i < nr && GET_SEGNO(sbi, addr[i]) == segno);
+
+		if (!IS_CURSEG(sbi, segno) &&
+			(!test_bit(segno, dirty_i->dirty_segmap[PRE]) ||
+							valid_blocks == 0))
+			locate_dirty_segment2(sbi, segno, valid_blocks,
+							dirty_type);
+		up_write(&se->local_lock);
+		curseg_unlock_for_invalidate(sbi, curseg);
+	}
+}
+
+static unsigned int inval_log_take(struct sit_info *sit_i,
+				struct inval_log *log, block_t *batch)
+{
+	unsigned int nr = log->nr;
+
+	memcpy(batch, log->addr, nr * sizeof(block_t));
+	log->nr = 0;
+	atomic_sub(nr, &sit_i->inval_pending);
+	return nr;
+}
+
+/*
+ * Invalidates the old address of an out-of-place write later, so that the
+ * write path only locks its new segment. Each CPU logs the addresses and a
+ * full log is applied sorted by segment. Until then the blocks still count
+ * as valid, which only delays their reuse. f3fs_flush_invalidations()
+ * settles the SIT before victim selection, after each GC victim and at
+ * checkpoint.
+ */
+static void f3fs_defer_invalidate(struct f3fs_sb_info *sbi, block_t blkaddr)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	block_t batch[INVAL_LOG_SIZE];
+	struct inval_log *log;
+	unsigned int nr = 0;
+
+	log = get_cpu_ptr(sit_i->inval_log);
+	spin_lock(&log->lock);
+	log->addr[log->nr++] = blkaddr;
+	atomic_inc(&sit_i->inval_pending);
+	if (log->nr == INVAL_LOG_SIZE)
+		nr = inval_log_take(sit_i, log, batch);
+	spin_unlock(&log->lock);
+	put_cpu_ptr(sit_i->inval_log);
+
+	if (nr)
+		apply_invalidations(sbi, batch, nr);
+}
+
+void f3fs_flush_invalidations(struct f3fs_sb_info *sbi)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	block_t batch[INVAL_LOG_SIZE];
+	int cpu;
+
+	if (!atomic_read(&sit_i->inval_pending))
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct inval_log *log = per_cpu_ptr(sit_i->inval_log, cpu);
+		unsigned int nr;
+
+		spin_lock(&log->lock);
+		nr = inval_log_take(sit_i, log, batch);
+		spin_unlock(&log->lock);
+
+		if (nr)
+			apply_invalidations(sbi, batch, nr);
+	}
+}
+
 bool f3fs_is_checkpointed_data(struct f3fs_sb_info *sbi, block_t blkaddr)
 {
 	unsigned int segno, offset;
@@ -2365,14 +2582,133 @@ static int is_next_segment_free(struct f3fs_sb_info *sbi,
 	return 0;
 }
 
+/*
+ * First free section from @start on, MAIN_SECS() if none. full_secmap
+ * skips the free_secmap words without a free section.
+ */
+static unsigned int __find_next_free_sec(struct f3fs_sb_info *sbi,
+						unsigned int start)
+{
+	struct free_segmap_info *free_i = FREE_I(sbi);
+	unsigned int nr_words = BITS_TO_LONGS(MAIN_SECS(sbi));
+	unsigned int word = BIT_WORD(start);
+	unsigned int end, secno;
+
+	if (start >= MAIN_SECS(sbi))
+		return MAIN_SECS(sbi);
+
+	end = min_t(unsigned int, MAIN_SECS(sbi), (word + 1) * BITS_PER_LONG);
+	secno = find_next_zero_bit(free_i->free_secmap, end, start);
+	if (secno < end)
+		return secno;
+
+	word = find_next_zero_bit(free_i->full_secmap, nr_words, word + 1);
+	if (word >= nr_words)
+		return MAIN_SECS(sbi);
+	return find_next_zero_bit(free_i->free_secmap, MAIN_SECS(sbi),
+						word * BITS_PER_LONG);
+}
+
+/*
+ * Claims the free sections after @secno, in its zone, for @curseg. They
+ * are marked in free_secmap, so no other log picks them, but still count
+ * in free_sections. Caller holds segmap_lock.
+ */
+static void __fill_free_secs(struct f3fs_sb_info *sbi,
+			struct curseg_info *curseg, unsigned int secno)
+{
+	struct free_segmap_info *free_i = FREE_I(sbi);
+	unsigned int zoneno = GET_ZONE_FROM_SEC(sbi, secno);
+
+	while (curseg->nr_free_secs < CURSEG_FREE_SECS) {
+		/* leave the last free sections to the logs that run out */
+		if (free_i->free_sections <= free_i->pooled_sections +
+						reserved_sections(sbi))
+			break;
+
+		secno = __find_next_free_sec(sbi, secno + 1);
+		if (secno >= MAIN_SECS(sbi) ||
+				GET_ZONE_FROM_SEC(sbi, secno) != zoneno)
+			break;
+
+		__test_and_set_free_secmap(free_i, secno);
+		free_i->pooled_sections++;
+		curseg->free_secs[curseg->nr_free_secs++] = secno;
+	}
+}
+
+/* Hands the sections @curseg claimed back to free_secmap */
+static void __release_curseg_free_secs(struct f3fs_sb_info *sbi,
+					struct curseg_info *curseg)
+{
+	struct free_segmap_info *free_i = FREE_I(sbi);
+
+	while (curseg->nr_free_secs) {
+		unsigned int secno = curseg->free_secs[--curseg->nr_free_secs];
+
+		__test_and_clear_free_secmap(free_i, secno);
+		free_i->pooled_sections--;
+	}
+}
+
+static void __release_free_secs(struct f3fs_sb_info *sbi)
+{
+	int i;
+
+	for (i = 0; i < NR_CURSEG_TYPE; i++)
+		__release_curseg_free_secs(sbi, CURSEG_I(sbi, i));
+}
+
+/* Before resize moves the logs out of the sections being removed */
+void f3fs_release_free_secs(struct f3fs_sb_info *sbi)
+{
+	struct free_segmap_info *free_i = FREE_I(sbi);
+
+	spin_lock(&free_i->segmap_lock);
+	__release_free_secs(sbi);
+	spin_unlock(&free_i->segmap_lock);
+}
+
+/* Next claimed section of @curseg still inside the main area */
+static unsigned int __pop_free_sec(struct f3fs_sb_info *sbi,
+					struct curseg_info *curseg)
+{
+	struct free_segmap_info *free_i = FREE_I(sbi);
+
+	while (curseg->nr_free_secs) {
+		unsigned int secno = curseg->free_secs[0];
+
+		curseg->nr_free_secs--;
+		memmove(curseg->free_secs, curseg->free_secs + 1,
+				curseg->nr_free_secs * sizeof(unsigned int));
+
+		/* __set_inuse() accounts for it again */
+		__test_and_clear_free_secmap(free_i, secno);
+		free_i->pooled_sections--;
+
+		/* claimed before a resize shrank the main area */
+		if (secno < MAIN_SECS(sbi))
+			return secno;
+	}
+	return MAIN_SECS(sbi);
+}
+
 /*
  * Find a new segment from the free segments bitmap to right order
  * This function should be returned with success, otherwise BUG
+ *
+ * With @use_pool, the log allocates to the right from its own current
+ * segment: it takes the new section from the ones it claimed ahead, if
+ * any, and otherwise the scan below picks one and claims up to
+ * CURSEG_FREE_SECS - 1 more right after it. Other hints go through the
+ * scan, with the log's claimed sections handed back first.
  */
-static void get_new_segment(struct f3fs_sb_info *sbi,
-			unsigned int *newseg, bool new_sec, int dir)
+static void get_new_segment(struct f3fs_sb_info *sbi, int type,
+			unsigned int *newseg, bool new_sec, int dir,
+			bool use_pool)
 {
 	struct free_segmap_info *free_i = FREE_I(sbi);
+	struct curseg_info *curseg = CURSEG_I(sbi, type);
 	unsigned int segno, secno, zoneno;
 	unsigned int total_zones = MAIN_SECS(sbi) / sbi->secs_per_zone;
 	unsigned int hint = GET_SEC_FROM_SEG(sbi, *newseg);
@@ -2390,12 +2726,25 @@ static void get_new_segment(struct f3fs_sb_info *sbi,
 		if (segno < GET_SEG_FROM_SEC(sbi, hint + 1))
 			goto got_it;
 	}
+
+	if (!use_pool) {
+		__release_curseg_free_secs(sbi, curseg);
+	} else if (curseg->nr_free_secs) {
+		secno = __pop_free_sec(sbi, curseg);
+		if (secno < MAIN_SECS(sbi)) {
+			segno = GET_SEG_FROM_SEC(sbi, secno);
+			goto got_it;
+		}
+	}
+
+	/* the only free sections left are claimed by other logs */
+	if (free_i->free_sections == free_i->pooled_sections)
+		__release_free_secs(sbi);
 find_other_zone:
-	secno = find_next_zero_bit(free_i->free_secmap, MAIN_SECS(sbi), hint);
+	secno = __find_next_free_sec(sbi, hint);
 	if (secno >= MAIN_SECS(sbi)) {
 		if (dir == ALLOC_RIGHT) {
-			secno = find_first_zero_bit(free_i->free_secmap,
-							MAIN_SECS(sbi));
+			secno = __find_next_free_sec(sbi, 0);
 			f3fs_bug_on(sbi, secno >= MAIN_SECS(sbi));
 		} else {
 			go_left = 1;
@@ -2410,8 +2759,7 @@ find_other_zone:
 			left_start--;
 			continue;
 		}
-		left_start = find_first_zero_bit(free_i->free_secmap,
-							MAIN_SECS(sbi));
+		left_start = __find_next_free_sec(sbi, 0);
 		f3fs_bug_on(sbi, left_start >= MAIN_SECS(sbi));
 		break;
 	}
@@ -2422,16 +2770,16 @@ skip_left:
 
 	/* give up on finding another zone */
 	if (!init)
-		goto got_it;
+		goto claim;
 	if (sbi->secs_per_zone == 1)
-		goto got_it;
+		goto claim;
 	if (zoneno == old_zoneno)
-		goto got_it;
+		goto claim;
 	if (dir == ALLOC_LEFT) {
 		if (!go_left && zoneno + 1 >= total_zones)
-			goto got_it;
+			goto claim;
 		if (go_left && zoneno == 0)
-			goto got_it;
+			goto claim;
 	}
 	for (i = 0; i < NR_CURSEG_TYPE; i++)
 		if (CURSEG_I(sbi, i)->zone == zoneno)
@@ -2448,6 +2796,9 @@ skip_left:
 		init = false;
 		goto find_other_zone;
 	}
+claim:
+	if (use_pool)
+		__fill_free_secs(sbi, curseg, secno);
 got_it:
 	/* set it as dirty segment in free segmap */
 	f3fs_bug_on(sbi, test_bit(segno, free_i->free_segmap));
@@ -2463,6 +2814,9 @@ static void reset_curseg(struct f3fs_sb_info *sbi, int type, int modified)
 	struct summary_footer *sum_footer;
 	unsigned short seg_type = curseg->seg_type;
 
+	/* these logs are opened lazily and stay open, see reserved_sections() */
+	if (!curseg->inited && (IS_GC_NODE_LOG(type) || IS_WARM_DATA_LOG(type)))
+		atomic_inc(&SM_I(sbi)->open_inmem_logs);
 	curseg->inited = true;
 	curseg->segno = curseg->next_segno;
 	curseg->zone = GET_ZONE_FROM_SEG(sbi, curseg->segno);
@@ -2527,11 +2881,12 @@ static void new_curseg(struct f3fs_sb_info *sbi, int type, bool new_sec)
 	unsigned short seg_type = curseg->seg_type;
 	unsigned int segno = curseg->segno;
 	int dir = ALLOC_LEFT;
-  get_seg_entry(sbi, segno)->curseg = 0;
 
-	if (curseg->inited)
+	if (curseg->inited) {
+		get_seg_entry(sbi, segno)->curseg = 0;
 		write_sum_page(sbi, curseg->sum_blk,
 				GET_SUM_BLOCK(sbi, segno));
+	}
 	if (seg_type == CURSEG_WARM_DATA || seg_type == CURSEG_COLD_DATA ||
     (seg_type >= CURSEG_COLD_GC_DATA_START && seg_type <= CURSEG_COLD_GC_DATA_END))
 		dir = ALLOC_RIGHT;
@@ -2540,7 +2895,10 @@ static void new_curseg(struct f3fs_sb_info *sbi, int type, bool new_sec)
 		dir = ALLOC_RIGHT;
 
 	segno = __get_next_segno(sbi, type);
-	get_new_segment(sbi, &segno, new_sec, dir);
+	/* claimed sections only stand for "right after the current one" */
+	get_new_segment(sbi, type, &segno, new_sec, dir,
+			dir == ALLOC_RIGHT && curseg->inited &&
+			segno == curseg->segno);
 	curseg->next_segno = segno;
 	reset_curseg(sbi, type, 1);
 	curseg->alloc_type = LFS;
@@ -2666,6 +3024,160 @@ static void get_atssr_segment(struct f3fs_sb_info *sbi, int type,
 	stat_inc_seg_type(sbi, curseg);
 }
 
+/*
+ * Lock-free block allocation in pure LFS mode. While a data log's window is
+ * open, writers reserve its next block with a cmpxchg on @window and fill
+ * their summary entry in place, without curseg_mutex. The new block's valid
+ * bit is set atomically. Its count is gathered in @window_blocks and added
+ * to the SIT entry when the window closes.
+ *
+ * curseg_mutex holders close the window before touching the log, and wait
+ * for the writers still inside. The last block of a segment always goes
+ * through the locked path, which moves the log on and opens the window
+ * again. A window is never closed with a seg_entry local_lock held, since
+ * writers take the old block's one. Invalidating a block of the window's
+ * segment closes it first, see curseg_lock_for_invalidate().
+ */
+#define WINDOW(segno, limit, off)	\
+	(((u64)(segno) << 32) | ((u64)(limit) << 16) | (off))
+#define WINDOW_SEGNO(v)		((unsigned int)((v) >> 32))
+#define WINDOW_LIMIT(v)		((unsigned int)((v) >> 16) & 0xffff)
+#define WINDOW_OFF(v)		((unsigned int)(v) & 0xffff)
+
+static void curseg_open_window(struct f3fs_sb_info *sbi,
+					struct curseg_info *curseg)
+{
+	if (!f3fs_lfs_mode(sbi) || f3fs_sb_has_blkzoned(sbi) ||
+			F3FS_IO_ALIGNED(sbi))
+		return;
+	if (!curseg->inited || curseg->alloc_type != LFS ||
+			!IS_DATASEG(curseg->seg_type))
+		return;
+
+	atomic64_set_release(&curseg->window, WINDOW(curseg->segno,
+			f3fs_usable_blks_in_seg(sbi, curseg->segno),
+			curseg->next_blkoff));
+}
+
+static void curseg_put_window(struct curseg_info *curseg)
+{
+	if (atomic_dec_and_test(&curseg->window_users) &&
+			wq_has_sleeper(&curseg->window_wq))
+		wake_up(&curseg->window_wq);
+}
+
+/* Reserves up to @nr blocks from *@off on; returns how many, 0 if none */
+static unsigned int curseg_reserve_blocks(struct curseg_info *curseg,
+		unsigned int nr, unsigned int *segno, unsigned int *off)
+{
+	unsigned int n;
+	s64 v;
+
+	atomic_inc(&curseg->window_users);
+	smp_mb__after_atomic();
+
+	v = atomic64_read(&curseg->window);
+	do {
+		/* closed, or only the last block is left */
+		if (WINDOW_OFF(v) + 1 >= WINDOW_LIMIT(v)) {
+			curseg_put_window(curseg);
+			return 0;
+		}
+		n = min(nr, WINDOW_LIMIT(v) - 1 - WINDOW_OFF(v));
+	} while (!atomic64_try_cmpxchg(&curseg->window, &v, v + n));
+
+	*segno = WINDOW_SEGNO(v);
+	*off = WINDOW_OFF(v);
+	return n;
+}
+
+/* Caller holds curseg_mutex and no seg_entry local_lock */
+static void curseg_close_window(struct f3fs_sb_info *sbi,
+					struct curseg_info *curseg)
+{
+	s64 v = atomic64_xchg(&curseg->window, 0);
+	unsigned int nr, discard;
+	struct seg_entry *se;
+
+	if (!WINDOW_LIMIT(v))
+		return;
+
+	wait_event(curseg->window_wq, !atomic_read(&curseg->window_users));
+
+	curseg->next_blkoff = WINDOW_OFF(v);
+	nr = atomic_xchg(&curseg->window_blocks, 0);
+	discard = atomic_xchg(&curseg->window_discard, 0);
+	if (!nr)
+		return;
+
+	se = get_seg_entry(sbi, WINDOW_SEGNO(v));
+	down_write(&se->local_lock);
+	update_segment_mtime_nr(sbi, se, 0, nr);
+	se->valid_blocks += nr;
+	se->ckpt_valid_blocks += nr;
+	sbi->discard_blks -= discard;
+	__mark_sit_entry_dirty(sbi, WINDOW_SEGNO(v));
+	up_write(&se->local_lock);
+}
+
+/*
+ * Blocks reserved through an open window are not in their seg_entry's
+ * counts until it closes. Before a block of @segno is invalidated, the
+ * window of the log writing @segno is closed, so valid_blocks never drops
+ * below what was written. Returns that log with curseg_mutex held, NULL
+ * if @segno is no log's current segment. Caller holds no local_lock.
+ */
+static struct curseg_info *curseg_lock_for_invalidate(struct f3fs_sb_info *sbi,
+						unsigned int segno)
+{
+	int i;
+
+	/* a segment becomes current again only through SSR, without window */
+	if (!get_seg_entry(sbi, segno)->curseg)
+		return NULL;
+
+	for (i = CURSEG_HOT_DATA; i < NO_CHECK_TYPE; i++) {
+		struct curseg_info *curseg = CURSEG_I(sbi, i);
+
+		if (!READ_ONCE(curseg->inited) ||
+				READ_ONCE(curseg->segno) != segno)
+			continue;
+
+		mutex_lock(&curseg->curseg_mutex);
+		if (curseg->inited && curseg->segno == segno) {
+			curseg_close_window(sbi, curseg);
+			return curseg;
+		}
+		/* the log moved on, and closed its window doing so */
+		mutex_unlock(&curseg->curseg_mutex);
+		return NULL;
+	}
+	return NULL;
+}
+
+static void curseg_unlock_for_invalidate(struct f3fs_sb_info *sbi,
+					struct curseg_info *curseg)
+{
+	if (!curseg)
+		return;
+	curseg_open_window(sbi, curseg);
+	mutex_unlock(&curseg->curseg_mutex);
+}
+
+/* Fold every open window into its log before a checkpoint reads them */
+void f3fs_close_curseg_windows(struct f3fs_sb_info *sbi)
+{
+	int i;
+
+	for (i = CURSEG_HOT_DATA; i < NO_CHECK_TYPE; i++) {
+		struct curseg_info *curseg = CURSEG_I(sbi, i);
+
+		mutex_lock(&curseg->curseg_mutex);
+		curseg_close_window(sbi, curseg);
+		mutex_unlock(&curseg->curseg_mutex);
+	}
+}
+
 static void __f3fs_init_atgc_curseg(struct f3fs_sb_info *sbi)
 {
 	struct curseg_info *curseg = CURSEG_I(sbi, CURSEG_ALL_DATA_ATGC);
@@ -2707,6 +3219,7 @@ static void __f3fs_save_inmem_curseg(struct f3fs_sb_info *sbi, int type)
 	if (!curseg->inited)
 		goto out;
 
+	curseg_close_window(sbi, curseg);
 	if (get_valid_blocks(sbi, curseg->segno, false)) {
 		write_sum_page(sbi, curseg->sum_blk,
 				GET_SUM_BLOCK(sbi, curseg->segno));
@@ -2721,10 +3234,15 @@ out:
 
 void f3fs_save_inmem_curseg(struct f3fs_sb_info *sbi)
 {
+	int i;
+
 	__f3fs_save_inmem_curseg(sbi, CURSEG_COLD_DATA_PINNED);
 
 	if (sbi->am.atgc_enabled)
 		__f3fs_save_inmem_curseg(sbi, CURSEG_ALL_DATA_ATGC);
+
+	for (i = CURSEG_COLD_GC_NODE_START; i <= CURSEG_WARM_DATA_LOG_END; i++)
+		__f3fs_save_inmem_curseg(sbi, i);
 }
 
 static void __f3fs_restore_inmem_curseg(struct f3fs_sb_info *sbi, int type)
@@ -2746,10 +3264,15 @@ out:
 
 void f3fs_restore_inmem_curseg(struct f3fs_sb_info *sbi)
 {
+	int i;
+
 	__f3fs_restore_inmem_curseg(sbi, CURSEG_COLD_DATA_PINNED);
 
 	if (sbi->am.atgc_enabled)
 		__f3fs_restore_inmem_curseg(sbi, CURSEG_ALL_DATA_ATGC);
+
+	for (i = CURSEG_COLD_GC_NODE_START; i <= CURSEG_WARM_DATA_LOG_END; i++)
+		__f3fs_restore_inmem_curseg(sbi, i);
 }
 
 static int get_ssr_segment(struct f3fs_sb_info *sbi, int type,
@@ -3183,8 +3706,12 @@ static int __get_segment_type_4(struct f3fs_io_info *fio)
 
 static int __get_segment_type_6(struct f3fs_io_info *fio)
 {
+	int type;
+
   if (fio->dst_hint != -1) {
     f3fs_bug_on(fio->sbi, fio->dst_hint < 0 || fio->dst_hint >= MAX_GC_WORKER);
+    if (fio->type == NODE)
+      return CURSEG_COLD_GC_NODE_START + fio->dst_hint;
     return CURSEG_COLD_GC_DATA_START + fio->dst_hint;
   }
 	if (fio->type == DATA) {
@@ -3213,7 +3740,10 @@ static int __get_segment_type_6(struct f3fs_io_info *fio)
 				is_inode_flag_set(inode, FI_HOT_DATA) ||
 				f3fs_is_cow_file(inode))
 			return CURSEG_HOT_DATA;
-		return f3fs_rw_hint_to_seg_type(inode->i_write_hint);
+		type = f3fs_rw_hint_to_seg_type(inode->i_write_hint);
+		if (type == CURSEG_WARM_DATA)
+			return f3fs_warm_data_log(fio->sbi);
+		return type;
 	} else {
 		if (IS_DNODE(fio->page))
 			return is_cold_node(fio->page) ? CURSEG_WARM_NODE :
@@ -3244,6 +3774,8 @@ static int __get_segment_type(struct f3fs_io_info *fio)
 		fio->temp = HOT;
 	else if (IS_WARM(type))
 		fio->temp = WARM;
+	else if (IS_WARM_DATA_LOG(type))
+		fio->temp = WARM_LOG_START + type - CURSEG_WARM_DATA_LOG_START;
   else {
     if (fio->dst_hint == -1) {
       fio->temp = COLD;
@@ -3252,6 +3784,49 @@ static int __get_segment_type(struct f3fs_io_info *fio)
 	return type;
 }
 
+static bool f3fs_allocate_block_lockless(struct f3fs_sb_info *sbi,
+		struct curseg_info *curseg, block_t old_blkaddr,
+		block_t *new_blkaddr, struct f3fs_summary *sum,
+		struct f3fs_io_info *fio)
+{
+	unsigned int old_segno = GET_SEGNO(sbi, old_blkaddr);
+	unsigned int segno, off;
+	struct seg_entry *se;
+
+	if (!curseg_reserve_blocks(curseg, 1, &segno, &off))
+		return false;
+
+	*new_blkaddr = START_BLOCK(sbi, segno) + off;
+	f3fs_wait_discard_bio(sbi, *new_blkaddr);
+
+	memcpy(&curseg->sum_blk->entries[off], sum,
+				sizeof(struct f3fs_summary));
+	stat_inc_block_count(sbi, curseg);
+
+	se = get_seg_entry(sbi, segno);
+	if (!f3fs_test_and_set_bit_atomic(off, se->cur_valid_map))
+		atomic_inc(&curseg->window_blocks);
+	if (f3fs_block_unit_discard(sbi) &&
+			!f3fs_test_and_set_bit_atomic(off, se->discard_map))
+		atomic_inc(&curseg->window_discard);
+
+	if (fio) {
+		struct f3fs_bio_info *io = sbi->write_io[fio->type] + fio->temp;
+
+		INIT_LIST_HEAD(&fio->list);
+		fio->in_list = true;
+		spin_lock(&io->io_lock);
+		list_add_tail(&fio->list, &io->io_list);
+		spin_unlock(&io->io_lock);
+	}
+
+	curseg_put_window(curseg);
+
+	if (old_segno != NULL_SEGNO)
+		f3fs_defer_invalidate(sbi, old_blkaddr);
+	return true;
+}
+
 void f3fs_allocate_data_block2(struct f3fs_sb_info *sbi, struct page *page,
 		block_t old_blkaddr, block_t *new_blkaddr,
 		struct f3fs_summary *sum, int type,
@@ -3259,35 +3834,32 @@ void f3fs_allocate_data_block2(struct f3fs_sb_info *sbi, struct page *page,
 {
 	struct sit_info *sit_i = SIT_I(sbi);
 	struct curseg_info *curseg = CURSEG_I(sbi, type);
-  unsigned int old_valid_blocks, new_valid_blocks;
-  enum dirty_type old_seg_dirty_type, new_seg_dirty_type;
+  unsigned int new_valid_blocks;
+  enum dirty_type new_seg_dirty_type;
   unsigned int new_segno, old_segno;
   f3fs_bug_on(sbi, type == CURSEG_ALL_DATA_ATGC);
 
+	if (f3fs_allocate_block_lockless(sbi, curseg, old_blkaddr,
+					new_blkaddr, sum, fio))
+		return;
+
 	f3fs_down_read(&SM_I(sbi)->curseg_lock);
 
 	mutex_lock(&curseg->curseg_mutex);
+	curseg_close_window(sbi, curseg);
 //	down_write(&sit_i->mtime_lock);
 //	down_write(&sit_i->tmp_map_lock);
 	//down_write(&sit_i->blk_info_lock);
 	//down_write(&sit_i->dirty_sentry_lock);
 
+	/* GC node and warm data logs get their first segment on first use */
+	if (!curseg->inited)
+		new_curseg(sbi, type, false);
+
 	*new_blkaddr = NEXT_FREE_BLKADDR(sbi, curseg);
   new_segno = GET_SEGNO(sbi, *new_blkaddr);
   old_segno = GET_SEGNO(sbi, old_blkaddr);
-  while (true) {
-    down_write(&get_seg_entry(sbi, new_segno)->local_lock);
-    if (new_segno != old_segno && old_segno != NULL_SEGNO) {
-      bool acquired = down_write_trylock(&get_seg_entry(sbi, old_segno)->local_lock);
-      if (acquired) {
-        break;
-      } else {
-        up_write(&get_seg_entry(sbi, new_segno)->local_lock);
-      }
-    } else {
-      break;
-    }
-  }
+  down_write(&get_seg_entry(sbi, new_segno)->local_lock);
 
 	f3fs_bug_on(sbi, curseg->next_blkoff >= sbi->blocks_per_seg);
 
@@ -3309,36 +3881,20 @@ void f3fs_allocate_data_block2(struct f3fs_sb_info *sbi, struct page *page,
 	 * since SSR needs latest valid block information.
 	 */
 	update_sit_entry2(sbi, *new_blkaddr, 1, &new_valid_blocks, &new_seg_dirty_type, 0);
-	if (old_segno != NULL_SEGNO)
-		update_sit_entry2(sbi, old_blkaddr, -1, &old_valid_blocks, &old_seg_dirty_type, 0);
 
 	if (!__has_curseg_space(sbi, curseg)) {
 		sit_i->s_ops->allocate_segment2(sbi, type, false);
 	  locate_dirty_segment2(sbi, new_segno, new_valid_blocks, new_seg_dirty_type);
 	}
-	/*
-	 * segment dirty status should be updated after segment allocation,
-	 * so we just need to update status only one time after previous
-	 * segment being closed.
-	 */
-  if (old_segno != NULL_SEGNO && !IS_CURSEG(sbi, old_segno)) {
-	  struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
-    if (!test_bit(old_segno, dirty_i->dirty_segmap[PRE]) || old_valid_blocks == 0) {
-      locate_dirty_segment2(sbi, old_segno, old_valid_blocks, old_seg_dirty_type);
-    }
-  }
 
 	//up_write(&sit_i->dirty_sentry_lock);
 	//up_write(&sit_i->blk_info_lock);
 	//up_write(&sit_i->tmp_map_lock);
 	//up_write(&sit_i->mtime_lock);
 
-  if (new_segno != old_segno && old_segno != NULL_SEGNO) {
-    up_write(&get_seg_entry(sbi, old_segno)->local_lock);
-  }
   up_write(&get_seg_entry(sbi, new_segno)->local_lock);
 
-	if (page && IS_NODESEG(type)) {
+	if (page && IS_NODESEG(curseg->seg_type)) {
 		fill_node_footer_blkaddr(page, NEXT_FREE_BLKADDR(sbi, curseg));
 
 		f3fs_inode_chksum_set(sbi, page);
@@ -3358,9 +3914,175 @@ void f3fs_allocate_data_block2(struct f3fs_sb_info *sbi, struct page *page,
 		spin_unlock(&io->io_lock);
 	}
 
+	curseg_open_window(sbi, curseg);
+	mutex_unlock(&curseg->curseg_mutex);
+
+	f3fs_up_read(&SM_I(sbi)->curseg_lock);
+
+	/* the old segment is left to a later batch, see f3fs_defer_invalidate() */
+	if (old_segno != NULL_SEGNO)
+		f3fs_defer_invalidate(sbi, old_blkaddr);
+}
+
+/* update_sit_entry2() for @nr new blocks from @off on, counted at once */
+static unsigned int update_sit_entry_run(struct f3fs_sb_info *sbi,
+		unsigned int segno, unsigned int off, unsigned int nr)
+{
+	struct seg_entry *se = get_seg_entry(sbi, segno);
+	unsigned int i, set = 0, ckpt = 0;
+
+	for (i = off; i < off + nr; i++) {
+		if (f3fs_test_and_set_bit_atomic(i, se->cur_valid_map))
+			continue;
+		set++;
+		if (!test_bit(i, se->ckpt_valid_map))
+			ckpt++;
+		if (f3fs_block_unit_discard(sbi) &&
+				!f3fs_test_and_set_bit_atomic(i, se->discard_map))
+			sbi->discard_blks--;
+	}
+
+	if (set)
+		update_segment_mtime_nr(sbi, se, 0, set);
+	se->valid_blocks += set;
+	se->ckpt_valid_blocks += ckpt;
+	__mark_sit_entry_dirty(sbi, segno);
+	return se->valid_blocks;
+}
+
+static void queue_data_fios(struct f3fs_sb_info *sbi,
+		struct f3fs_io_info **fio, unsigned int nr)
+{
+	struct f3fs_bio_info *io = sbi->write_io[DATA] + fio[0]->temp;
+	LIST_HEAD(fios);
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		fio[i]->in_list = true;
+		list_add_tail(&fio[i]->list, &fios);
+	}
+
+	spin_lock(&io->io_lock);
+	list_splice_tail(&fios, &io->io_list);
+	spin_unlock(&io->io_lock);
+}
+
+static unsigned int f3fs_allocate_blocks_lockless(struct f3fs_sb_info *sbi,
+		struct curseg_info *curseg, struct f3fs_io_info **fio,
+		struct f3fs_summary *sum, unsigned int nr)
+{
+	unsigned int segno, off, i, set = 0, discard = 0;
+	struct seg_entry *se;
+
+	nr = curseg_reserve_blocks(curseg, nr, &segno, &off);
+	if (!nr)
+		return 0;
+
+	se = get_seg_entry(sbi, segno);
+	for (i = 0; i < nr; i++) {
+		fio[i]->new_blkaddr = START_BLOCK(sbi, segno) + off + i;
+		f3fs_wait_discard_bio(sbi, fio[i]->new_blkaddr);
+
+		memcpy(&curseg->sum_blk->entries[off + i], &sum[i],
+					sizeof(struct f3fs_summary));
+		stat_inc_block_count(sbi, curseg);
+
+		if (!f3fs_test_and_set_bit_atomic(off + i, se->cur_valid_map))
+			set++;
+		if (f3fs_block_unit_discard(sbi) &&
+			!f3fs_test_and_set_bit_atomic(off + i, se->discard_map))
+			discard++;
+	}
+	atomic_add(set, &curseg->window_blocks);
+	atomic_add(discard, &curseg->window_discard);
+
+	queue_data_fios(sbi, fio, nr);
+	curseg_put_window(curseg);
+	return nr;
+}
+
+/*
+ * Allocates blocks for up to @nr DATA fios heading to log @type, with one
+ * window reservation, or one curseg_mutex and local_lock round, for all of
+ * them. In LFS allocation the blocks are back to back. Their summary
+ * entries come from @sum, the SIT entry is updated once and the fios are
+ * queued on the io_list together, in block order.
+ *
+ * Returns how many fios got a block, at least one; a run stops at the end
+ * of the segment. Not for IO-aligned mounts, whose fios may need a retry.
+ */
+unsigned int f3fs_allocate_data_blocks(struct f3fs_sb_info *sbi, int type,
+		struct f3fs_io_info **fio, struct f3fs_summary *sum,
+		unsigned int nr)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	struct curseg_info *curseg = CURSEG_I(sbi, type);
+	unsigned int i, segno, off, valid_blocks;
+	struct seg_entry *se;
+
+	f3fs_bug_on(sbi, type == CURSEG_ALL_DATA_ATGC);
+
+	i = f3fs_allocate_blocks_lockless(sbi, curseg, fio, sum, nr);
+	if (i) {
+		nr = i;
+		goto invalidate;
+	}
+
+	f3fs_down_read(&SM_I(sbi)->curseg_lock);
+
+	mutex_lock(&curseg->curseg_mutex);
+	curseg_close_window(sbi, curseg);
+
+	if (!curseg->inited)
+		new_curseg(sbi, type, false);
+
+	/* SSR and fragment mode pick their blocks one at a time */
+	if (curseg->alloc_type != LFS ||
+			F3FS_OPTION(sbi).fs_mode == FS_MODE_FRAGMENT_BLK) {
+		curseg_open_window(sbi, curseg);
+		mutex_unlock(&curseg->curseg_mutex);
+		f3fs_up_read(&SM_I(sbi)->curseg_lock);
+
+		f3fs_allocate_data_block2(sbi, fio[0]->page,
+				fio[0]->old_blkaddr, &fio[0]->new_blkaddr,
+				sum, type, fio[0]);
+		return 1;
+	}
+
+	segno = curseg->segno;
+	off = curseg->next_blkoff;
+	nr = min(nr, f3fs_usable_blks_in_seg(sbi, segno) - off);
+	se = get_seg_entry(sbi, segno);
+
+	down_write(&se->local_lock);
+	for (i = 0; i < nr; i++) {
+		fio[i]->new_blkaddr = NEXT_FREE_BLKADDR(sbi, curseg);
+		f3fs_wait_discard_bio(sbi, fio[i]->new_blkaddr);
+
+		__add_sum_entry(sbi, type, &sum[i]);
+		__refresh_next_blkoff(sbi, curseg);
+		stat_inc_block_count(sbi, curseg);
+	}
+
+	/* as in f3fs_allocate_data_block2(), SIT goes before a new segment */
+	valid_blocks = update_sit_entry_run(sbi, segno, off, nr);
+	if (!__has_curseg_space(sbi, curseg)) {
+		sit_i->s_ops->allocate_segment2(sbi, type, false);
+		locate_dirty_segment2(sbi, segno, valid_blocks, se->type);
+	}
+	up_write(&se->local_lock);
+
+	queue_data_fios(sbi, fio, nr);
+
+	curseg_open_window(sbi, curseg);
 	mutex_unlock(&curseg->curseg_mutex);
 
 	f3fs_up_read(&SM_I(sbi)->curseg_lock);
+invalidate:
+	for (i = 0; i < nr; i++)
+		if (GET_SEGNO(sbi, fio[i]->old_blkaddr) != NULL_SEGNO)
+			f3fs_defer_invalidate(sbi, fio[i]->old_blkaddr);
+	return nr;
 }
 
 void f3fs_update_device_state(struct f3fs_sb_info *sbi, nid_t ino,
@@ -3518,6 +4240,69 @@ void f3fs_outplace_write_data(struct dnode_of_data *dn,
 	f3fs_update_iostat(sbi, fio->io_type, F3FS_BLKSIZE);
 }
 
+/*
+ * f3fs_outplace_write_data() for the @nr pages @dn addresses from its
+ * ofs_in_node on. Pages heading to the same log share their allocation
+ * and are submitted with one call.
+ */
+void f3fs_outplace_write_data_run(struct dnode_of_data *dn,
+			struct f3fs_io_info **fio, unsigned int nr)
+{
+	struct f3fs_sb_info *sbi = fio[0]->sbi;
+	struct f3fs_summary sum[F3FS_ONSTACK_PAGES];
+	unsigned int ofs = dn->ofs_in_node;
+	unsigned int i, j, k;
+
+	f3fs_bug_on(sbi, nr > F3FS_ONSTACK_PAGES);
+
+	for (i = 0; i < nr; i++) {
+		f3fs_bug_on(sbi, fio[i]->old_blkaddr == NULL_ADDR);
+		set_summary(&sum[i], dn->nid, ofs + i, fio[i]->version);
+	}
+
+	for (i = 0; i < nr; i = j) {
+		int type = __get_segment_type(fio[i]);
+		bool keep_order = (f3fs_lfs_mode(sbi) && (type == CURSEG_COLD_DATA ||
+			(type >= CURSEG_COLD_GC_DATA_START &&
+			 type <= CURSEG_COLD_GC_DATA_END)));
+
+		for (j = i + 1; j < nr && __get_segment_type(fio[j]) == type; j++)
+			;
+
+		if (keep_order)
+			f3fs_down_read(&sbi->io_order_lock);
+
+		for (k = i; k < j; )
+			k += f3fs_allocate_data_blocks(sbi, type, fio + k,
+							sum + k, j - k);
+
+		for (k = i; k < j; k++) {
+			if (GET_SEGNO(sbi, fio[k]->old_blkaddr) == NULL_SEGNO)
+				continue;
+			invalidate_mapping_pages(META_MAPPING(sbi),
+					fio[k]->old_blkaddr, fio[k]->old_blkaddr);
+			f3fs_invalidate_compress_page(sbi, fio[k]->old_blkaddr);
+		}
+
+		/* drains the whole run from the io_list */
+		f3fs_submit_page_write(fio[i]);
+
+		for (k = i; k < j; k++)
+			f3fs_update_device_state(sbi, fio[k]->ino,
+						fio[k]->new_blkaddr, 1);
+
+		if (keep_order)
+			f3fs_up_read(&sbi->io_order_lock);
+	}
+
+	for (i = 0; i < nr; i++) {
+		dn->ofs_in_node = ofs + i;
+		f3fs_update_data_blkaddr(dn, fio[i]->new_blkaddr);
+		f3fs_update_iostat(sbi, fio[i]->io_type, F3FS_BLKSIZE);
+	}
+	dn->ofs_in_node = ofs;
+}
+
 int f3fs_inplace_write_data(struct f3fs_io_info *fio)
 {
 	int err;
@@ -3624,6 +4409,7 @@ void f3fs_do_replace_block(struct f3fs_sb_info *sbi, struct f3fs_summary *sum,
 	curseg = CURSEG_I(sbi, type);
 
 	mutex_lock(&curseg->curseg_mutex);
+	curseg_close_window(sbi, curseg);
 	down_write(&sit_i->sentry_only_lock);
 //	down_write(&sit_i->mtime_lock);
 	down_write(&sit_i->dirty_sentry_lock);
@@ -4299,6 +5085,7 @@ static int build_sit_info(struct f3fs_sb_info *sbi)
 	unsigned int sit_segs, start;
 	char *src_bitmap;
 	unsigned int main_bitmap_size, sit_bitmap_size;
+	int cpu;
 
 	/* allocate memory for SIT information */
 	sit_i = f3fs_kzalloc(sbi, sizeof(struct sit_info), GFP_KERNEL);
@@ -4334,6 +5121,12 @@ static int build_sit_info(struct f3fs_sb_info *sbi)
 	if (!sit_i->tmp_map)
 		return -ENOMEM;
 
+	sit_i->inval_log = alloc_percpu(struct inval_log);
+	if (!sit_i->inval_log)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(sit_i->inval_log, cpu)->lock);
+
 	if (__is_large_section(sbi)) {
 		sit_i->sec_entries =
 			f3fs_kvzalloc(sbi, array_size(sizeof(struct sec_entry),
@@ -4397,9 +5190,16 @@ static int build_free_segmap(struct f3fs_sb_info *sbi)
 	if (!free_i->free_secmap)
 		return -ENOMEM;
 
+	free_i->full_secmap = f3fs_kvmalloc(sbi, f3fs_bitmap_size(
+			BITS_TO_LONGS(MAIN_SECS(sbi))), GFP_KERNEL);
+	if (!free_i->full_secmap)
+		return -ENOMEM;
+
 	/* set all segments as dirty temporarily */
 	memset(free_i->free_segmap, 0xff, bitmap_size);
 	memset(free_i->free_secmap, 0xff, sec_bitmap_size);
+	memset(free_i->full_secmap, 0xff,
+			f3fs_bitmap_size(BITS_TO_LONGS(MAIN_SECS(sbi))));
 
 	/* init free segmap information */
 	free_i->start_segno = GET_SEGNO_FROM_SEG0(sbi, MAIN_BLKADDR(sbi));
@@ -4423,6 +5223,7 @@ static int build_curseg(struct f3fs_sb_info *sbi)
 
 	for (i = 0; i < NO_CHECK_TYPE; i++) {
 		mutex_init(&array[i].curseg_mutex);
+		init_waitqueue_head(&array[i].window_wq);
 		array[i].sum_blk = f3fs_kzalloc(sbi, PAGE_SIZE, GFP_KERNEL);
 		if (!array[i].sum_blk)
 			return -ENOMEM;
@@ -4437,6 +5238,10 @@ static int build_curseg(struct f3fs_sb_info *sbi)
 			array[i].seg_type = CURSEG_COLD_DATA;
 		else if (i == CURSEG_ALL_DATA_ATGC)
 			array[i].seg_type = CURSEG_COLD_DATA;
+		else if (IS_GC_NODE_LOG(i))
+			array[i].seg_type = CURSEG_COLD_NODE;
+		else if (IS_WARM_DATA_LOG(i))
+			array[i].seg_type = CURSEG_WARM_DATA;
 		array[i].segno = NULL_SEGNO;
 		array[i].next_blkoff = 0;
 		array[i].inited = false;
@@ -4673,10 +5478,34 @@ static int init_victim_secmap(struct f3fs_sb_info *sbi)
 	return 0;
 }
 
+static int init_dirty_index(struct f3fs_sb_info *sbi)
+{
+	struct dirty_index *di = &DIRTY_I(sbi)->index;
+	unsigned int i;
+
+	di->shift = sbi->log_blocks_per_seg > ilog2(DIRTY_INDEX_BUCKETS) ?
+		sbi->log_blocks_per_seg - ilog2(DIRTY_INDEX_BUCKETS) : 0;
+	for (i = 0; i < DIRTY_INDEX_BUCKETS; i++)
+		di->head[i] = NULL_SEGNO;
+
+	di->next = f3fs_kvmalloc(sbi, array_size(MAIN_SEGS(sbi),
+				sizeof(unsigned int)), GFP_KERNEL);
+	di->prev = f3fs_kvmalloc(sbi, array_size(MAIN_SEGS(sbi),
+				sizeof(unsigned int)), GFP_KERNEL);
+	di->bucket = f3fs_kvmalloc(sbi, MAIN_SEGS(sbi), GFP_KERNEL);
+	di->snap = f3fs_kvmalloc(sbi, array_size(MAIN_SEGS(sbi),
+				sizeof(unsigned int)), GFP_KERNEL);
+	if (!di->next || !di->prev || !di->bucket || !di->snap)
+		return -ENOMEM;
+	memset(di->bucket, DIRTY_INDEX_NONE, MAIN_SEGS(sbi));
+	return 0;
+}
+
 static int build_dirty_segmap(struct f3fs_sb_info *sbi)
 {
 	struct dirty_seglist_info *dirty_i;
 	unsigned int bitmap_size, i;
+	int err;
 
 	/* allocate memory for dirty segments list information */
 	dirty_i = f3fs_kzalloc(sbi, sizeof(struct dirty_seglist_info),
@@ -4686,6 +5515,8 @@ static int build_dirty_segmap(struct f3fs_sb_info *sbi)
 
 	SM_I(sbi)->dirty_info = dirty_i;
 	mutex_init(&dirty_i->seglist_lock);
+	for (i = 0; i < DIRTY_INDEX_BUCKETS; i++)
+		spin_lock_init(&dirty_i->index.lock[i]);
 
 	bitmap_size = f3fs_bitmap_size(MAIN_SEGS(sbi));
 
@@ -4702,6 +5533,10 @@ static int build_dirty_segmap(struct f3fs_sb_info *sbi)
 						bitmap_size, GFP_KERNEL);
 		if (!dirty_i->dirty_secmap)
 			return -ENOMEM;
+	} else {
+		err = init_dirty_index(sbi);
+		if (err)
+			return err;
 	}
 
 	init_dirty_segmap(sbi);
@@ -5270,6 +6105,11 @@ static void destroy_dirty_segmap(struct f3fs_sb_info *sbi)
 		mutex_unlock(&dirty_i->seglist_lock);
 	}
 
+	kvfree(dirty_i->index.snap);
+	kvfree(dirty_i->index.bucket);
+	kvfree(dirty_i->index.prev);
+	kvfree(dirty_i->index.next);
+
 	destroy_victim_secmap(sbi);
 	SM_I(sbi)->dirty_info = NULL;
 	kfree(dirty_i);
@@ -5299,6 +6139,7 @@ static void destroy_free_segmap(struct f3fs_sb_info *sbi)
 	SM_I(sbi)->free_info = NULL;
 	kvfree(free_i->free_segmap);
 	kvfree(free_i->free_secmap);
+	kvfree(free_i->full_secmap);
 	kfree(free_i);
 }
 
@@ -5310,6 +6151,7 @@ static void destroy_sit_info(struct f3fs_sb_info *sbi)
 		return;
 
 	kfree(sit_i->tmp_map);
+	free_percpu(sit_i->inval_log);
 
 /*  for (int i = 0 ; i < MAIN_SEGS(sbi) ; i++) {
     if (sit_i->sentries[i].cur_valmap_lock) {
@@ -24,6 +24,10 @@
 
 #define IS_DATASEG(t)	((t) <= CURSEG_COLD_GC_DATA_END)
 #define IS_NODESEG(t)	((t) >= CURSEG_HOT_NODE && (t) <= CURSEG_COLD_NODE)
+#define IS_GC_NODE_LOG(t)	((t) >= CURSEG_COLD_GC_NODE_START && \
+				 (t) <= CURSEG_COLD_GC_NODE_END)
+#define IS_WARM_DATA_LOG(t)	((t) >= CURSEG_WARM_DATA_LOG_START && \
+				 (t) <= CURSEG_WARM_DATA_LOG_END)
 #define SE_PAGETYPE(se)	((IS_NODESEG((se)->type) ? NODE : DATA))
 
 static inline void sanity_check_seg_type(struct f3fs_sb_info *sbi,
@@ -198,13 +202,15 @@ struct seg_entry {
 	unsigned int ckpt_valid_blocks:10;	/* # of valid blocks last cp */
 	unsigned int curseg:1;
 	unsigned int padding:5;		/* padding */
-	unsigned char cur_valid_map[SIT_VBLOCK_MAP_SIZE];	/* validity bitmap of blocks */
+	unsigned char cur_valid_map[SIT_VBLOCK_MAP_SIZE]
+			__aligned(sizeof(unsigned long));	/* validity bitmap of blocks */
 	/*
 	 * # of valid blocks and the validity bitmap stored in the last
 	 * checkpoint pack. This information is used by the SSR mode.
 	 */
 	unsigned long ckpt_valid_map[SIT_VBLOCK_MAP_SIZE/sizeof(unsigned long)];	/* validity bitmap of blocks last cp */
-	unsigned char discard_map[SIT_VBLOCK_MAP_SIZE];
+	unsigned char discard_map[SIT_VBLOCK_MAP_SIZE]
+			__aligned(sizeof(unsigned long));
 	unsigned long long mtime;	/* modification time of the segment */
 //	struct rw_semaphore* cur_valmap_lock;	/* to protect SIT cache */
 	struct rw_semaphore local_lock;	/* to protect SIT cache */
@@ -227,6 +233,15 @@ struct revoke_entry {
 	pgoff_t index;
 };
 
+/* Old block addresses a CPU invalidates at once, see f3fs_defer_invalidate() */
+#define INVAL_LOG_SIZE		64
+
+struct inval_log {
+	spinlock_t lock;
+	unsigned int nr;
+	block_t addr[INVAL_LOG_SIZE];
+};
+
 struct sit_info {
 	const struct segment_allocation *s_ops;
 
@@ -262,6 +277,9 @@ struct sit_info {
 	unsigned long long dirty_max_mtime;	/* rerange candidates in GC_AT */
 
 	unsigned int last_victim[MAX_GC_POLICY]; /* last victim segment # */
+
+	struct inval_log __percpu *inval_log;	/* deferred invalidations */
+	atomic_t inval_pending;			/* ... not applied yet */
 };
 
 struct free_segmap_info {
@@ -271,6 +289,8 @@ struct free_segmap_info {
 	spinlock_t segmap_lock;		/* free segmap lock */
 	unsigned long *free_segmap;	/* free segment bitmap */
 	unsigned long *free_secmap;	/* free section bitmap */
+	unsigned long *full_secmap;	/* free_secmap words with no free bit */
+	unsigned int pooled_sections;	/* free sections held by log pools */
 };
 
 /* Notice: The order of dirty type is same with CURSEG_XXX in f3fs.h */
@@ -288,6 +308,26 @@ enum dirty_type {
 	NR_DIRTY_TYPE
 };
 
+/*
+ * Dirty segments bucketed by valid block count, so that victim selection
+ * can visit them cheapest first instead of walking dirty_segmap. Each
+ * bucket is a doubly linked list threaded through @next and @prev, under
+ * its own lock; a segment's links belong to the bucket it is in.
+ */
+#define DIRTY_INDEX_BUCKETS	64
+#define DIRTY_INDEX_NONE	0xff	/* @bucket of an unindexed segment */
+
+struct dirty_index {
+	spinlock_t lock[DIRTY_INDEX_BUCKETS];	/* protect the lists */
+	unsigned int shift;			/* valid blocks >> shift = bucket */
+	unsigned int head[DIRTY_INDEX_BUCKETS];
+	unsigned int count[DIRTY_INDEX_BUCKETS];
+	unsigned int *next;			/* NULL_SEGNO terminated */
+	unsigned int *prev;
+	unsigned char *bucket;			/* NULL for large sections */
+	unsigned int *snap;			/* bucket copy, under seglist_lock */
+};
+
 struct dirty_seglist_info {
 	const struct victim_selection *v_ops;	/* victim selction operation */
 	unsigned long *dirty_segmap[NR_DIRTY_TYPE];
@@ -298,17 +338,26 @@ struct dirty_seglist_info {
 	unsigned long *pinned_secmap;		/* pinned victims from foreground GC */
 	unsigned int pinned_secmap_cnt;		/* count of victims which has pinned data */
 	bool enable_pin_section;		/* enable pinning section */
+	struct dirty_index index;		/* DIRTY segments by cost */
 };
 
+struct gc_victim;
+
 /* victim selection function for cleaning and SSR */
 struct victim_selection {
 	int (*get_victim)(struct f3fs_sb_info *, unsigned int *,
 					int, int, char, unsigned long long);
-	int (*get_multiple_victim)(struct f3fs_sb_info *, unsigned int *,
-					int, int, char, unsigned long long);
+	int (*get_multiple_victim)(struct f3fs_sb_info *, struct gc_victim *,
+			unsigned int, int, int, char, unsigned long long);
 };
 
 /* for active log information */
+/*
+ * Free sections a log claims in one free_secmap scan. They stay counted in
+ * free_sections, see get_new_segment().
+ */
+#define CURSEG_FREE_SECS	4
+
 struct curseg_info {
 	struct mutex curseg_mutex;		/* lock for consistency */
 	struct f3fs_summary_block *sum_blk;	/* cached summary block */
@@ -322,6 +371,17 @@ struct curseg_info {
 	unsigned int next_segno;		/* preallocated segment */
 	int fragment_remained_chunk;		/* remained block size in a chunk for block fragmentation mode */
 	bool inited;				/* indicate inmem log is inited */
+
+	/* lock-free LFS allocation, see curseg_reserve_blocks() */
+	atomic64_t window;			/* segno | limit | next offset */
+	atomic_t window_users;			/* writers inside the window */
+	atomic_t window_blocks;			/* valid blocks not in the SIT yet */
+	atomic_t window_discard;		/* discard bits set meanwhile */
+	wait_queue_head_t window_wq;		/* closer waits for the users */
+
+	/* free sections claimed ahead, under segmap_lock */
+	unsigned int free_secs[CURSEG_FREE_SECS];
+	unsigned int nr_free_secs;
 };
 
 struct sit_entry_set {
@@ -504,6 +564,24 @@ static inline unsigned int find_next_inuse(struct free_segmap_info *free_i,
 	return ret;
 }
 
+/* free_secmap updates keeping full_secmap in step, under segmap_lock */
+static inline bool __test_and_clear_free_secmap(struct free_segmap_info *free_i,
+						unsigned int secno)
+{
+	clear_bit(BIT_WORD(secno), free_i->full_secmap);
+	return test_and_clear_bit(secno, free_i->free_secmap);
+}
+
+static inline bool __test_and_set_free_secmap(struct free_segmap_info *free_i,
+						unsigned int secno)
+{
+	if (test_and_set_bit(secno, free_i->free_secmap))
+		return true;
+	if (free_i->free_secmap[BIT_WORD(secno)] == ~0UL)
+		set_bit(BIT_WORD(secno), free_i->full_secmap);
+	return false;
+}
+
 static inline void __set_free(struct f3fs_sb_info *sbi, unsigned int segno)
 {
 	struct free_segmap_info *free_i = FREE_I(sbi);
@@ -519,7 +597,7 @@ static inline void __set_free(struct f3fs_sb_info *sbi, unsigned int segno)
 	next = find_next_bit(free_i->free_segmap,
 			start_segno + sbi->segs_per_sec, start_segno);
 	if (next >= start_segno + usable_segs) {
-		clear_bit(secno, free_i->free_secmap);
+		__test_and_clear_free_secmap(free_i, secno);
 		free_i->free_sections++;
 	}
 	spin_unlock(&free_i->segmap_lock);
@@ -533,7 +611,7 @@ static inline void __set_inuse(struct f3fs_sb_info *sbi,
 
 	set_bit(segno, free_i->free_segmap);
 	free_i->free_segments--;
-	if (!test_and_set_bit(secno, free_i->free_secmap))
+	if (!__test_and_set_free_secmap(free_i, secno))
 		free_i->free_sections--;
 }
 
@@ -555,7 +633,7 @@ static inline void __set_test_and_free(struct f3fs_sb_info *sbi,
 		next = find_next_bit(free_i->free_segmap,
 				start_segno + sbi->segs_per_sec, start_segno);
 		if (next >= start_segno + usable_segs) {
-			if (test_and_clear_bit(secno, free_i->free_secmap))
+			if (__test_and_clear_free_secmap(free_i, secno))
 				free_i->free_sections++;
 		}
 	}
@@ -572,7 +650,7 @@ static inline void __set_test_and_inuse(struct f3fs_sb_info *sbi,
 	spin_lock(&free_i->segmap_lock);
 	if (!test_and_set_bit(segno, free_i->free_segmap)) {
 		free_i->free_segments--;
-		if (!test_and_set_bit(secno, free_i->free_secmap))
+		if (!__test_and_set_free_secmap(free_i, secno))
 			free_i->free_sections--;
 	}
 	spin_unlock(&free_i->segmap_lock);
@@ -658,9 +736,30 @@ static inline int overprovision_segments(struct f3fs_sb_info *sbi)
 	return SM_I(sbi)->ovp_segments;
 }
 
+/*
+ * The reserve is sized for the persistent logs. Each GC node or warm data
+ * log opened since mount may take one more section when its own fills up.
+ */
 static inline int reserved_sections(struct f3fs_sb_info *sbi)
 {
-	return GET_SEC_FROM_SEG(sbi, reserved_segments(sbi));
+	return GET_SEC_FROM_SEG(sbi, reserved_segments(sbi)) +
+			atomic_read(&SM_I(sbi)->open_inmem_logs);
+}
+
+/*
+ * Log for warm data written on this CPU, so that writers on different CPUs
+ * do not all serialize on CURSEG_WARM_DATA's curseg_mutex.
+ */
+static inline int f3fs_warm_data_log(struct f3fs_sb_info *sbi)
+{
+	unsigned int nr = F3FS_OPTION(sbi).warm_data_logs;
+	unsigned int idx;
+
+	if (nr <= 1)
+		return CURSEG_WARM_DATA;
+
+	idx = raw_smp_processor_id() % nr;
+	return idx ? CURSEG_WARM_DATA_LOG_START + idx - 1 : CURSEG_WARM_DATA;
 }
 
 static inline bool has_curseg_enough_space(struct f3fs_sb_info *sbi,
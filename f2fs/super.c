@@ -161,6 +161,11 @@ enum {
 	Opt_nogc_merge,
 	Opt_discard_unit,
 	Opt_memory_mode,
+	Opt_range_lock,
+	Opt_range_lock_fair,
+	Opt_norange_lock_fair,
+	Opt_gc_max_workers,
+	Opt_warm_data_logs,
 	Opt_err,
 };
 
@@ -238,6 +243,11 @@ static match_table_t f3fs_tokens = {
 	{Opt_nogc_merge, "nogc_merge"},
 	{Opt_discard_unit, "discard_unit=%s"},
 	{Opt_memory_mode, "memory=%s"},
+	{Opt_range_lock, "range_lock=%s"},
+	{Opt_range_lock_fair, "range_lock_fair"},
+	{Opt_norange_lock_fair, "norange_lock_fair"},
+	{Opt_gc_max_workers, "gc_max_workers=%u"},
+	{Opt_warm_data_logs, "warm_data_logs=%u"},
 	{Opt_err, NULL},
 };
 
@@ -1256,6 +1266,48 @@ static int parse_options(struct super_block *sb, char *options, bool is_remount)
 			}
 			kfree(name);
 			break;
+		case Opt_range_lock:
+			name = match_strdup(&args[0]);
+			if (!name)
+				return -ENOMEM;
+			if (!strcmp(name, "list")) {
+				F3FS_OPTION(sbi).range_lock_mode =
+						RANGE_LOCK_LIST;
+			} else if (!strcmp(name, "skiplist")) {
+				F3FS_OPTION(sbi).range_lock_mode =
+						RANGE_LOCK_SKIPLIST;
+			} else {
+				kfree(name);
+				return -EINVAL;
+			}
+			kfree(name);
+			break;
+		case Opt_range_lock_fair:
+			set_opt(sbi, RANGE_LOCK_FAIR);
+			break;
+		case Opt_norange_lock_fair:
+			clear_opt(sbi, RANGE_LOCK_FAIR);
+			break;
+		case Opt_gc_max_workers:
+			if (args->from && match_int(args, &arg))
+				return -EINVAL;
+			if (arg < 1 || arg > MAX_GC_WORKER) {
+				f3fs_err(sbi, "gc_max_workers should be in range 1-%d",
+					 MAX_GC_WORKER);
+				return -EINVAL;
+			}
+			F3FS_OPTION(sbi).gc_max_workers = arg;
+			break;
+		case Opt_warm_data_logs:
+			if (args->from && match_int(args, &arg))
+				return -EINVAL;
+			if (arg < 1 || arg > MAX_WARM_DATA_LOGS) {
+				f3fs_err(sbi, "warm_data_logs should be in range 1-%d",
+					 MAX_WARM_DATA_LOGS);
+				return -EINVAL;
+			}
+			F3FS_OPTION(sbi).warm_data_logs = arg;
+			break;
 		default:
 			f3fs_err(sbi, "Unrecognized mount option \"%s\" or missing value",
 				 p);
@@ -1376,6 +1428,16 @@ static struct inode *f3fs_alloc_inode(struct super_block *sb)
 	INIT_LIST_HEAD(&fi->gdirty_list);
 	init_f3fs_rwsem3(&fi->i_gc_rwsem[READ]);
 	init_f3fs_rwsem3(&fi->i_gc_rwsem[WRITE]);
+	fi->i_gc_rwsem[READ].stat = F3FS_SB(sb)->rl_stat;
+	fi->i_gc_rwsem[WRITE].stat = F3FS_SB(sb)->rl_stat;
+	if (F3FS_OPTION(F3FS_SB(sb)).range_lock_mode == RANGE_LOCK_SKIPLIST) {
+		fi->i_gc_rwsem[READ].list_rl.skiplist = true;
+		fi->i_gc_rwsem[WRITE].list_rl.skiplist = true;
+	}
+	if (test_opt(F3FS_SB(sb), RANGE_LOCK_FAIR)) {
+		fi->i_gc_rwsem[READ].list_rl.fair = true;
+		fi->i_gc_rwsem[WRITE].list_rl.fair = true;
+	}
 	init_f3fs_rwsem(&fi->i_xattr_sem);
 
 	/* Will be used by directory only */
@@ -1505,12 +1567,15 @@ static void f3fs_dirty_inode(struct inode *inode, int flags)
 
 static void f3fs_free_inode(struct inode *inode)
 {
+	destroy_f3fs_rwsem3(&F3FS_I(inode)->i_gc_rwsem[READ]);
+	destroy_f3fs_rwsem3(&F3FS_I(inode)->i_gc_rwsem[WRITE]);
 	fscrypt_free_inode(inode);
 	kmem_cache_free(f3fs_inode_cachep, F3FS_I(inode));
 }
 
 static void destroy_percpu_info(struct f3fs_sb_info *sbi)
 {
+	free_percpu(sbi->rl_stat);
 	percpu_counter_destroy(&sbi->total_valid_inode_count);
 	percpu_counter_destroy(&sbi->rf_node_block_count);
 	percpu_counter_destroy(&sbi->alloc_valid_block_count);
@@ -2030,6 +2095,15 @@ static int f3fs_show_options(struct seq_file *seq, struct dentry *root)
 	else if (F3FS_OPTION(sbi).memory_mode == MEMORY_MODE_LOW)
 		seq_printf(seq, ",memory=%s", "low");
 
+	if (F3FS_OPTION(sbi).range_lock_mode == RANGE_LOCK_LIST)
+		seq_printf(seq, ",range_lock=%s", "list");
+	else if (F3FS_OPTION(sbi).range_lock_mode == RANGE_LOCK_SKIPLIST)
+		seq_printf(seq, ",range_lock=%s", "skiplist");
+	if (test_opt(sbi, RANGE_LOCK_FAIR))
+		seq_puts(seq, ",range_lock_fair");
+	seq_printf(seq, ",gc_max_workers=%u", F3FS_OPTION(sbi).gc_max_workers);
+	seq_printf(seq, ",warm_data_logs=%u", F3FS_OPTION(sbi).warm_data_logs);
+
 	return 0;
 }
 
@@ -2043,6 +2117,8 @@ static void default_options(struct f3fs_sb_info *sbi)
 
 	F3FS_OPTION(sbi).inline_xattr_size = DEFAULT_INLINE_XATTR_ADDRS;
 	F3FS_OPTION(sbi).alloc_mode = ALLOC_MODE_DEFAULT;
+	F3FS_OPTION(sbi).gc_max_workers = clamp(num_gc_thread, 1, MAX_GC_WORKER);
+	F3FS_OPTION(sbi).warm_data_logs = 1;
 	F3FS_OPTION(sbi).fsync_mode = FSYNC_MODE_POSIX;
 	F3FS_OPTION(sbi).s_resuid = make_kuid(&init_user_ns, F3FS_DEF_RESUID);
 	F3FS_OPTION(sbi).s_resgid = make_kgid(&init_user_ns, F3FS_DEF_RESGID);
@@ -2052,6 +2128,7 @@ static void default_options(struct f3fs_sb_info *sbi)
 	F3FS_OPTION(sbi).compress_mode = COMPR_MODE_FS;
 	F3FS_OPTION(sbi).bggc_mode = BGGC_MODE_ON;
 	F3FS_OPTION(sbi).memory_mode = MEMORY_MODE_NORMAL;
+	F3FS_OPTION(sbi).range_lock_mode = RANGE_LOCK_LIST;
 
 	sbi->sb->s_flags &= ~SB_INLINECRYPT;
 
@@ -2193,6 +2270,7 @@ static int f3fs_remount(struct super_block *sb, int *flags, char *data)
 	unsigned long old_sb_flags;
 	int err;
 	bool need_restart_gc = false, need_stop_gc = false;
+	bool need_resize_gc = false;
 	bool need_restart_ckpt = false, need_stop_ckpt = false;
 	bool need_restart_flush = false, need_stop_flush = false;
 	bool need_restart_discard = false, need_stop_discard = false;
@@ -2333,6 +2411,13 @@ static int f3fs_remount(struct super_block *sb, int *flags, char *data)
 		if (err)
 			goto restore_opts;
 		need_stop_gc = true;
+	} else if (sbi->gc_thread->nr_workers !=
+				F3FS_OPTION(sbi).gc_max_workers) {
+		f3fs_stop_gc_thread(sbi);
+		need_resize_gc = true;
+		err = f3fs_start_gc_thread(sbi);
+		if (err)
+			goto restore_gc;
 	}
 
 	if (*flags & SB_RDONLY) {
@@ -2436,7 +2521,11 @@ restore_ckpt:
 		f3fs_stop_ckpt_thread(sbi);
 	}
 restore_gc:
-	if (need_restart_gc) {
+	if (need_restart_gc || need_resize_gc) {
+		/* with as many workers as the old options had */
+		if (sbi->gc_thread)
+			f3fs_stop_gc_thread(sbi);
+		F3FS_OPTION(sbi).gc_max_workers = org_mount_opt.gc_max_workers;
 		if (f3fs_start_gc_thread(sbi))
 			f3fs_warn(sbi, "background gc thread has stopped");
 	} else if (need_stop_gc) {
@@ -3646,6 +3735,7 @@ static void init_sb_info(struct f3fs_sb_info *sbi)
 	init_f3fs_rwsem(&sbi->sb_lock);
 	init_f3fs_rwsem(&sbi->pin_sem);
   mutex_init(&sbi->gc_internal_cp);
+	atomic64_set(&sbi->gc_cp_gen, 0);
 }
 
 static int init_percpu_info(struct f3fs_sb_info *sbi)
@@ -3664,8 +3754,16 @@ static int init_percpu_info(struct f3fs_sb_info *sbi)
 								GFP_KERNEL);
 	if (err)
 		goto err_node_block;
+
+	sbi->rl_stat = alloc_percpu(struct rl_sem_stat);
+	if (!sbi->rl_stat) {
+		err = -ENOMEM;
+		goto err_valid_inode;
+	}
 	return 0;
 
+err_valid_inode:
+	percpu_counter_destroy(&sbi->total_valid_inode_count);
 err_node_block:
 	percpu_counter_destroy(&sbi->rf_node_block_count);
 err_valid_block:
@@ -4038,7 +4136,6 @@ try_onemore:
   atomic_set(&sbi->total_written_direct_request_blocks, 0);
   atomic_set(&sbi->gc_read_blocks, 0);
   atomic_set(&sbi->gc_written_blocks, 0);
-  sbi->num_gc_thread = num_gc_thread;
 
 	/* Load the checksum driver */
 	sbi->s_chksum_driver = crypto_alloc_shash("crc32", 0, 0);
@@ -4615,9 +4712,12 @@ static int __init init_f3fs_fs(void)
 	err = f3fs_create_garbage_collection_cache();
 	if (err)
 		goto free_extent_cache;
-	err = f3fs_init_sysfs();
+	err = f3fs_create_range_lock_cache();
 	if (err)
 		goto free_garbage_collection_cache;
+	err = f3fs_init_sysfs();
+	if (err)
+		goto free_range_lock_cache;
 	err = register_shrinker(&f3fs_shrinker_info, "f3fs-shrinker");
 	if (err)
 		goto free_sysfs;
@@ -4666,6 +4766,8 @@ free_shrinker:
 	unregister_shrinker(&f3fs_shrinker_info);
 free_sysfs:
 	f3fs_exit_sysfs();
+free_range_lock_cache:
+	f3fs_destroy_range_lock_cache();
 free_garbage_collection_cache:
 	f3fs_destroy_garbage_collection_cache();
 free_extent_cache:
@@ -4697,6 +4799,7 @@ static void __exit exit_f3fs_fs(void)
 	unregister_filesystem(&f3fs_fs_type);
 	unregister_shrinker(&f3fs_shrinker_info);
 	f3fs_exit_sysfs();
+	f3fs_destroy_range_lock_cache();
 	f3fs_destroy_garbage_collection_cache();
 	f3fs_destroy_extent_cache();
 	f3fs_destroy_recovery_cache();
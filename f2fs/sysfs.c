@@ -266,6 +266,107 @@ static ssize_t avg_vblocks_show(struct f3fs_attr *a,
 }
 #endif
 
+static ssize_t range_lock_pool_show(struct f3fs_attr *a,
+				struct f3fs_sb_info *sbi, char *buf)
+{
+	struct rl_pool_stat stat;
+
+	f3fs_range_lock_pool_stat(&stat);
+	return sysfs_emit(buf, "acquire: %lu, lnode: %lu, range: %lu, "
+			"slab: %lu, rcu_batch: %lu\n",
+			stat.acquire, stat.lnode_alloc, stat.range_alloc,
+			stat.slab_alloc, stat.rcu_batch);
+}
+
+static ssize_t range_lock_wait_show(struct f3fs_attr *a,
+				struct f3fs_sb_info *sbi, char *buf)
+{
+	struct rl_wait_stat stat;
+	unsigned long waits;
+
+	f3fs_range_lock_wait_stat(&stat);
+	waits = stat.spin + stat.sleep;
+	return sysfs_emit(buf, "spin: %lu, sleep: %lu, avg_ns: %llu, "
+			"max_ns: %llu\n",
+			stat.spin, stat.sleep,
+			waits ? div_u64(stat.wait_ns, waits) : 0,
+			stat.max_wait_ns);
+}
+
+static const char * const rl_site_name[RL_SITE_MAX] = {
+	[RL_SITE_OTHER]		= "other",
+	[RL_SITE_GC_PHASE3]	= "gc_phase3",
+	[RL_SITE_GC_PHASE4]	= "gc_phase4",
+	[RL_SITE_DIO_READ]	= "dio_read",
+	[RL_SITE_DIO_WRITE]	= "dio_write",
+	[RL_SITE_FALLOCATE]	= "fallocate",
+	[RL_SITE_TRUNCATE]	= "truncate",
+};
+
+static ssize_t range_lock_stat_show(struct f3fs_attr *a,
+				struct f3fs_sb_info *sbi, char *buf)
+{
+	struct rl_site_stat stat;
+	int len = 0;
+	int i;
+
+	len += sysfs_emit_at(buf, len, "%-10s %10s %10s %10s %10s %10s "
+			"%10s %10s %14s\n", "site", "sh_range", "sh_full",
+			"ex_range", "ex_full", "try_fail", "cas_retry",
+			"restart", "wait_ns");
+	for (i = 0; i < RL_SITE_MAX; i++) {
+		f3fs_range_lock_site_stat(sbi->rl_stat, i, &stat);
+		len += sysfs_emit_at(buf, len, "%-10s %10lu %10lu %10lu %10lu "
+				"%10lu %10lu %10lu %14llu\n", rl_site_name[i],
+				stat.shared_range, stat.shared_full,
+				stat.excl_range, stat.excl_full,
+				stat.try_fail, stat.cas_retry,
+				stat.restart, stat.wait_ns);
+	}
+	return len;
+}
+
+static ssize_t gc_worker_util_show(struct f3fs_attr *a,
+				struct f3fs_sb_info *sbi, char *buf)
+{
+	struct f3fs_gc_kthread *gc_th = sbi->gc_thread;
+	u64 elapsed;
+	int len = 0;
+	int i;
+
+	if (!gc_th)
+		return sysfs_emit(buf, "gc thread not running\n");
+
+	elapsed = ktime_get_ns() - gc_th->start_ns;
+	len += sysfs_emit_at(buf, len, "active: %u, max: %u, started: %u, "
+			"worker_rate: %u\n", gc_th->nr_active,
+			gc_th->max_workers, gc_th->nr_workers,
+			gc_th->worker_rate);
+	len += sysfs_emit_at(buf, len, "%-6s %10s %14s %5s\n",
+			"worker", "runs", "busy_ms", "util");
+	for (i = 0; i < gc_th->nr_workers; i++) {
+		struct worker_arg *w = &gc_th->worker_args[i];
+
+		len += sysfs_emit_at(buf, len, "%-6d %10lu %14llu %4llu%%\n",
+				i, w->runs, div_u64(w->busy_ns, NSEC_PER_MSEC),
+				elapsed ? div64_u64(w->busy_ns * 100, elapsed) : 0);
+	}
+	return len;
+}
+
+static ssize_t gc_age_stat_show(struct f3fs_attr *a,
+				struct f3fs_sb_info *sbi, char *buf)
+{
+	int len = 0;
+	int i;
+
+	for (i = 0; i < GC_AGE_CLASSES; i++)
+		len += sysfs_emit_at(buf, len, "%s%ld", i ? " " : "",
+				atomic_long_read(&sbi->gc_age_victims[i]));
+	len += sysfs_emit_at(buf, len, "\n");
+	return len;
+}
+
 static ssize_t main_blkaddr_show(struct f3fs_attr *a,
 				struct f3fs_sb_info *sbi, char *buf)
 {
@@ -488,6 +589,11 @@ out:
 			return -EINVAL;
 	}
 
+	if (!strcmp(a->attr.name, "gc_max_workers")) {
+		if (t == 0 || t > sbi->gc_thread->nr_workers)
+			return -EINVAL;
+	}
+
 	if (!strcmp(a->attr.name, "trim_sections"))
 		return -EINVAL;
 
@@ -781,6 +887,7 @@ F3FS_RW_ATTR(GC_THREAD, f3fs_gc_kthread, gc_urgent_sleep_time,
 F3FS_RW_ATTR(GC_THREAD, f3fs_gc_kthread, gc_min_sleep_time, min_sleep_time);
 F3FS_RW_ATTR(GC_THREAD, f3fs_gc_kthread, gc_max_sleep_time, max_sleep_time);
 F3FS_RW_ATTR(GC_THREAD, f3fs_gc_kthread, gc_no_gc_sleep_time, no_gc_sleep_time);
+F3FS_RW_ATTR(GC_THREAD, f3fs_gc_kthread, gc_max_workers, max_workers);
 F3FS_RW_ATTR(F3FS_SBI, f3fs_sb_info, gc_idle, gc_mode);
 F3FS_RW_ATTR(F3FS_SBI, f3fs_sb_info, gc_urgent, gc_mode);
 F3FS_RW_ATTR(SM_INFO, f3fs_sm_info, reclaim_segments, rec_prefree_segments);
@@ -819,6 +926,7 @@ F3FS_RW_ATTR(F3FS_SBI, f3fs_sb_info, iostat_period_ms, iostat_period_ms);
 F3FS_RW_ATTR(F3FS_SBI, f3fs_sb_info, readdir_ra, readdir_ra);
 F3FS_RW_ATTR(F3FS_SBI, f3fs_sb_info, max_io_bytes, max_io_bytes);
 F3FS_RW_ATTR(F3FS_SBI, f3fs_sb_info, gc_pin_file_thresh, gc_pin_file_threshold);
+F3FS_RW_ATTR(F3FS_SBI, f3fs_sb_info, gc_rwsem_bypass, gc_rwsem_bypass);
 F3FS_RW_ATTR(F3FS_SBI, f3fs_super_block, extension_list, extension_list);
 #ifdef CONFIG_F3FS_FAULT_INJECTION
 F3FS_RW_ATTR(FAULT_INFO_RATE, f3fs_fault_info, inject_rate, inject_rate);
@@ -839,6 +947,11 @@ F3FS_GENERAL_RO_ATTR(encoding);
 F3FS_GENERAL_RO_ATTR(mounted_time_sec);
 F3FS_GENERAL_RO_ATTR(main_blkaddr);
 F3FS_GENERAL_RO_ATTR(pending_discard);
+F3FS_GENERAL_RO_ATTR(range_lock_pool);
+F3FS_GENERAL_RO_ATTR(range_lock_wait);
+F3FS_GENERAL_RO_ATTR(range_lock_stat);
+F3FS_GENERAL_RO_ATTR(gc_worker_util);
+F3FS_GENERAL_RO_ATTR(gc_age_stat);
 #ifdef CONFIG_F3FS_STAT_FS
 F3FS_STAT_ATTR(STAT_INFO, f3fs_stat_info, cp_foreground_calls, cp_count);
 F3FS_STAT_ATTR(STAT_INFO, f3fs_stat_info, cp_background_calls, bg_cp_count);
@@ -909,6 +1022,7 @@ static struct attribute *f3fs_attrs[] = {
 	ATTR_LIST(gc_min_sleep_time),
 	ATTR_LIST(gc_max_sleep_time),
 	ATTR_LIST(gc_no_gc_sleep_time),
+	ATTR_LIST(gc_max_workers),
 	ATTR_LIST(gc_idle),
 	ATTR_LIST(gc_urgent),
 	ATTR_LIST(reclaim_segments),
@@ -946,6 +1060,7 @@ static struct attribute *f3fs_attrs[] = {
 	ATTR_LIST(readdir_ra),
 	ATTR_LIST(max_io_bytes),
 	ATTR_LIST(gc_pin_file_thresh),
+	ATTR_LIST(gc_rwsem_bypass),
 	ATTR_LIST(extension_list),
 #ifdef CONFIG_F3FS_FAULT_INJECTION
 	ATTR_LIST(inject_rate),
@@ -965,6 +1080,11 @@ static struct attribute *f3fs_attrs[] = {
 	ATTR_LIST(current_reserved_blocks),
 	ATTR_LIST(encoding),
 	ATTR_LIST(mounted_time_sec),
+	ATTR_LIST(range_lock_pool),
+	ATTR_LIST(range_lock_wait),
+	ATTR_LIST(range_lock_stat),
+	ATTR_LIST(gc_worker_util),
+	ATTR_LIST(gc_age_stat),
 #ifdef CONFIG_F3FS_STAT_FS
 	ATTR_LIST(cp_foreground_calls),
 	ATTR_LIST(cp_background_calls),
@@ -1,95 +1,602 @@
+/*
+ * Userspace correctness test and benchmark for the range locks.
+ *
+ * Built by "make lock_test" against the IN_KERNEL == 0 / IN_KERNEL2 == 0
+ * variants of range_lock.h and lockfree_list.c. lock_test uses the hashed
+ * lock-free list, lock_test_unhashed the single sorted list.
+ *
+ *   ./lock_test -T                  run the sleep based smoke test
+ *   ./lock_test -l rwsem3 -t 1,8,32 -r 90 -s 16 -f 1 -z 0.8 -d 5
+ *   ./lock_test_unhashed -l rwsem3,rwsem3skip -p 4096 -t 8
+ *   ./lock_test -r 95 -f 2 -s 64 -c 2000 -t 8 -F
+ *
+ * Every benchmark run prints one JSON line with throughput and acquire
+ * latency percentiles.
+ */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <assert.h>
 #include <pthread.h>
+#include <math.h>
+#include <time.h>
 
-#define VER (2)
-
-#if VER==1
 #include "range_lock.h"
+#include "lockfree_list.h"
 
-void* test0_thread0(void* data) {
-  struct f3fs_rwsem2* lock = (struct f3fs_rwsem2*)data;
-  bool ret = false;
+#define MAX_THREADS (1024)
+#define FULL_RANGE (0xFFFFFFFFU)
 
-  f3fs_down_range(lock, 0, 0xFFFFFFFF, true);
-  sleep(1);
-  f3fs_up_range(lock, 0, 0xFFFFFFFF, true);
-  sleep(0.5);
-  assert(!f3fs_down_range_trylock(lock, 0,1, false));
-  assert(f3fs_down_range_trylock(lock, 1, 0xFFFFFFFE, false));
-  sleep(1);
-  f3fs_up_range(lock, 1, 0xFFFFFFFE, false);
+enum lock_type {
+  LOCK_RWSEM2,    /* rbtree/GList range lock, range_lock.h */
+  LOCK_RWSEM3,    /* lock-free list range lock, lockfree_list.c */
+  LOCK_RWSEM3_SKIP, /* the same with its writers indexed by a skip list */
+  LOCK_PTHREAD,   /* plain pthread rwlock, ignores ranges */
+};
+
+struct bench_config {
+  enum lock_type type;
+  unsigned int threads;
+  unsigned int duration;      /* seconds */
+  unsigned int read_pct;      /* shared acquisitions, in percent */
+  unsigned int full_pct;      /* whole-file acquisitions, in percent */
+  unsigned int try_pct;       /* trylock acquisitions, in percent */
+  unsigned int range_size;    /* blocks per ranged acquisition */
+  unsigned int file_blocks;   /* blocks the ranges are drawn from */
+  unsigned int hold_spins;    /* busy loop inside the critical section */
+  unsigned int pinned;        /* writer ranges held below the workload */
+  bool grow;                  /* resize the rwsem3 tables while running */
+  bool fair;                  /* rwsem3 readers yield to waiting writers */
+  double skew;                /* 0 is uniform, towards 1 hits low blocks */
+  bool verify;                /* check that exclusive ranges never overlap */
+};
+
+/*
+ * Log-linear latency histogram: 64 power-of-two groups of 16 linear
+ * sub-buckets, about 6% relative error, no per-sample storage.
+ */
+#define HIST_SUB_BITS (4)
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct histogram {
+  uint64_t count[HIST_BUCKETS];
+};
+
+static unsigned int hist_index(uint64_t ns) {
+  unsigned int msb;
+
+  if (ns < HIST_SUB) {
+    return ns;
+  }
+  msb = 63 - __builtin_clzll(ns);
+  return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+    ((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
 }
 
-void* test0_thread1(void* data) {
-  struct f3fs_rwsem2* lock = (struct f3fs_rwsem2*)data;
-  sleep(0.5);
-  assert(false == f3fs_down_range_trylock(lock, 0, 0x1, true));
-  f3fs_down_range(lock, 0, 0x1, true);
-  sleep(1);
-  assert(f3fs_down_range_trylock(lock, 1, 0xFFFFFFFE, false));
-  f3fs_up_range(lock, 1, 0xFFFFFFFE, false);
-  f3fs_up_range(lock, 0, 0x1, true);
+static uint64_t hist_value(unsigned int idx) {
+  unsigned int group = idx / HIST_SUB;
+  unsigned int sub = idx % HIST_SUB;
+
+  if (group == 0) {
+    return sub;
+  }
+  return (uint64_t)(HIST_SUB + sub) << (group - 1);
 }
-#else
-#include "lockfree_list.h"
 
-void* test0_thread0(void* data) {
+static uint64_t hist_percentile(struct histogram* h, uint64_t total,
+    double pct) {
+  uint64_t target = (uint64_t)ceil(total * pct / 100.0);
+  uint64_t seen = 0;
+
+  for (unsigned int i = 0 ; i < HIST_BUCKETS ; i++) {
+    seen += h->count[i];
+    if (seen >= target && seen) {
+      return hist_value(i);
+    }
+  }
+  return 0;
+}
+
+struct bench_lock {
+  struct f3fs_rwsem2 rwsem2;
+  struct f3fs_rwsem3 rwsem3;
+  pthread_rwlock_t rwlock;
+  /* -V: writers per block, readers per block */
+  volatile int* writers;
+  volatile int* readers;
+};
+
+struct bench_thread {
+  pthread_t tid;
+  struct bench_config* cfg;
+  struct bench_lock* lock;
+  uint64_t rng;
+  uint64_t ops;
+  uint64_t try_failed;
+  uint64_t violations;
+  uint64_t writes;
+  struct histogram hist;
+  struct histogram hist_w;    /* exclusive acquisitions only */
+} __attribute__((aligned(64)));
+
+static volatile bool bench_stop;
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t next_rand(uint64_t* state) {
+  uint64_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+static inline double next_unit(uint64_t* state) {
+  return (next_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static inline bool roll(uint64_t* state, unsigned int pct) {
+  return next_rand(state) % 100 < pct;
+}
+
+/* u^(1 / (1 - skew)) concentrates picks near block 0 as skew grows. */
+static unsigned int pick_start(struct bench_thread* t) {
+  struct bench_config* cfg = t->cfg;
+  unsigned int span = cfg->file_blocks - cfg->range_size + 1;
+  double u = next_unit(&t->rng);
+
+  if (cfg->skew > 0) {
+    u = pow(u, 1.0 / (1.0 - cfg->skew));
+  }
+  return (unsigned int)(u * span) % span;
+}
+
+static void* lock_acquire(struct bench_thread* t, unsigned int start,
+    unsigned int size, bool writer, bool try) {
+  struct bench_lock* lock = t->lock;
+  unsigned long long end = (unsigned long long)start + size;
+
+  switch (t->cfg->type) {
+  case LOCK_RWSEM2:
+    if (try) {
+      return f3fs_down_range_trylock(&lock->rwsem2, start, size, writer) ?
+        (void*)lock : NULL;
+    }
+    f3fs_down_range(&lock->rwsem2, start, size, writer);
+    return lock;
+  case LOCK_RWSEM3:
+  case LOCK_RWSEM3_SKIP:
+    if (end > MAX_SIZE) {
+      end = MAX_SIZE;
+    }
+    if (try) {
+      return RWSemTryAcquire(&lock->rwsem3, start, end, writer, RL_SITE_OTHER);
+    }
+    return RWSemAcquire(&lock->rwsem3, start, end, writer, RL_SITE_OTHER);
+  case LOCK_PTHREAD:
+    if (try) {
+      int ret = writer ? pthread_rwlock_trywrlock(&lock->rwlock) :
+        pthread_rwlock_tryrdlock(&lock->rwlock);
+      return ret ? NULL : lock;
+    }
+    if (writer) {
+      pthread_rwlock_wrlock(&lock->rwlock);
+    } else {
+      pthread_rwlock_rdlock(&lock->rwlock);
+    }
+    return lock;
+  }
+  return NULL;
+}
+
+static void lock_release(struct bench_thread* t, void* token,
+    unsigned int start, unsigned int size, bool writer) {
+  switch (t->cfg->type) {
+  case LOCK_RWSEM2:
+    f3fs_up_range(&t->lock->rwsem2, start, size, writer);
+    break;
+  case LOCK_RWSEM3:
+  case LOCK_RWSEM3_SKIP:
+    RWSemRelease((struct RangeLock*)token);
+    break;
+  case LOCK_PTHREAD:
+    pthread_rwlock_unlock(&t->lock->rwlock);
+    break;
+  }
+}
+
+static void verify_enter(struct bench_thread* t, unsigned int start,
+    unsigned int end, bool writer) {
+  for (unsigned int b = start ; b < end ; b++) {
+    if (writer) {
+      if (__sync_fetch_and_add(&t->lock->writers[b], 1) ||
+          t->lock->readers[b]) {
+        t->violations++;
+      }
+    } else {
+      __sync_fetch_and_add(&t->lock->readers[b], 1);
+      if (t->lock->writers[b]) {
+        t->violations++;
+      }
+    }
+  }
+}
+
+static void verify_exit(struct bench_thread* t, unsigned int start,
+    unsigned int end, bool writer) {
+  for (unsigned int b = start ; b < end ; b++) {
+    __sync_fetch_and_sub(writer ? &t->lock->writers[b] :
+        &t->lock->readers[b], 1);
+  }
+}
+
+static void* bench_worker(void* data) {
+  struct bench_thread* t = (struct bench_thread*)data;
+  struct bench_config* cfg = t->cfg;
+
+  while (!bench_stop) {
+    bool writer = !roll(&t->rng, cfg->read_pct);
+    bool full = roll(&t->rng, cfg->full_pct);
+    bool try = roll(&t->rng, cfg->try_pct);
+    unsigned int base = cfg->pinned * 2;
+    unsigned int start = base + (full ? 0 : pick_start(t));
+    unsigned int size = full ? FULL_RANGE - base : cfg->range_size;
+    unsigned int vend = full ? base + cfg->file_blocks : start + size;
+    uint64_t begin = now_ns();
+    uint64_t lat;
+    void* token;
+
+    // like an i_size update that may land while others hold ranges
+    if (cfg->grow && cfg->type != LOCK_RWSEM2 && cfg->type != LOCK_PTHREAD) {
+      resize_f3fs_rwsem3(&t->lock->rwsem3, vend);
+    }
+    token = lock_acquire(t, start, size, writer, try);
+
+    if (!token) {
+      t->try_failed++;
+      continue;
+    }
+    lat = now_ns() - begin;
+    t->hist.count[hist_index(lat)]++;
+    if (writer) {
+      t->hist_w.count[hist_index(lat)]++;
+      t->writes++;
+    }
+
+    if (cfg->verify) {
+      verify_enter(t, start, vend, writer);
+    }
+    for (volatile unsigned int i = 0 ; i < cfg->hold_spins ; i++) {
+    }
+    if (cfg->verify) {
+      verify_exit(t, start, vend, writer);
+    }
+
+    lock_release(t, token, start, size, writer);
+    t->ops++;
+  }
+  return NULL;
+}
+
+static const char* lock_name(enum lock_type type) {
+  switch (type) {
+  case LOCK_RWSEM2:
+    return "rwsem2";
+  case LOCK_RWSEM3:
+    return HASH_MODE ? "rwsem3-hash" : "rwsem3-list";
+  case LOCK_RWSEM3_SKIP:
+    return HASH_MODE ? "rwsem3-hash-skip" : "rwsem3-list-skip";
+  case LOCK_PTHREAD:
+    return "pthread";
+  }
+  return "unknown";
+}
+
+static int run_bench(struct bench_config* cfg) {
+  static struct bench_thread threads[MAX_THREADS];
+  struct bench_lock lock;
+  struct histogram total = { { 0 } };
+  struct histogram total_w = { { 0 } };
+  struct bench_thread pin = { .cfg = cfg, .lock = &lock };
+  void** pinned = NULL;
+  uint64_t ops = 0, writes = 0, try_failed = 0, violations = 0;
+  uint64_t begin, elapsed;
+
+  memset(&lock, 0, sizeof(lock));
+  init_f3fs_rwsem2(&lock.rwsem2);
+  init_f3fs_rwsem3(&lock.rwsem3);
+  lock.rwsem3.list_rl.skiplist = cfg->type == LOCK_RWSEM3_SKIP;
+  lock.rwsem3.list_rl.fair = cfg->fair;
+  if (!cfg->grow) {
+    resize_f3fs_rwsem3(&lock.rwsem3, cfg->pinned * 2 + cfg->file_blocks);
+  }
+  pthread_rwlock_init(&lock.rwlock, NULL);
+  if (cfg->verify) {
+    lock.writers = calloc(cfg->pinned * 2 + cfg->file_blocks, sizeof(int));
+    lock.readers = calloc(cfg->pinned * 2 + cfg->file_blocks, sizeof(int));
+  }
+
+  // outstanding ranges every acquisition has to get past
+  if (cfg->pinned && cfg->type != LOCK_PTHREAD) {
+    pinned = calloc(cfg->pinned, sizeof(void*));
+    for (unsigned int i = 0 ; i < cfg->pinned ; i++) {
+      pinned[i] = lock_acquire(&pin, i * 2, 1, true, false);
+    }
+  }
+
+  bench_stop = false;
+  memset(threads, 0, sizeof(threads[0]) * cfg->threads);
+  begin = now_ns();
+  for (unsigned int i = 0 ; i < cfg->threads ; i++) {
+    threads[i].cfg = cfg;
+    threads[i].lock = &lock;
+    threads[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+    pthread_create(&threads[i].tid, NULL, bench_worker, &threads[i]);
+  }
+  sleep(cfg->duration);
+  bench_stop = true;
+  for (unsigned int i = 0 ; i < cfg->threads ; i++) {
+    pthread_join(threads[i].tid, NULL);
+  }
+  elapsed = now_ns() - begin;
+
+  if (pinned) {
+    for (unsigned int i = 0 ; i < cfg->pinned ; i++) {
+      lock_release(&pin, pinned[i], i * 2, 1, true);
+    }
+    free(pinned);
+  }
+
+  for (unsigned int i = 0 ; i < cfg->threads ; i++) {
+    ops += threads[i].ops;
+    try_failed += threads[i].try_failed;
+    violations += threads[i].violations;
+    writes += threads[i].writes;
+    for (unsigned int b = 0 ; b < HIST_BUCKETS ; b++) {
+      total.count[b] += threads[i].hist.count[b];
+      total_w.count[b] += threads[i].hist_w.count[b];
+    }
+  }
+
+  printf("{\"lock\": \"%s\", \"threads\": %u, \"duration_s\": %.3f, "
+      "\"read_pct\": %u, \"full_pct\": %u, \"try_pct\": %u, "
+      "\"range_size\": %u, \"file_blocks\": %u, \"skew\": %.2f, "
+      "\"hold_spins\": %u, \"pinned\": %u, \"grow\": %s, "
+      "\"fair\": %s, \"ops\": %llu, \"ops_per_sec\": %.0f, "
+      "\"try_failed\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+      "\"p999_ns\": %llu, \"write_p99_ns\": %llu, "
+      "\"write_p999_ns\": %llu, \"violations\": %llu}\n",
+      lock_name(cfg->type), cfg->threads, elapsed / 1e9,
+      cfg->read_pct, cfg->full_pct, cfg->try_pct,
+      cfg->range_size, cfg->file_blocks, cfg->skew,
+      cfg->hold_spins, cfg->pinned, cfg->grow ? "true" : "false",
+      cfg->fair ? "true" : "false", (unsigned long long)ops, ops / (elapsed / 1e9),
+      (unsigned long long)try_failed,
+      (unsigned long long)hist_percentile(&total, ops, 50),
+      (unsigned long long)hist_percentile(&total, ops, 99),
+      (unsigned long long)hist_percentile(&total, ops, 99.9),
+      (unsigned long long)hist_percentile(&total_w, writes, 99),
+      (unsigned long long)hist_percentile(&total_w, writes, 99.9),
+      (unsigned long long)violations);
+  fflush(stdout);
+
+  destroy_f3fs_rwsem3(&lock.rwsem3);
+  pthread_rwlock_destroy(&lock.rwlock);
+  free((void*)lock.writers);
+  free((void*)lock.readers);
+  return violations ? 1 : 0;
+}
+
+/* The original sleep based scenario against f3fs_rwsem3 */
+static void* test0_thread0(void* data) {
   struct f3fs_rwsem3* lock = (struct f3fs_rwsem3*)data;
-  bool ret = false;
   struct RangeLock* range = NULL;
 
-  range = RWRangeAcquire(&lock->list_rl,0, 0xFFFFFFFF, true);
+  range = RWRangeAcquire(&lock->list_rl, 0, MAX_SIZE, true);
   assert(range);
   sleep(1);
   MutexRangeRelease(range);
-  sleep(0.5);
+  usleep(500000);
   range = RWRangeTryAcquire(&lock->list_rl, 0, 1, false);
   assert(!range);
-  range = RWRangeTryAcquire(&lock->list_rl, 1, 0xFFFFFFFF, false);
+  range = RWRangeTryAcquire(&lock->list_rl, 1, MAX_SIZE, false);
   assert(range);
   sleep(1);
   MutexRangeRelease(range);
+  return NULL;
 }
 
-void* test0_thread1(void* data) {
+static void* test0_thread1(void* data) {
   struct f3fs_rwsem3* lock = (struct f3fs_rwsem3*)data;
   struct RangeLock* ret = NULL;
   struct RangeLock* ret2 = NULL;
-  sleep(0.5);
+
+  usleep(500000);
   ret = RWRangeTryAcquire(&lock->list_rl, 0, 1, true);
   assert(!ret);
   ret = RWRangeAcquire(&lock->list_rl, 0, 1, true);
   sleep(1);
-  ret2 = RWRangeTryAcquire(&lock->list_rl, 1, 0xFFFFFFFF, false);
+  ret2 = RWRangeTryAcquire(&lock->list_rl, 1, MAX_SIZE, false);
   assert(ret2);
   MutexRangeRelease(ret2);
   MutexRangeRelease(ret);
+  return NULL;
+}
+
+/* A batch around a held block gets everything but that block */
+static void test_batch(struct f3fs_rwsem3* lock) {
+  const unsigned int blocks[] = {3, 4, 5, 6, 9};
+  const bool expect[] = {true, true, false, true, true};
+  struct RangeLock* ranges[5];
+  bool held[5];
+  struct RangeLock* range;
+  int i;
+
+  range = RWSemAcquire(lock, 5, 6, false, RL_SITE_OTHER);
+  assert(RWSemTryAcquireBatch(lock, blocks, 5, true, RL_SITE_GC_PHASE4,
+      ranges, held) == 4);
+  for (i = 0; i < 5; i++) {
+    assert(held[i] == expect[i]);
+  }
+  assert(!RWSemTryAcquire(lock, 4, 5, false, RL_SITE_OTHER));
+  RWSemReleaseBatch(ranges, 5);
+  RWSemRelease(range);
+
+  assert(RWSemTryAcquireBatch(lock, blocks, 5, true, RL_SITE_GC_PHASE4,
+      ranges, held) == 5);
+  assert(ranges[0] && !ranges[1] && !ranges[3] && ranges[4]);
+  RWSemReleaseBatch(ranges, 5);
 }
-#endif
 
-int main(void) {
+static int run_smoke_test(void) {
   pthread_t pthread[2] = {0,};
-#if VER==1
-  struct f3fs_rwsem2 lock;
-  init_f3fs_rwsem2(&lock);
-#else
   struct f3fs_rwsem3 lock;
-  init_f3fs_rwsem3(&lock);
-#endif
 
+  init_f3fs_rwsem3(&lock);
   printf("start\n");
 
-  // test0
   pthread_create(&pthread[0], NULL, test0_thread0, &lock);
   pthread_create(&pthread[1], NULL, test0_thread1, &lock);
 
   pthread_join(pthread[0], NULL);
   pthread_join(pthread[1], NULL);
+  test_batch(&lock);
+  destroy_f3fs_rwsem3(&lock);
   printf("end\n");
-
   return 0;
 }
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+    "usage: %s [-T] [-l rwsem2|rwsem3|rwsem3skip|pthread[,...]]\n"
+    "          [-t threads[,...]] [-d seconds] [-r read%%] [-f full-file%%]\n"
+    "          [-y trylock%%] [-s range blocks] [-n file blocks]\n"
+    "          [-z skew 0..1)] [-c hold spins] [-p pinned ranges] [-g]\n"
+    "          [-F] [-V]\n",
+    prog);
+}
+
+static bool parse_locks(char* arg, enum lock_type* types, int* nr) {
+  for (char* tok = strtok(arg, ",") ; tok ; tok = strtok(NULL, ",")) {
+    if (!strcmp(tok, "rwsem2")) {
+      types[(*nr)++] = LOCK_RWSEM2;
+    } else if (!strcmp(tok, "rwsem3")) {
+      types[(*nr)++] = LOCK_RWSEM3;
+    } else if (!strcmp(tok, "rwsem3skip")) {
+      types[(*nr)++] = LOCK_RWSEM3_SKIP;
+    } else if (!strcmp(tok, "pthread")) {
+      types[(*nr)++] = LOCK_PTHREAD;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  struct bench_config cfg = {
+    .type = LOCK_RWSEM3,
+    .duration = 3,
+    .read_pct = 50,
+    .range_size = 1,
+    .file_blocks = 1 << 20,
+  };
+  enum lock_type types[4];
+  unsigned int thread_counts[64];
+  int nr_types = 0, nr_threads = 0;
+  int opt, ret = 0;
+
+  while ((opt = getopt(argc, argv, "Tl:t:d:r:f:y:s:n:z:c:p:gFVh")) != -1) {
+    switch (opt) {
+    case 'T':
+      return run_smoke_test();
+    case 'l':
+      if (!parse_locks(optarg, types, &nr_types)) {
+        usage(argv[0]);
+        return 2;
+      }
+      break;
+    case 't':
+      for (char* tok = strtok(optarg, ",") ; tok && nr_threads < 64 ;
+          tok = strtok(NULL, ",")) {
+        thread_counts[nr_threads++] = atoi(tok);
+      }
+      break;
+    case 'd':
+      cfg.duration = atoi(optarg);
+      break;
+    case 'r':
+      cfg.read_pct = atoi(optarg);
+      break;
+    case 'f':
+      cfg.full_pct = atoi(optarg);
+      break;
+    case 'y':
+      cfg.try_pct = atoi(optarg);
+      break;
+    case 's':
+      cfg.range_size = atoi(optarg);
+      break;
+    case 'n':
+      cfg.file_blocks = atoi(optarg);
+      break;
+    case 'z':
+      cfg.skew = atof(optarg);
+      break;
+    case 'c':
+      cfg.hold_spins = atoi(optarg);
+      break;
+    case 'p':
+      cfg.pinned = atoi(optarg);
+      break;
+    case 'g':
+      cfg.grow = true;
+      break;
+    case 'F':
+      cfg.fair = true;
+      break;
+    case 'V':
+      cfg.verify = true;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+
+  if (!nr_types) {
+    types[nr_types++] = LOCK_RWSEM3;
+  }
+  if (!nr_threads) {
+    thread_counts[nr_threads++] = 4;
+  }
+  if (!cfg.range_size || cfg.range_size > cfg.file_blocks ||
+      cfg.skew < 0 || cfg.skew >= 1) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  for (int i = 0 ; i < nr_types ; i++) {
+    for (int j = 0 ; j < nr_threads ; j++) {
+      cfg.type = types[i];
+      cfg.threads = thread_counts[j];
+      if (!cfg.threads || cfg.threads > MAX_THREADS) {
+        usage(argv[0]);
+        return 2;
+      }
+      ret |= run_bench(&cfg);
+    }
+  }
+  return ret;
+}
@@ -210,7 +210,8 @@ cleanup:
 	 * from re-instantiating cached pages we are truncating (since unlike
 	 * normal file accesses, garbage collection isn't limited by i_size).
 	 */
-	range = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE]);
+	range = f3fs_down_write3(&F3FS_I(inode)->i_gc_rwsem[WRITE],
+				RL_SITE_OTHER);
 	truncate_inode_pages(inode->i_mapping, inode->i_size);
 	err2 = f3fs_truncate(inode);
 	if (err2) {